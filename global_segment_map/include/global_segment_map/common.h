@@ -21,6 +21,8 @@ typedef uint8_t SemanticLabel;
 typedef std::vector<Label> Labels;
 typedef std::vector<SemanticLabel> SemanticLabels;
 typedef std::vector<InstanceLabel> InstanceLabels;
+// Number of raw points a point stands for after downsampling.
+typedef std::vector<uint32_t> PointCounts;
 
 typedef std::map<Label, int> LMap;
 typedef std::map<Label, int>::iterator LMapIt;
@@ -57,6 +59,20 @@ struct PointSurfelSemanticInstance {
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 } EIGEN_ALIGN16;
 
+// Frame pointcloud type with semantic instance segmentation. The label field
+// holds the segment of the point, as several segments of a frame can share
+// the same instance and semantic label pair.
+struct PointSurfelSemanticInstanceLabel {
+  PCL_ADD_POINT4D;
+  PCL_ADD_NORMAL4D;
+  PCL_ADD_RGB;
+  uint32_t label;
+  uint8_t instance_label;
+  SemanticLabel semantic_label;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+} EIGEN_ALIGN16;
+
 // Map pointcloud type.
 struct PointTSDFLabel {
   PCL_ADD_POINT4D;
@@ -75,6 +91,7 @@ struct PointTSDFLabel {
 typedef pcl::PointXYZRGB PointType;
 typedef PointSurfelLabel PointLabelType;
 typedef PointSurfelSemanticInstance PointSemanticInstanceType;
+typedef PointSurfelSemanticInstanceLabel PointSemanticInstanceLabelType;
 typedef PointTSDFLabel PointMapType;
 
 }  // namespace voxblox
@@ -90,6 +107,14 @@ POINT_CLOUD_REGISTER_POINT_STRUCT(
         std::uint8_t, instance_label,
         instance_label)(voxblox::SemanticLabel, semantic_label, semantic_label))
 
+POINT_CLOUD_REGISTER_POINT_STRUCT(
+    voxblox::PointSemanticInstanceLabelType,
+    (float, x, x)(float, y, y)(float, z, z)(float, rgb, rgb)(
+        std::uint32_t, label, label)(std::uint8_t, instance_label,
+                                     instance_label)(voxblox::SemanticLabel,
+                                                     semantic_label,
+                                                     semantic_label))
+
 POINT_CLOUD_REGISTER_POINT_STRUCT(
     voxblox::PointTSDFLabel,
     (float, x, x)(float, y, y)(float, z, z)(float, distance, distance)(
@@ -0,0 +1,138 @@
+#ifndef GLOBAL_SEGMENT_MAP_LABEL_CANDIDATE_MATRIX_H_
+#define GLOBAL_SEGMENT_MAP_LABEL_CANDIDATE_MATRIX_H_
+
+#include <bitset>
+#include <cstdint>
+#include <limits>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+#include "global_segment_map/common.h"
+#include "global_segment_map/segment.h"
+
+namespace voxblox {
+
+// Label candidates of the segments of a frame while their labels are
+// decided. The raw point count of every label and segment pair is kept in a
+// flat hash map, and the pair with the highest count is found with a
+// max-heap. Changing a count pushes a new heap entry, entries that no longer
+// match their pair, or whose label or segment got assigned, are skipped when
+// they reach the top of the heap.
+class LabelCandidateMatrix {
+ public:
+  static constexpr size_t kNumLabels =
+      static_cast<size_t>(std::numeric_limits<Label>::max()) + 1u;
+
+  // Indexes the segments and copies their candidate counts from nested
+  // label and segment maps.
+  template <typename LabelCandidatesType>
+  LabelCandidateMatrix(const std::vector<Segment*>& segments,
+                       const LabelCandidatesType& candidates)
+      : LabelCandidateMatrix(segments) {
+    for (const auto& label_candidates : candidates) {
+      for (const auto& segment_count : label_candidates.second) {
+        setCount(label_candidates.first,
+                 getSegmentIndex(segment_count.first), segment_count.second);
+      }
+    }
+  }
+
+  inline size_t getNumSegments() const { return segments_.size(); }
+  inline Segment* getSegment(const size_t segment_idx) const {
+    return segments_[segment_idx];
+  }
+  size_t getSegmentIndex(Segment* segment) const;
+
+  // Count of the pair, 0 if it has none.
+  size_t getCount(const Label label, const size_t segment_idx) const;
+
+  // Sets the count of the pair, a count of 0 removes it.
+  void setCount(const Label label, const size_t segment_idx,
+                const size_t count);
+
+  // Removes all the pairs of the segment except the one with keep_label.
+  void eraseSegment(const size_t segment_idx, const Label keep_label);
+
+  // Indices of the segments with a count for the label, in no particular
+  // order.
+  void getLabelSegments(const Label label,
+                        std::vector<size_t>* segment_indices) const;
+
+  // Pops the label and segment pair with the highest count above
+  // min_count, whose label and segment are not assigned yet. Ties are
+  // broken towards the lowest label and then the lowest segment address.
+  // Returns false if there is none.
+  bool popMaxCount(const size_t min_count, Label* label, size_t* segment_idx,
+                   size_t* count);
+
+  inline bool isLabelAssigned(const Label label) const {
+    return is_label_assigned_[label];
+  }
+  inline void assignLabel(const Label label) {
+    is_label_assigned_[label] = true;
+  }
+
+  inline bool isSegmentLabelled(const size_t segment_idx) const {
+    return is_segment_labelled_[segment_idx];
+  }
+  inline void setSegmentLabelled(const size_t segment_idx) {
+    is_segment_labelled_[segment_idx] = true;
+  }
+
+  // Heap entries pushed and skipped as outdated since construction.
+  inline size_t getNumPushedEntries() const { return num_pushed_entries_; }
+  inline size_t getNumOutdatedEntries() const {
+    return num_outdated_entries_;
+  }
+
+ private:
+  struct Entry {
+    size_t count;
+    Label label;
+    size_t segment_idx;
+    // Address of the segment, which breaks ties like iterating the nested
+    // candidate maps did.
+    const Segment* segment;
+  };
+
+  struct EntryLess {
+    inline bool operator()(const Entry& lhs, const Entry& rhs) const {
+      if (lhs.count != rhs.count) {
+        return lhs.count < rhs.count;
+      }
+      if (lhs.label != rhs.label) {
+        return lhs.label > rhs.label;
+      }
+      return lhs.segment > rhs.segment;
+    }
+  };
+
+  explicit LabelCandidateMatrix(const std::vector<Segment*>& segments);
+
+  inline static uint64_t getKey(const Label label, const size_t segment_idx) {
+    return static_cast<uint64_t>(label) << 32u |
+           static_cast<uint64_t>(segment_idx);
+  }
+
+  std::vector<Segment*> segments_;
+  std::unordered_map<const Segment*, size_t> segment_indices_;
+
+  std::unordered_map<uint64_t, size_t> counts_;
+  // Segments and labels of the pairs, appended when a pair is added. Pairs
+  // removed since are filtered out when they are read.
+  std::unordered_map<Label, std::vector<size_t>> label_segments_;
+  std::vector<std::vector<Label>> segment_labels_;
+
+  std::priority_queue<Entry, std::vector<Entry>, EntryLess> heap_;
+
+  std::bitset<kNumLabels> is_label_assigned_;
+  std::vector<bool> is_segment_labelled_;
+
+  size_t num_pushed_entries_;
+  size_t num_outdated_entries_;
+};
+
+}  // namespace voxblox
+
+#endif  // GLOBAL_SEGMENT_MAP_LABEL_CANDIDATE_MATRIX_H_
@@ -0,0 +1,62 @@
+#ifndef GLOBAL_SEGMENT_MAP_LABEL_PROPAGATION_CACHE_H_
+#define GLOBAL_SEGMENT_MAP_LABEL_PROPAGATION_CACHE_H_
+
+#include <vector>
+
+#include "global_segment_map/common.h"
+#include "global_segment_map/segment.h"
+
+namespace voxblox {
+
+// Footprints of the segments of the last propagated frame, that is the map
+// voxels they covered, together with the labels they were given. While the
+// camera barely moves, a segment mostly covers the footprint of a segment of
+// the previous frame and gets its label again, so that label can be proposed
+// without looking up the voxels of the segment in the map.
+class LabelPropagationCache {
+ public:
+  struct Entry {
+    Label label = 0u;
+    // Fraction of the raw points of the segment that voted for its label.
+    FloatingPoint confidence = 0.0f;
+  };
+
+  LabelPropagationCache();
+
+  inline bool empty() const { return entries_.empty(); }
+
+  void clear();
+
+  // Replaces the cached footprints by the ones of the voxelized segments,
+  // with the entry of every segment. Segments whose label has a confidence
+  // below min_confidence are left out.
+  void update(const Transformation& T_G_C,
+              const std::vector<Segment*>& segments,
+              const FloatingPoint min_confidence,
+              std::vector<Entry>* entries);
+
+  // Whether the camera moved at most max_translation_m and
+  // max_rotation_rad since the cached frame.
+  bool isCameraCoherent(const Transformation& T_G_C,
+                        const FloatingPoint max_translation_m,
+                        const FloatingPoint max_rotation_rad) const;
+
+  // Returns the entry whose footprint covers the most raw points of the
+  // voxelized segment, if it covers at least min_overlap_ratio of them, and
+  // sets overlap_count to their number. Returns nullptr otherwise. Can be
+  // called concurrently, as long as the cache is not updated.
+  const Entry* lookup(const Segment& segment,
+                      const FloatingPoint min_overlap_ratio,
+                      size_t* overlap_count) const;
+
+ private:
+  Transformation T_G_C_;
+  std::vector<Entry> entries_;
+  // Index of the entry covering each voxel. A voxel covered by several
+  // segments belongs to the first one.
+  LongIndexHashMapType<size_t>::type voxel_entries_;
+};
+
+}  // namespace voxblox
+
+#endif  // GLOBAL_SEGMENT_MAP_LABEL_PROPAGATION_CACHE_H_
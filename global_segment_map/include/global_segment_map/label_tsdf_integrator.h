@@ -1,7 +1,15 @@
 #ifndef GLOBAL_SEGMENT_MAP_LABEL_TSDF_INTEGRATOR_H_
 #define GLOBAL_SEGMENT_MAP_LABEL_TSDF_INTEGRATOR_H_
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <limits>
 #include <map>
+#include <memory>
+#include <scoped_allocator>
+#include <unordered_map>
 #include <vector>
 
 #include <glog/logging.h>
@@ -14,9 +22,16 @@
 
 #include "global_segment_map/common.h"
 #include "global_segment_map/icp_utils.h"
+#include "global_segment_map/label_candidate_matrix.h"
+#include "global_segment_map/label_propagation_cache.h"
 #include "global_segment_map/label_tsdf_map.h"
 #include "global_segment_map/segment.h"
 #include "global_segment_map/semantic_instance_label_fusion.h"
+#include "global_segment_map/utils/bipartite_matching.h"
+#include "global_segment_map/utils/frame_arena.h"
+#include "global_segment_map/utils/index_bloom_filter.h"
+#include "global_segment_map/utils/point_merging.h"
+#include "global_segment_map/utils/thread_pool.h"
 
 namespace voxblox {
 
@@ -26,6 +41,137 @@ class LabelTsdfIntegrator : public MergedTsdfIntegrator {
   typedef LongIndexHashMapType<AlignedVector<size_t>>::type VoxelMap;
   typedef VoxelMap::value_type VoxelMapElement;
 
+  // All the points bundled into a ray, merged into a single weighted point,
+  // together with one vote per distinct label of the points.
+  struct MergedRay {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    Point point_G;
+    Color color;
+    FloatingPoint weight = 0.0f;
+    std::vector<LabelCount> label_votes;
+  };
+
+  // A voxel visited by the ray with index ray_idx.
+  struct RayVoxel {
+    GlobalIndex global_voxel_idx;
+    size_t ray_idx;
+  };
+  typedef AnyIndexHashMapType<AlignedVector<RayVoxel>>::type BlockRayVoxelsMap;
+
+  // A voxel visited by a ray together with its blocks and voxels. These are
+  // nullptr if the block is not allocated in the layers yet.
+  struct RayStep {
+    GlobalIndex global_voxel_idx;
+    BlockIndex block_idx;
+    Block<TsdfVoxel>* tsdf_block = nullptr;
+    Block<LabelVoxel>* label_block = nullptr;
+    TsdfVoxel* tsdf_voxel = nullptr;
+    LabelVoxel* label_voxel = nullptr;
+  };
+
+  // Counters of the label voxel updates and label block allocations, to
+  // measure what restricting labels to the surface band saves.
+  struct LabelUpdateStats {
+    // Voxels whose label was updated.
+    size_t num_label_updates = 0u;
+    // Voxels only updated in the TSDF, as they are outside the label band.
+    size_t num_out_of_band_voxels = 0u;
+    // Voxels of clearing rays, which never look up their label voxel.
+    size_t num_clearing_voxels = 0u;
+    // Newly allocated label blocks.
+    size_t num_label_blocks = 0u;
+    // Newly allocated TSDF blocks that got no label block.
+    size_t num_tsdf_only_blocks = 0u;
+
+    inline LabelUpdateStats& operator+=(const LabelUpdateStats& other) {
+      num_label_updates += other.num_label_updates;
+      num_out_of_band_voxels += other.num_out_of_band_voxels;
+      num_clearing_voxels += other.num_clearing_voxels;
+      num_label_blocks += other.num_label_blocks;
+      num_tsdf_only_blocks += other.num_tsdf_only_blocks;
+      return *this;
+    }
+  };
+
+  // Counters of the label propagation, to measure how much of the cached
+  // voxel votes have to be revisited when labels get assigned.
+  struct LabelPropagationStats {
+    // Voxel votes cached, once per segment that needed a recomputation.
+    size_t num_cached_voxel_votes = 0u;
+    // Cached voxel votes moved to another label, as theirs was assigned.
+    size_t num_reassigned_voxel_votes = 0u;
+    // Segment candidate recomputations.
+    size_t num_recomputed_segments = 0u;
+    // Candidate heap entries pushed, and skipped as they were outdated.
+    size_t num_heap_entries = 0u;
+    size_t num_outdated_heap_entries = 0u;
+    // Segment and label pairs of the optimal assignment, and the segments
+    // it matched to a label.
+    size_t num_matching_edges = 0u;
+    size_t num_matched_segments = 0u;
+    // Segments looked up in the propagation cache, and those that took
+    // their label from it.
+    size_t num_propagation_cache_lookups = 0u;
+    size_t num_propagation_cache_hits = 0u;
+    // Segments whose candidates were counted and their voxels, the voxels
+    // whose label was counted, fewer if sampled, and the segments that were
+    // sampled.
+    size_t num_counted_segments = 0u;
+    size_t num_counted_voxels = 0u;
+    size_t num_voxel_lookups = 0u;
+    size_t num_sampled_segments = 0u;
+    // Blocks of the label votes counted ahead of the frame, and those
+    // recounted as they changed since.
+    size_t num_vote_blocks = 0u;
+    size_t num_recounted_vote_blocks = 0u;
+  };
+
+  // Label statistics changed by a single integration thread. They are
+  // reduced into the global statistics at the end of every integration pass,
+  // so threads do not need to share a lock while updating voxels.
+  struct LabelStatsDelta {
+    static constexpr size_t kNumLabels =
+        static_cast<size_t>(std::numeric_limits<Label>::max()) + 1u;
+
+    LabelStatsDelta() : label_count_deltas(kNumLabels, 0), max_label(0u) {}
+
+    // Net change of the voxel count of each label.
+    std::vector<int> label_count_deltas;
+    // Labels that gained or lost a voxel, both as bitset and as list.
+    std::bitset<kNumLabels> is_label_updated;
+    std::vector<Label> updated_labels;
+    // Highest label that gained a voxel.
+    Label max_label;
+    // Label voxel updates done by the thread.
+    LabelUpdateStats update_stats;
+    // Blocks with voxels updated by the thread, only recorded if block
+    // versions are enabled.
+    IndexSet changed_blocks;
+  };
+
+  // Pinhole intrinsics of the camera a frame was taken with.
+  struct CameraIntrinsics {
+    FloatingPoint fx = 0.0f;
+    FloatingPoint fy = 0.0f;
+    FloatingPoint cx = 0.0f;
+    FloatingPoint cy = 0.0f;
+    size_t width = 640u;
+    size_t height = 480u;
+  };
+
+  // Depth, color and segment of every pixel of a frame, stored row-major.
+  // Pixels without a measurement have a depth of 0. The segment index refers
+  // to the segments of the frame, pixels without a segment have kNoSegment.
+  struct SegmentedDepthImage {
+    static constexpr int kNoSegment = -1;
+
+    CameraIntrinsics camera;
+    std::vector<float> depths;
+    Colors colors;
+    std::vector<int> segment_indices;
+  };
+
   struct LabelTsdfConfig {
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
@@ -33,6 +179,36 @@ class LabelTsdfIntegrator : public MergedTsdfIntegrator {
     // TODO(margaritaG): maybe use a relative measure, not absolue voxel count.
     // Minimum number of label voxels count for label propagation.
     size_t min_label_voxel_count = 20u;
+    // Assign the labels with a maximum weight matching of the segment and
+    // label overlap counted once, instead of greedily picking the highest
+    // count and recounting the segments that lost their label after each
+    // pick. Pairs up to min_label_voxel_count are left out of the matching.
+    bool enable_optimal_label_assignment = false;
+    // While the camera barely moves, segments covering the footprint of a
+    // segment of the previous frame take its label, without looking up
+    // their voxels in the map. Only used by computeFrameLabelCandidates(),
+    // and not with enable_pairwise_confidence_merging, as the merge
+    // candidates of a segment come from the labels of its voxels.
+    bool enable_label_propagation_cache = false;
+    // Camera motion since the cached frame up to which the cache is used.
+    float propagation_cache_max_translation_m = 0.05f;
+    float propagation_cache_max_rotation_rad = 0.05f;
+    // Fraction of the points of a segment a cached footprint must cover.
+    float propagation_cache_min_overlap_ratio = 0.8f;
+    // Segments whose label got the votes of a lower fraction of their
+    // points are not cached.
+    float propagation_cache_min_confidence = 0.5f;
+    // Estimate the label counts of a segment with many voxels from a
+    // stratified random sample of its voxels, drawn in batches until the
+    // count of its top label exceeds the second one by
+    // sampled_label_voting_z_score standard errors, instead of looking up
+    // all of its voxels in the map.
+    bool enable_sampled_label_voting = false;
+    // Voxels sampled per batch, and at most per segment. Segments with at
+    // most sampled_label_voting_max_samples voxels are counted exactly.
+    size_t sampled_label_voting_batch_size = 128u;
+    size_t sampled_label_voting_max_samples = 2048u;
+    float sampled_label_voting_z_score = 3.0f;
     size_t max_num_icp_updates = 15u;
     // Truncation distance factor for label propagation.
     float label_propagation_td_factor = 1.0f;
@@ -59,28 +235,235 @@ class LabelTsdfIntegrator : public MergedTsdfIntegrator {
     // ICP params.
     bool enable_icp = false;
     bool keep_track_of_icp_correction = false;
+
+    // Integration threading. The number of threads is given by
+    // integrator_threads in the TSDF integrator config.
+    // Number of bundled rays a thread grabs at a time. Segments with fewer
+    // rays than this are integrated inline on the calling thread.
+    size_t integration_grain_size = 256u;
+    // Bucket the voxels visited by the rays by their block and update every
+    // block from a single thread, instead of locking each updated voxel.
+    bool enable_block_partitioned_integration = false;
+    // Merge the points bundled into a ray with the vectorized kernel instead
+    // of blending them one by one.
+    bool enable_vectorized_point_merging = true;
+    // Label voxels are only updated within label_band_factor times the
+    // truncation distance from the end of a ray, and label blocks are only
+    // allocated around this band. Clearing rays never update labels.
+    float label_band_factor = 3.0f;
+    // Cast all the clearing rays of a frame before updating any voxel, and
+    // update every voxel they pass whose distance is clamped to the
+    // truncation distance once with their merged weight and color, instead
+    // of once per ray.
+    bool enable_clearing_voxel_deduplication = false;
+
+    // Projective integration. Instead of casting a ray per voxel bundle,
+    // the segments of a frame are rendered into a depth and segment image
+    // with projective_camera, and every voxel of the allocated blocks in the
+    // camera frustum is updated from the pixel it projects to.
+    bool enable_projective_integration = false;
+    CameraIntrinsics projective_camera;
+
+    // Record the map version at which every block was last changed, so that
+    // label votes counted from an older map are only recounted in the
+    // blocks changed since.
+    bool enable_block_versions = false;
+  };
+
+  // Counters of the work done while traversing the rays, to measure the
+  // cost per ray.
+  struct RayTraversalStats {
+    size_t num_rays = 0u;
+    // Voxels visited by the rays, including the ones skipped by anti-grazing.
+    size_t num_steps = 0u;
+    // Block lookups, only done when a ray enters a new block.
+    size_t num_block_lookups = 0u;
+    // Anti-grazing voxel map lookups not ruled out by the bloom filter.
+    size_t num_anti_grazing_lookups = 0u;
+    // Voxels skipped by anti-grazing.
+    size_t num_anti_grazing_skips = 0u;
+    // Voxels of clearing rays merged into the update of a voxel already
+    // passed by another clearing ray of the same frame.
+    size_t num_merged_clearing_steps = 0u;
+
+    inline RayTraversalStats& operator+=(const RayTraversalStats& other) {
+      num_rays += other.num_rays;
+      num_steps += other.num_steps;
+      num_block_lookups += other.num_block_lookups;
+      num_anti_grazing_lookups += other.num_anti_grazing_lookups;
+      num_anti_grazing_skips += other.num_anti_grazing_skips;
+      num_merged_clearing_steps += other.num_merged_clearing_steps;
+      return *this;
+    }
+  };
+
+  // Counters of the work done by projective integration.
+  struct ProjectiveIntegrationStats {
+    size_t num_frames = 0u;
+    // Blocks of the bounding box of the camera frustum, and the allocated
+    // ones among them intersecting the frustum.
+    size_t num_box_blocks = 0u;
+    size_t num_frustum_blocks = 0u;
+    // Voxels of the frustum blocks that project into the image.
+    size_t num_projected_voxels = 0u;
+    // Voxels within the truncation band of their pixel, or in front of it if
+    // voxel carving is enabled.
+    size_t num_updated_voxels = 0u;
+
+    inline ProjectiveIntegrationStats& operator+=(
+        const ProjectiveIntegrationStats& other) {
+      num_frames += other.num_frames;
+      num_box_blocks += other.num_box_blocks;
+      num_frustum_blocks += other.num_frustum_blocks;
+      num_projected_voxels += other.num_projected_voxels;
+      num_updated_voxels += other.num_updated_voxels;
+      return *this;
+    }
   };
 
+  // Label votes of the voxels of a segment that fall into a single block.
+  struct BlockLabelVotes {
+    // Linear voxel index in the block of every such voxel, with its index
+    // in the segment.
+    std::vector<std::pair<size_t, size_t>> voxels;
+    bool is_counted = false;
+    // Map version of the block when the votes were counted.
+    uint64_t block_version = 0u;
+  };
+  struct SegmentLabelVotes {
+    typedef AnyIndexHashMapType<BlockLabelVotes>::type BlockVotesMap;
+    BlockVotesMap block_votes;
+    // Label every voxel of the segment votes for, 0 if none.
+    std::vector<Label> voxel_labels;
+  };
+
+  // Label candidates of a frame, the raw point count of every segment
+  // voting for each label, and the merge candidate labels of every segment.
+  // Constructed with an arena allocator their nodes live in a FrameArena,
+  // the nested maps are allocated from the arena of the outer map.
+  typedef std::map<Segment*, size_t, std::less<Segment*>,
+                   ArenaAllocator<std::pair<Segment* const, size_t>>>
+      SegmentCandidates;
+  typedef std::map<Label, SegmentCandidates, std::less<Label>,
+                   std::scoped_allocator_adaptor<ArenaAllocator<
+                       std::pair<const Label, SegmentCandidates>>>>
+      LabelCandidates;
+  typedef std::map<
+      Segment*, std::vector<Label>, std::less<Segment*>,
+      ArenaAllocator<std::pair<Segment* const, std::vector<Label>>>>
+      SegmentMergeCandidates;
+
   LabelTsdfIntegrator(const Config& tsdf_config,
                       const LabelTsdfConfig& label_tsdf_config,
                       LabelTsdfMap* map);
 
   // Label propagation.
   void computeSegmentLabelCandidates(
-      Segment* segment, std::map<Label, std::map<Segment*, size_t>>* candidates,
-      std::map<Segment*, std::vector<Label>>* segment_merge_candidates,
+      Segment* segment, LabelCandidates* candidates,
+      SegmentMergeCandidates* segment_merge_candidates,
       const std::set<Label>& assigned_labels = std::set<Label>());
 
+  // Same as computeSegmentLabelCandidates() for all the segments of a frame,
+  // spread over the integration threads. Each thread fills its own
+  // candidate tables, which are merged once all segments are done. If
+  // segment_label_votes is given, the votes of every segment are recounted
+  // in the blocks changed since they were counted and used instead of
+  // looking up its voxels in the map.
+  void computeFrameLabelCandidates(
+      const std::vector<Segment*>& segments,
+      std::vector<SegmentLabelVotes>* segment_label_votes,
+      LabelCandidates* candidates,
+      SegmentMergeCandidates* segment_merge_candidates);
+
+  // Label propagation from label votes counted per block. Grouping the
+  // voxels of a segment by block does not access the map, so it can run
+  // while another frame is integrated. Only the voxels that may be sampled
+  // are grouped if the segment is sampled. Counting the votes reads the layers,
+  // but only for the blocks not counted yet or changed since they were
+  // counted, and returns their number. Requires enable_block_versions.
+  void groupSegmentPointsByBlock(Segment* segment,
+                                 SegmentLabelVotes* segment_votes) const;
+
+  size_t countSegmentLabelVotes(SegmentLabelVotes* segment_votes) const;
+
+  // Map version at which the block was last changed, 0 if never.
+  inline uint64_t getBlockVersion(const BlockIndex& block_idx) const {
+    const auto block_version_it = block_versions_.find(block_idx);
+    return block_version_it == block_versions_.end() ? 0u
+                                                     : block_version_it->second;
+  }
+
+  // Assigns a label to every segment, greedily picking the label and segment
+  // pair with the highest count first, or with an optimal matching if
+  // enable_optimal_label_assignment. The candidates are empty afterwards.
   void decideLabelPointClouds(
       std::vector<voxblox::Segment*>* segments_to_integrate,
-      std::map<voxblox::Label, std::map<voxblox::Segment*, size_t>>* candidates,
-      std::map<Segment*, std::vector<Label>>* segment_merge_candidates);
+      LabelCandidates* candidates,
+      SegmentMergeCandidates* segment_merge_candidates);
 
   // Segment integration.
   void integratePointCloud(const Transformation& T_G_C,
                            const Pointcloud& points_C, const Colors& colors,
                            const Label& label, const bool freespace_points);
 
+  // Frame integration. All segments of a frame share the same T_G_C, so
+  // their points are bundled into a single voxel map and every ray is cast
+  // once, voting for the labels of all the points it was merged from. The
+  // T_G_C_ of every segment must be T_G_C. The points of a bundle are
+  // merged in increasing index order, integration_order_mode is ignored.
+  void integrateFrame(const Transformation& T_G_C,
+                      const std::vector<Segment*>& segments);
+
+  // Renders the points of the segments into a depth and segment image,
+  // keeping the closest point of every pixel.
+  void renderSegmentedDepthImage(const std::vector<Segment*>& segments,
+                                 const CameraIntrinsics& camera,
+                                 SegmentedDepthImage* image) const;
+
+  // Projective frame integration. The blocks around the surface seen by the
+  // image are allocated, then every voxel of the allocated blocks in the
+  // camera frustum is projected into the image and updated with the depth,
+  // color and segment label of its pixel. The cost is bounded by the frustum
+  // volume instead of the number of rays and their length. Voxels behind
+  // unallocated free space are not carved. With allow_clear, pixels beyond
+  // max_ray_length_m clear the voxels up to max_ray_length_m.
+  void integrateSegmentedDepthImage(const Transformation& T_G_C,
+                                    const std::vector<Segment*>& segments,
+                                    const SegmentedDepthImage& image);
+
+  // Ray traversal counters accumulated since the last reset.
+  inline const RayTraversalStats& getRayTraversalStats() const {
+    return ray_traversal_stats_;
+  }
+  inline void resetRayTraversalStats() {
+    ray_traversal_stats_ = RayTraversalStats();
+  }
+
+  // Projective integration counters accumulated since the last reset.
+  inline const ProjectiveIntegrationStats& getProjectiveIntegrationStats()
+      const {
+    return projective_integration_stats_;
+  }
+  inline void resetProjectiveIntegrationStats() {
+    projective_integration_stats_ = ProjectiveIntegrationStats();
+  }
+
+  // Label propagation counters accumulated since the last reset.
+  inline const LabelPropagationStats& getLabelPropagationStats() const {
+    return label_propagation_stats_;
+  }
+  inline void resetLabelPropagationStats() {
+    label_propagation_stats_ = LabelPropagationStats();
+  }
+
+  // Label update counters accumulated since the last reset.
+  inline const LabelUpdateStats& getLabelUpdateStats() const {
+    return label_update_stats_;
+  }
+  inline void resetLabelUpdateStats() {
+    label_update_stats_ = LabelUpdateStats();
+  }
+
   // Segment merging.
   // Not thread safe.
   void mergeLabels(LLSet* merges_to_publish);
@@ -93,16 +476,127 @@ class LabelTsdfIntegrator : public MergedTsdfIntegrator {
                                      const Pointcloud& point_cloud);
 
  protected:
+  // Label vote of a voxel hit by the points of a segment. The labels of the
+  // voxel are stored in the order getNextUnassignedLabel() picks them as
+  // more labels get assigned, so the voxel votes for the first unassigned
+  // one. The order ends before the first label 0, which is no vote.
+  struct VoxelLabelVote {
+    static constexpr size_t kMaxLabels = 4u;
+
+    std::array<Label, kMaxLabels> labels;
+    uint8_t num_labels = 0u;
+    // Index of the label the voxel votes for, num_labels if none.
+    uint8_t label_idx = 0u;
+    // Raw points of the segment in the voxel.
+    uint32_t point_count = 0u;
+  };
+
+  // Voxel votes of a segment, cached once per frame the first time the
+  // label candidates of the segment are recomputed. When a label gets
+  // assigned, only the voxels voting for it move on to their next label.
+  struct SegmentVoxelVotes {
+    std::vector<VoxelLabelVote> voxel_votes;
+    // Indices of the voxel votes currently voting for each label.
+    std::unordered_map<Label, std::vector<size_t>> voxel_votes_by_label;
+    // Raw points currently voting for each label.
+    std::map<Label, size_t> label_counts;
+  };
+  // Indexed by the index of the segment in the candidate matrix.
+  typedef std::unordered_map<size_t, SegmentVoxelVotes> SegmentVoxelVotesMap;
+
   // Label propagation.
   // Fetch the next segment label pair which has overall
-  // the highest voxel count.
+  // the highest voxel count, and mark its label and segment as assigned.
   bool getNextSegmentLabelPair(
-      const std::set<Segment*>& labelled_segments,
-      std::set<Label>* assigned_labels,
-      std::map<voxblox::Label, std::map<voxblox::Segment*, size_t>>* candidates,
-      std::map<Segment*, std::vector<Label>>* segment_merge_candidates,
+      LabelCandidateMatrix* candidate_matrix,
+      SegmentMergeCandidates* segment_merge_candidates,
+      SegmentVoxelVotesMap* segment_voxel_votes,
       std::pair<Segment*, Label>* segment_label_pair);
 
+  // Labels the segments with the maximum weight matching of the candidates.
+  void assignLabelsByMatching(const std::vector<Segment*>& segments,
+                              const LabelCandidates& candidates,
+                              std::set<Segment*>* labelled_segments);
+
+  // Caches the voxel votes of the segment, skipping the assigned labels.
+  void cacheSegmentVoxelVotes(Segment* segment,
+                              const LabelCandidateMatrix& candidate_matrix,
+                              SegmentVoxelVotes* segment_votes);
+
+  // Moves the voxel votes for the just assigned label to their next
+  // unassigned label. The labels whose count changed are added to
+  // changed_labels.
+  void reassignSegmentVoxelVotes(const Label assigned_label,
+                                 const LabelCandidateMatrix& candidate_matrix,
+                                 SegmentVoxelVotes* segment_votes,
+                                 std::vector<Label>* changed_labels);
+
+  // Sets the candidates of the segment for the changed labels and its merge
+  // candidates to the counts of its voxel votes. A segment left without
+  // votes gets an unseen label.
+  void setSegmentLabelCandidates(
+      const size_t segment_idx, const SegmentVoxelVotes& segment_votes,
+      const std::vector<Label>& changed_labels,
+      LabelCandidateMatrix* candidate_matrix,
+      SegmentMergeCandidates* segment_merge_candidates);
+
+  // Adds the label candidates of the segment, without drawing a fresh
+  // label for it. Only reads the map, so segments can be counted
+  // concurrently into separate tables and stats. Returns false if the
+  // segment has no candidate.
+  bool countSegmentLabelCandidates(
+      Segment* segment, const std::set<Label>& assigned_labels,
+      LabelCandidates* candidates,
+      SegmentMergeCandidates* segment_merge_candidates,
+      LabelPropagationStats* stats);
+
+  // Adds the label candidates of the segment from the label each of its
+  // voxels votes for, as returned by get_voxel_label for the index of the
+  // voxel, 0 if none. Counts all voxels, or a sample of them if
+  // enable_sampled_label_voting. Returns false if the segment has no
+  // candidate.
+  template <typename VoxelLabelGetter>
+  bool countSegmentVoxelLabels(
+      Segment* segment, const VoxelLabelGetter& get_voxel_label,
+      LabelCandidates* candidates,
+      SegmentMergeCandidates* segment_merge_candidates,
+      LabelPropagationStats* stats);
+
+  // Sets the voxels of the segment sampled for its label counts, a batch
+  // after another, if the segment is sampled. They only depend on the
+  // number of voxels of the segment. Returns false if all of its voxels are
+  // counted instead.
+  bool getSampledSegmentVoxels(const Segment& segment,
+                               std::vector<size_t>* sampled_voxels) const;
+
+  inline size_t getSampledLabelVotingBatchSize() const {
+    return std::max<size_t>(label_tsdf_config_.sampled_label_voting_batch_size,
+                            2u);
+  }
+
+  // Whether the sampled label counts of a segment decide its top label,
+  // given the sums of the raw point counts of the sampled voxels voting for
+  // each label and of their squares.
+  bool isTopLabelDecided(
+      const std::map<Label, std::pair<double, double>>& label_sample_sums,
+      const size_t num_samples) const;
+
+  inline bool isPropagationCacheEnabled() const {
+    return label_tsdf_config_.enable_label_propagation_cache &&
+           !label_tsdf_config_.enable_pairwise_confidence_merging;
+  }
+
+  // Adds the label of the cached segment the segment overlaps, if any, as
+  // its only candidate. Returns false on a cache miss.
+  bool lookupPropagationCache(Segment* segment, LabelCandidates* candidates);
+
+  // Caches the footprints and decided labels of the segments for the next
+  // frame. initial_counts holds the candidate counts before any label was
+  // assigned.
+  void updatePropagationCache(
+      const std::vector<Segment*>& segments,
+      const std::map<std::pair<Segment*, Label>, size_t>& initial_counts);
+
   Label getNextUnassignedLabel(const LabelVoxel& voxel,
                                const std::set<Label>& assigned_labels);
 
@@ -111,9 +605,11 @@ class LabelTsdfIntegrator : public MergedTsdfIntegrator {
       const int segment_points_count,
       std::unordered_set<Label>* merge_candidate_labels);
 
+  // Increases the count of the label for the segment by point_count, the
+  // number of raw points of the segment voting for it.
   void increaseLabelCountForSegment(
       Segment* segment, const Label& label, const int segment_points_count,
-      std::map<Label, std::map<Segment*, size_t>>* candidates,
+      const uint32_t point_count, LabelCandidates* candidates,
       std::unordered_set<Label>* merge_candidate_labels);
 
   void increasePairwiseConfidenceCount(
@@ -147,33 +643,207 @@ class LabelTsdfIntegrator : public MergedTsdfIntegrator {
   // NOT thread safe
   void updateLabelLayerWithStoredBlocks();
 
-  // Updates label_voxel. Thread safe.
-  void updateLabelVoxel(const Point& point_G, const Label& label,
-                        LabelVoxel* label_voxel,
-                        const LabelConfidence& confidence = 1u);
+  // Updates label_voxel and records the label changes in label_stats, which
+  // must only be used by the calling thread. Thread safe.
+  void updateLabelVoxel(const GlobalIndex& global_voxel_idx, const Label& label,
+                        const LabelConfidence& confidence,
+                        LabelVoxel* label_voxel, LabelStatsDelta* label_stats);
+
+  // Updates label_voxel without locking it. Only safe if no other thread
+  // updates the block containing label_voxel at the same time.
+  void updateLabelVoxelUnlocked(const Label& label,
+                                const LabelConfidence& confidence,
+                                LabelVoxel* label_voxel,
+                                LabelStatsDelta* label_stats);
+
+  // Applies the label statistics of all threads to the global label counts,
+  // updated labels, highest label and block versions and resets them. Not
+  // thread safe.
+  void reduceLabelStats();
+
+  // Whether a voxel at the given distance from the end of a ray is close
+  // enough to the surface for its label voxel to be updated.
+  inline bool isInLabelBand(const FloatingPoint distance) const {
+    return std::abs(distance) < label_tsdf_config_.label_band_factor *
+                                    config_.default_truncation_distance;
+  }
 
-  void integrateVoxel(
+  // Integrates a pointcloud in which every point carries its own label.
+  // Every point is weighted by its count in point_counts, or by one if
+  // point_counts is empty.
+  void integrateLabelledPointCloud(const Transformation& T_G_C,
+                                   const Pointcloud& points_C,
+                                   const Colors& colors, const Labels& labels,
+                                   const PointCounts& point_counts,
+                                   const bool freespace_points);
+
+  // Integrates the rays bundled from the points into voxel_map and
+  // clear_map.
+  void integrateBundledRays(const Transformation& T_G_C,
+                            const Pointcloud& points_C, const Colors& colors,
+                            const Labels& labels,
+                            const PointCounts& point_counts,
+                            const VoxelMap& voxel_map,
+                            const VoxelMap& clear_map);
+
+  // Merges the points bundled into a ray into a single weighted point and
+  // collects the label votes of the ray. Clearing rays do not vote.
+  void mergeRay(const Transformation& T_G_C, const Pointcloud& points_C,
+                const Colors& colors, const Labels& labels,
+                const PointCounts& point_counts, const bool clearing_ray,
+                const AlignedVector<size_t>& point_indices,
+                MergedRay* merged_ray);
+
+  // Inserts the indices of all the blocks the voxels of a ray can fall in
+  // into block_footprint, and the ones its label band can fall in into
+  // label_block_footprint. The ray has the same extent as the one cast by
+  // RayCaster for the voxel pass, but is traversed block by block.
+  void addRayBlockFootprint(const Point& origin, const Point& point_G,
+                            const bool clearing_ray,
+                            IndexSet* block_footprint,
+                            IndexSet* label_block_footprint) const;
+
+  // Merges chunks of rays until all of them have been taken and collects
+  // the blocks they will touch.
+  void mergeRaysAndComputeBlockFootprint(
       const Transformation& T_G_C, const Pointcloud& points_C,
-      const Colors& colors, const Label& label, const bool enable_anti_grazing,
-      const bool clearing_ray,
+      const Colors& colors, const Labels& labels,
+      const PointCounts& point_counts, const bool clearing_ray,
+      const std::vector<const VoxelMapElement*>& rays,
+      std::atomic<size_t>* next_ray_idx, AlignedVector<MergedRay>* merged_rays,
+      IndexSet* block_footprint, IndexSet* label_block_footprint);
+
+  // Allocates the block in both the TSDF and the label layer, if missing.
+  // NOT thread safe.
+  void allocateTsdfAndLabelBlock(const BlockIndex& block_idx);
+
+  // Allocates the block in the TSDF layer only, if missing.
+  // NOT thread safe.
+  void allocateTsdfBlock(const BlockIndex& block_idx);
+
+  // Whether anti-grazing skips this voxel of the ray, because another ray
+  // ends in it. Uses anti_grazing_filter_ to avoid most voxel map lookups.
+  bool isGrazingVoxel(
+      const GlobalIndex& global_voxel_idx, const bool clearing_ray,
       const VoxelMapElement& global_voxel_idx_to_point_indices,
-      const LongIndexHashMapType<AlignedVector<size_t>>::type& voxel_map);
+      const LongIndexHashMapType<AlignedVector<size_t>>::type& voxel_map,
+      RayTraversalStats* ray_stats) const;
+
+  // Advances the ray caster to the next voxel not skipped by anti-grazing.
+  // The blocks of previous_step are reused if the voxel lies in the same
+  // block, otherwise they are looked up. Clearing rays do not look up label
+  // blocks. The voxels of the step are prefetched. Returns false at the end
+  // of the ray.
+  bool nextRayStep(
+      const bool enable_anti_grazing, const bool clearing_ray,
+      const VoxelMapElement& global_voxel_idx_to_point_indices,
+      const LongIndexHashMapType<AlignedVector<size_t>>::type& voxel_map,
+      const RayStep* previous_step, RayCaster* ray_caster, RayStep* step,
+      RayTraversalStats* ray_stats);
 
+  void integrateVoxel(
+      const Transformation& T_G_C, const MergedRay& merged_ray,
+      const bool enable_anti_grazing, const bool clearing_ray,
+      const VoxelMapElement& global_voxel_idx_to_point_indices,
+      const LongIndexHashMapType<AlignedVector<size_t>>::type& voxel_map,
+      LabelStatsDelta* label_stats, RayTraversalStats* ray_stats);
+
+  // Integrates chunks of rays until all of them have been taken.
   void integrateVoxels(
+      const Transformation& T_G_C, const bool enable_anti_grazing,
+      const bool clearing_ray, const std::vector<const VoxelMapElement*>& rays,
+      const AlignedVector<MergedRay>& merged_rays,
+      const LongIndexHashMapType<AlignedVector<size_t>>::type& voxel_map,
+      std::atomic<size_t>* next_ray_idx, LabelStatsDelta* label_stats,
+      RayTraversalStats* ray_stats);
+
+  // Casts chunks of rays until all of them have been taken and buckets the
+  // visited voxels by their block, without updating any voxel. The blocks
+  // with voxels in the label band are inserted into label_blocks.
+  void castRaysToBlocks(
       const Transformation& T_G_C, const Pointcloud& points_C,
-      const Colors& colors, const Label& label, const bool enable_anti_grazing,
+      const Colors& colors, const Labels& labels,
+      const PointCounts& point_counts, const bool enable_anti_grazing,
       const bool clearing_ray,
+      const std::vector<const VoxelMapElement*>& rays,
       const LongIndexHashMapType<AlignedVector<size_t>>::type& voxel_map,
-      const LongIndexHashMapType<AlignedVector<size_t>>::type& clear_map,
-      const size_t thread_idx);
+      std::atomic<size_t>* next_ray_idx, AlignedVector<MergedRay>* merged_rays,
+      BlockRayVoxelsMap* block_ray_voxels, IndexSet* label_blocks,
+      RayTraversalStats* ray_stats);
+
+  // Updates all the voxels of a block visited by the rays, in ray order.
+  // The block has to be allocated in the TSDF layer, and in the label layer
+  // if any of the voxels is in the label band. If deduplicate_clearing_voxels
+  // is set, the rays have to be clearing rays.
+  void updateBlock(const Point& origin, const BlockIndex& block_idx,
+                   const std::vector<const AlignedVector<RayVoxel>*>&
+                       ray_voxels_per_thread,
+                   const AlignedVector<MergedRay>& merged_rays,
+                   const bool deduplicate_clearing_voxels,
+                   LabelStatsDelta* label_stats, RayTraversalStats* ray_stats);
+
+  // Updates every voxel of the block passed by the clearing rays. A voxel
+  // clamped to the truncation distance, which all rays end behind, is
+  // updated once with the sum of the weights and the blended color of the
+  // rays, and the end point of the first of them. Other voxels are updated
+  // once per ray.
+  void clearVoxelsOnce(const Point& origin,
+                       const AlignedVector<RayVoxel>& ray_voxels,
+                       const AlignedVector<MergedRay>& merged_rays,
+                       Block<TsdfVoxel>* tsdf_block,
+                       LabelStatsDelta* label_stats,
+                       RayTraversalStats* ray_stats);
+
+  // Integrates the rays in two phases. First all rays are cast in parallel
+  // and their voxels bucketed by block, then each block is updated by a
+  // single thread, so no per-voxel locking is needed.
+  void integrateRaysBlockPartitioned(
+      const Transformation& T_G_C, const Pointcloud& points_C,
+      const Colors& colors, const Labels& labels,
+      const PointCounts& point_counts, const bool enable_anti_grazing,
+      const bool clearing_ray,
+      const std::vector<const VoxelMapElement*>& rays,
+      const LongIndexHashMapType<AlignedVector<size_t>>::type& voxel_map);
 
   void integrateRays(
       const Transformation& T_G_C, const Pointcloud& points_C,
-      const Colors& colors, const Label& label, const bool enable_anti_grazing,
+      const Colors& colors, const Labels& labels,
+      const PointCounts& point_counts, const bool enable_anti_grazing,
       const bool clearing_ray,
       const LongIndexHashMapType<AlignedVector<size_t>>::type& voxel_map,
       const LongIndexHashMapType<AlignedVector<size_t>>::type& clear_map);
 
+  // Inserts the blocks covering the truncation and label band around the
+  // surface seen by the pixels of the rows [begin_row, end_row) into
+  // surface_blocks.
+  void addSurfaceBlocks(const Transformation& T_G_C,
+                        const SegmentedDepthImage& image,
+                        const size_t begin_row, const size_t end_row,
+                        IndexSet* surface_blocks) const;
+
+  // Range of the blocks of the bounding box of the camera frustum up to
+  // max_ray_length_m, grown by a block.
+  void getFrustumBlockRange(const Transformation& T_G_C,
+                            const CameraIntrinsics& camera,
+                            BlockIndex* min_block_idx,
+                            BlockIndex* max_block_idx) const;
+
+  // Whether the block may intersect the frustum of the camera, up to
+  // max_ray_length_m. Conservative, based on the bounding sphere of the block.
+  bool isBlockInFrustum(const Transformation& T_C_G,
+                        const CameraIntrinsics& camera,
+                        const BlockIndex& block_idx) const;
+
+  // Projects every voxel of the block into the image and updates it from its
+  // pixel. The block has to be allocated in the TSDF layer and must not be
+  // updated by another thread at the same time.
+  void updateBlockProjective(const Transformation& T_G_C,
+                             const std::vector<Segment*>& segments,
+                             const SegmentedDepthImage& image,
+                             const BlockIndex& block_idx,
+                             LabelStatsDelta* label_stats,
+                             ProjectiveIntegrationStats* projective_stats);
+
   FloatingPoint computeConfidenceWeight(const FloatingPoint& distance);
 
   // Not thread safe.
@@ -207,6 +877,33 @@ class LabelTsdfIntegrator : public MergedTsdfIntegrator {
   // Label layer.
   LabelTsdfConfig label_tsdf_config_;
   Layer<LabelVoxel>* label_layer_;
+  // Used for combined TSDF and label block lookups.
+  LabelTsdfMap* label_tsdf_map_;
+
+  // Persistent integration threads, reused for every segment.
+  std::unique_ptr<ThreadPool> thread_pool_;
+  // Label statistics of each integration thread, indexed by thread.
+  std::vector<LabelStatsDelta> label_stats_per_thread_;
+  // Ray traversal counters of each integration thread, summed up into
+  // ray_traversal_stats_ at the end of every integration pass.
+  std::vector<RayTraversalStats> ray_traversal_stats_per_thread_;
+  // Memory of the label candidate tables of each thread, released once
+  // they are merged.
+  std::vector<FrameArena> candidate_arenas_per_thread_;
+  RayTraversalStats ray_traversal_stats_;
+  ProjectiveIntegrationStats projective_integration_stats_;
+  LabelUpdateStats label_update_stats_;
+  LabelPropagationStats label_propagation_stats_;
+  LabelPropagationCache propagation_cache_;
+
+  // Increased by every integrated pointcloud and label swap. Blocks record
+  // the version they were last changed at.
+  uint64_t map_version_;
+  AnyIndexHashMapType<uint64_t>::type block_versions_;
+
+  // Global voxel indices of the voxel map of the pointcloud being
+  // integrated, used to rule out most anti-grazing voxel map lookups.
+  GlobalIndexBloomFilter anti_grazing_filter_;
 
   // Temporary block storage, used to hold blocks that need to be created
   // while integrating a new pointcloud.
@@ -229,7 +926,6 @@ class LabelTsdfIntegrator : public MergedTsdfIntegrator {
 
   Label* highest_label_ptr_;
   LMap* label_count_map_ptr_;
-  std::mutex updated_labels_mutex_;
   std::set<Label> updated_labels_;
 
   // Pairwise confidence merging.
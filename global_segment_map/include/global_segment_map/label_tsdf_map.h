@@ -60,6 +60,22 @@ class LabelTsdfMap {
 
   inline FloatingPoint block_size() const { return tsdf_layer_->block_size(); }
 
+  // Gets the TSDF and label blocks at block_index, a nullptr is returned for
+  // a block that is not allocated.
+  void getBlockPair(const BlockIndex& block_index,
+                    Block<TsdfVoxel>::Ptr* tsdf_block,
+                    Block<LabelVoxel>::Ptr* label_block);
+  void getBlockPair(const BlockIndex& block_index,
+                    Block<TsdfVoxel>::ConstPtr* tsdf_block,
+                    Block<LabelVoxel>::ConstPtr* label_block) const;
+
+  // Gets the TSDF and label blocks at block_index and allocates the missing
+  // ones.
+  // NOT THREAD SAFE.
+  void allocateBlockPair(const BlockIndex& block_index,
+                         Block<TsdfVoxel>::Ptr* tsdf_block,
+                         Block<LabelVoxel>::Ptr* label_block);
+
   // Get the list of all labels
   // for which the voxel count is greater than 0.
   // NOT THREAD SAFE.
@@ -79,7 +79,9 @@ class MeshLabelIntegrator : public MeshIntegrator<TsdfVoxel> {
 
   void updateMeshColor(const Block<TsdfVoxel>& tsdf_block, Mesh* mesh);
 
-  void updateMeshColor(const Block<LabelVoxel>& label_block, Mesh* mesh);
+  // The vertices without a label voxel, as label_block is a nullptr or they
+  // fall into a block without label block, get the color of label 0.
+  void updateMeshColor(const Block<LabelVoxel>* label_block, Mesh* mesh);
 
   LabelTsdfConfig label_tsdf_config_;
 
@@ -1,6 +1,9 @@
 #ifndef GLOBAL_SEGMENT_MAP_SEGMENT_H_
 #define GLOBAL_SEGMENT_MAP_SEGMENT_H_
 
+#include <mutex>
+#include <vector>
+
 #include <global_segment_map/common.h>
 
 namespace voxblox {
@@ -17,13 +20,134 @@ class Segment {
       const pcl::PointCloud<voxblox::PointSemanticInstanceType>& point_cloud,
       const Transformation& T_G_C);
 
+  // Segment without points, filled by splitFramePointCloud().
+  Segment(const Transformation& T_G_C, const Label label,
+          const SemanticLabel semantic_label,
+          const InstanceLabel instance_label);
+
+  // Replaces the points falling into the same cell of a voxel grid, aligned
+  // with the global frame, by their centroid and mean color. The number of
+  // points merged into each centroid is kept in point_counts_, to weigh it
+  // during label propagation and integration.
+  void downsampleVoxelGrid(const FloatingPoint voxel_size);
+
+  // Number of raw points the i-th point stands for.
+  inline uint32_t getPointCount(const size_t i) const {
+    return point_counts_.empty() ? 1u : point_counts_[i];
+  }
+
+  // Number of points of the segment before downsampling.
+  size_t getNumRawPoints() const;
+
+  // Transforms the points into the global frame in one batch and groups them
+  // by the map voxel they fall into, once per frame. Label propagation and
+  // integration both work on these voxels. Does nothing if the segment is
+  // already voxelized for this voxel size and its current T_G_C_.
+  void voxelize(const FloatingPoint voxel_size_inv);
+
+  inline bool isVoxelized(const FloatingPoint voxel_size_inv) const {
+    return voxelized_voxel_size_inv_ == voxel_size_inv &&
+           voxelized_T_G_C_.getTransformationMatrix() ==
+               T_G_C_.getTransformationMatrix();
+  }
+
+  // Drops the voxels, to be called after changing the points.
+  void clearVoxels();
+
+  inline size_t getNumVoxels() const { return voxel_indices_.size(); }
+
   voxblox::Transformation T_G_C_;
   voxblox::Pointcloud points_C_;
   voxblox::Colors colors_;
+  // Empty unless the segment was downsampled.
+  voxblox::PointCounts point_counts_;
   voxblox::Label label_;
   voxblox::SemanticLabel semantic_label_;
   voxblox::InstanceLabel instance_label_;
+
+  // Filled by voxelize(). The points in the global frame, in the order of
+  // points_C_.
+  voxblox::Pointcloud points_G_;
+  // Global indices of the voxels hit by the points, in the order they are
+  // first hit, and the number of raw points falling into each of them.
+  voxblox::AlignedVector<voxblox::GlobalIndex> voxel_indices_;
+  std::vector<uint32_t> voxel_point_counts_;
+  // The points of the i-th voxel are voxel_point_indices_[j] for j in
+  // [voxel_point_offsets_[i], voxel_point_offsets_[i + 1]), by increasing
+  // index.
+  std::vector<size_t> voxel_point_offsets_;
+  std::vector<size_t> voxel_point_indices_;
+
+ private:
+  // 0 if the segment is not voxelized.
+  FloatingPoint voxelized_voxel_size_inv_ = 0.0f;
+  // T_G_C_ at the time the segment was voxelized.
+  voxblox::Transformation voxelized_T_G_C_;
+};
+
+// Recycles segments across frames. A released segment keeps the capacity of
+// its point buffers, so that in steady state filling the segments of a frame
+// allocates neither the segments nor their buffers. Any segment allocated
+// with new can be released into the pool, which owns it from then on.
+// Thread safe.
+class SegmentPool {
+ public:
+  // Counters accumulated since the last resetStats().
+  struct Stats {
+    size_t num_acquired_segments = 0u;
+    // Acquired segments that had to be allocated, as the pool was empty.
+    size_t num_allocated_segments = 0u;
+    // Released segments deleted as the pool was full.
+    size_t num_deleted_segments = 0u;
+  };
+
+  explicit SegmentPool(
+      const size_t max_pooled_segments = kDefaultMaxPooledSegments);
+
+  ~SegmentPool();
+
+  SegmentPool(const SegmentPool&) = delete;
+  SegmentPool& operator=(const SegmentPool&) = delete;
+
+  // Returns a segment without points with the given transform and labels.
+  Segment* acquire(const Transformation& T_G_C, const Label label,
+                   const SemanticLabel semantic_label,
+                   const InstanceLabel instance_label);
+
+  void release(Segment* segment);
+
+  // Releases all the segments and clears the vector.
+  void release(std::vector<Segment*>* segments);
+
+  Stats getStats();
+  void resetStats();
+
+  static constexpr size_t kDefaultMaxPooledSegments = 1024u;
+
+ private:
+  const size_t max_pooled_segments_;
+  std::mutex mutex_;
+  std::vector<Segment*> free_segments_;
+  Stats stats_;
 };
+
+// Split a pointcloud holding all the segments of a frame into one segment per
+// distinct label in a single pass over the points. The segments are appended
+// to segments in the order they first appear in the cloud, non-finite points
+// are skipped. The segments are acquired from the segment pool. With semantic
+// instance segmentation, the instance and semantic labels of a segment are
+// the ones of its first point.
+void splitFramePointCloud(
+    const pcl::PointCloud<voxblox::PointLabelType>& point_cloud,
+    const Transformation& T_G_C, SegmentPool* segment_pool,
+    std::vector<Segment*>* segments);
+
+void splitFramePointCloud(
+    const pcl::PointCloud<voxblox::PointSemanticInstanceLabelType>&
+        point_cloud,
+    const Transformation& T_G_C, SegmentPool* segment_pool,
+    std::vector<Segment*>* segments);
+
 }  // namespace voxblox
 
 #endif  // GLOBAL_SEGMENT_MAP_SEGMENT_H_
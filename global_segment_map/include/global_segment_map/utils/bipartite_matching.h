@@ -0,0 +1,32 @@
+#ifndef GLOBAL_SEGMENT_MAP_UTILS_BIPARTITE_MATCHING_H_
+#define GLOBAL_SEGMENT_MAP_UTILS_BIPARTITE_MATCHING_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace voxblox {
+
+struct WeightedEdge {
+  size_t row;
+  size_t col;
+  uint64_t weight;
+};
+
+constexpr int kUnmatched = -1;
+
+// Matching of maximum total weight of a sparse bipartite graph, in which
+// rows and columns may stay unmatched. Solved as a min-cost assignment by
+// successive shortest augmenting paths, where every row can also take a
+// private unmatched column. Each row is added with one Dijkstra search over
+// the edges, so the cost is O(num_rows * (num_edges + num_cols) * log) no
+// matter how the weights are distributed. Ties between matchings of equal
+// weight are broken by the order of the edges.
+// Sets row_matches to the column matched to every row, or kUnmatched.
+void computeMaxWeightMatching(const size_t num_rows, const size_t num_cols,
+                              const std::vector<WeightedEdge>& edges,
+                              std::vector<int>* row_matches);
+
+}  // namespace voxblox
+
+#endif  // GLOBAL_SEGMENT_MAP_UTILS_BIPARTITE_MATCHING_H_
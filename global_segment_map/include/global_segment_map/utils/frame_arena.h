@@ -0,0 +1,111 @@
+#ifndef GLOBAL_SEGMENT_MAP_UTILS_FRAME_ARENA_H_
+#define GLOBAL_SEGMENT_MAP_UTILS_FRAME_ARENA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+namespace voxblox {
+
+// Monotonic memory resource for data that lives for a single frame.
+// Allocations are carved out of large chunks and never freed individually,
+// everything is released at once by reset(). If a frame needed more than one
+// chunk, they are replaced by a single chunk large enough for the whole
+// frame, so that in steady state a frame does not allocate at all.
+// Not thread safe.
+class FrameArena {
+ public:
+  // Allocation counters accumulated since the last resetStats().
+  struct Stats {
+    // Allocations served by the arena.
+    size_t num_allocations = 0u;
+    size_t num_allocated_bytes = 0u;
+    // Chunks allocated from the heap to serve them.
+    size_t num_chunk_allocations = 0u;
+  };
+
+  explicit FrameArena(const size_t initial_chunk_size = kDefaultChunkSize);
+
+  ~FrameArena();
+
+  FrameArena(const FrameArena&) = delete;
+  FrameArena& operator=(const FrameArena&) = delete;
+
+  void* allocate(const size_t num_bytes, const size_t alignment);
+
+  // Invalidates all memory allocated from the arena.
+  void reset();
+
+  inline const Stats& getStats() const { return stats_; }
+  inline void resetStats() { stats_ = Stats(); }
+
+  static constexpr size_t kDefaultChunkSize = 1u << 16u;
+
+ private:
+  struct Chunk {
+    uint8_t* data;
+    size_t size;
+  };
+
+  void allocateChunk(const size_t min_size);
+
+  std::vector<Chunk> chunks_;
+  // Bytes used in the last chunk.
+  size_t chunk_offset_;
+  // Bytes used in all chunks, including alignment padding.
+  size_t num_used_bytes_;
+  Stats stats_;
+};
+
+// Allocator placing the elements of a container into a FrameArena. Without
+// an arena it falls back to the heap, so containers can still be default
+// constructed. Containers sharing an arena must be cleared before it is
+// reset.
+template <typename T>
+class ArenaAllocator {
+ public:
+  typedef T value_type;
+
+  ArenaAllocator() : arena_(nullptr) {}
+
+  explicit ArenaAllocator(FrameArena* arena) : arena_(arena) {}
+
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& other)  // NOLINT
+      : arena_(other.getArena()) {}
+
+  inline T* allocate(const size_t n) {
+    if (arena_ == nullptr) {
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  inline void deallocate(T* pointer, const size_t /*n*/) {
+    if (arena_ == nullptr) {
+      ::operator delete(pointer);
+    }
+  }
+
+  inline FrameArena* getArena() const { return arena_; }
+
+ private:
+  FrameArena* arena_;
+};
+
+template <typename T, typename U>
+inline bool operator==(const ArenaAllocator<T>& lhs,
+                       const ArenaAllocator<U>& rhs) {
+  return lhs.getArena() == rhs.getArena();
+}
+
+template <typename T, typename U>
+inline bool operator!=(const ArenaAllocator<T>& lhs,
+                       const ArenaAllocator<U>& rhs) {
+  return !(lhs == rhs);
+}
+
+}  // namespace voxblox
+
+#endif  // GLOBAL_SEGMENT_MAP_UTILS_FRAME_ARENA_H_
@@ -0,0 +1,75 @@
+#ifndef GLOBAL_SEGMENT_MAP_UTILS_INDEX_BLOOM_FILTER_H_
+#define GLOBAL_SEGMENT_MAP_UTILS_INDEX_BLOOM_FILTER_H_
+
+#include <cstdint>
+#include <vector>
+
+#include <voxblox/core/common.h>
+
+namespace voxblox {
+
+// Bloom filter over global voxel indices with two hash functions. A negative
+// answer of mayContain() is exact, a positive one has to be confirmed with
+// the exact set. With the default of 16 bits per index about 1.4% of the
+// indices not in the set are reported as possibly contained.
+class GlobalIndexBloomFilter {
+ public:
+  GlobalIndexBloomFilter() : bit_mask_(0u) {}
+
+  // Clears the filter and sizes it for num_indices insertions.
+  inline void reset(const size_t num_indices,
+                    const size_t bits_per_index = 16u) {
+    size_t num_bits = kBitsPerWord;
+    while (num_bits < num_indices * bits_per_index) {
+      num_bits <<= 1u;
+    }
+    words_.assign(num_bits / kBitsPerWord, 0u);
+    bit_mask_ = num_bits - 1u;
+  }
+
+  inline void insert(const GlobalIndex& global_index) {
+    const uint64_t hash = computeHash(global_index);
+    setBit(hash & bit_mask_);
+    setBit((hash >> 32u) & bit_mask_);
+  }
+
+  inline bool mayContain(const GlobalIndex& global_index) const {
+    if (words_.empty()) {
+      return false;
+    }
+    const uint64_t hash = computeHash(global_index);
+    return getBit(hash & bit_mask_) && getBit((hash >> 32u) & bit_mask_);
+  }
+
+ private:
+  static constexpr size_t kBitsPerWord = 64u;
+
+  static inline uint64_t computeHash(const GlobalIndex& global_index) {
+    uint64_t hash = static_cast<uint64_t>(global_index.x()) *
+                    UINT64_C(0x9E3779B97F4A7C15);
+    hash ^= static_cast<uint64_t>(global_index.y()) *
+            UINT64_C(0xC2B2AE3D27D4EB4F);
+    hash ^= static_cast<uint64_t>(global_index.z()) *
+            UINT64_C(0x165667B19E3779F9);
+    // Final mixing, so that both halves of the hash depend on all bits.
+    hash ^= hash >> 29u;
+    hash *= UINT64_C(0xBF58476D1CE4E5B9);
+    hash ^= hash >> 32u;
+    return hash;
+  }
+
+  inline void setBit(const uint64_t bit) {
+    words_[bit / kBitsPerWord] |= UINT64_C(1) << (bit % kBitsPerWord);
+  }
+
+  inline bool getBit(const uint64_t bit) const {
+    return (words_[bit / kBitsPerWord] >> (bit % kBitsPerWord)) & 1u;
+  }
+
+  std::vector<uint64_t> words_;
+  uint64_t bit_mask_;
+};
+
+}  // namespace voxblox
+
+#endif  // GLOBAL_SEGMENT_MAP_UTILS_INDEX_BLOOM_FILTER_H_
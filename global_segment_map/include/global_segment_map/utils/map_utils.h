@@ -13,7 +13,6 @@ inline void createPointcloudFromMap(const LabelTsdfMap& map,
   pointcloud->clear();
 
   const Layer<TsdfVoxel>& tsdf_layer = map.getTsdfLayer();
-  const Layer<LabelVoxel>& label_layer = map.getLabelLayer();
 
   const SemanticInstanceLabelFusion semantic_instance_label_fusion =
       map.getSemanticInstanceLabelFusion();
@@ -29,8 +28,11 @@ inline void createPointcloudFromMap(const LabelTsdfMap& map,
   double intensity = 0.0;
   // Iterate over all blocks.
   for (const BlockIndex& index : blocks) {
-    const Block<TsdfVoxel>& tsdf_block = tsdf_layer.getBlockByIndex(index);
-    const Block<LabelVoxel>& label_block = label_layer.getBlockByIndex(index);
+    Block<TsdfVoxel>::ConstPtr tsdf_block_ptr;
+    Block<LabelVoxel>::ConstPtr label_block_ptr;
+    map.getBlockPair(index, &tsdf_block_ptr, &label_block_ptr);
+    CHECK(tsdf_block_ptr);
+    const Block<TsdfVoxel>& tsdf_block = *tsdf_block_ptr;
 
     // Iterate over all voxels in said blocks.
     for (size_t linear_index = 0; linear_index < num_voxels_per_block;
@@ -38,7 +40,12 @@ inline void createPointcloudFromMap(const LabelTsdfMap& map,
       Point coord = tsdf_block.computeCoordinatesFromLinearIndex(linear_index);
 
       TsdfVoxel tsdf_voxel = tsdf_block.getVoxelByLinearIndex(linear_index);
-      LabelVoxel label_voxel = label_block.getVoxelByLinearIndex(linear_index);
+      // Blocks away from any surface have no label block, their voxels are
+      // unlabelled.
+      LabelVoxel label_voxel;
+      if (label_block_ptr) {
+        label_voxel = label_block_ptr->getVoxelByLinearIndex(linear_index);
+      }
 
       constexpr float kMinWeight = 0.0f;
       constexpr float kFramesCountThresholdFactor = 0.1f;
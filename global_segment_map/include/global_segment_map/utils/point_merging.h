@@ -0,0 +1,26 @@
+#ifndef GLOBAL_SEGMENT_MAP_UTILS_POINT_MERGING_H_
+#define GLOBAL_SEGMENT_MAP_UTILS_POINT_MERGING_H_
+
+#include <voxblox/core/common.h>
+
+#include "global_segment_map/common.h"
+
+namespace voxblox {
+
+// Merges the points at point_indices into their weighted mean point and
+// color and their total weight, in a single pass. The weight of a point is
+// the same as in TsdfIntegratorBase::getVoxelWeight(), i.e. 1 if
+// use_const_weight is set and 1 / z^2 otherwise, times the count of the
+// point in point_counts if it is not empty. Vectorized with AVX2 or
+// SSE2 if the build enables them, with a scalar fallback otherwise.
+// Matches merging the points one by one up to floating point rounding; the
+// color channels are only rounded once instead of after every point.
+void mergeWeightedPoints(const Pointcloud& points_C, const Colors& colors,
+                         const PointCounts& point_counts,
+                         const AlignedVector<size_t>& point_indices,
+                         const bool use_const_weight, Point* merged_point_C,
+                         Color* merged_color, FloatingPoint* merged_weight);
+
+}  // namespace voxblox
+
+#endif  // GLOBAL_SEGMENT_MAP_UTILS_POINT_MERGING_H_
@@ -0,0 +1,52 @@
+#ifndef GLOBAL_SEGMENT_MAP_UTILS_THREAD_POOL_H_
+#define GLOBAL_SEGMENT_MAP_UTILS_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace voxblox {
+
+// Fixed set of worker threads that are kept alive for the lifetime of the
+// pool. A task is executed once on every participating thread and the caller
+// blocks until all of them are done. The calling thread takes part in the
+// work as thread 0, so a pool of n threads only spawns n - 1 workers.
+class ThreadPool {
+ public:
+  typedef std::function<void(const size_t thread_idx)> Task;
+
+  explicit ThreadPool(const size_t num_threads);
+
+  ~ThreadPool();
+
+  inline size_t numThreads() const { return num_threads_; }
+
+  // Runs task(thread_idx) for thread_idx in [0, num_threads) and returns once
+  // all of them have finished. The task is shared by reference, so anything
+  // it captures is not copied. If num_threads is 1 or less the task is run
+  // inline on the calling thread. Not thread safe, only one caller at a time.
+  void run(const size_t num_threads, const Task& task);
+
+ private:
+  void workerLoop(const size_t thread_idx);
+
+  const size_t num_threads_;
+  std::vector<std::thread> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable task_available_;
+  std::condition_variable task_done_;
+
+  // State of the current task, protected by mutex_.
+  const Task* task_;
+  size_t num_task_threads_;
+  size_t num_pending_threads_;
+  size_t task_generation_;
+  bool shutdown_;
+};
+
+}  // namespace voxblox
+
+#endif  // GLOBAL_SEGMENT_MAP_UTILS_THREAD_POOL_H_
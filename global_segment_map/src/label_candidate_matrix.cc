@@ -0,0 +1,127 @@
+#include "global_segment_map/label_candidate_matrix.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+namespace voxblox {
+
+constexpr size_t LabelCandidateMatrix::kNumLabels;
+
+LabelCandidateMatrix::LabelCandidateMatrix(
+    const std::vector<Segment*>& segments)
+    : segments_(segments),
+      segment_labels_(segments.size()),
+      is_segment_labelled_(segments.size(), false),
+      num_pushed_entries_(0u),
+      num_outdated_entries_(0u) {
+  CHECK_LE(segments_.size(), std::numeric_limits<uint32_t>::max());
+  segment_indices_.reserve(segments_.size());
+  for (size_t segment_idx = 0u; segment_idx < segments_.size();
+       ++segment_idx) {
+    segment_indices_.emplace(segments_[segment_idx], segment_idx);
+  }
+}
+
+size_t LabelCandidateMatrix::getSegmentIndex(Segment* segment) const {
+  const auto segment_it = segment_indices_.find(segment);
+  CHECK(segment_it != segment_indices_.end())
+      << "Label candidate of a segment not in the frame.";
+  return segment_it->second;
+}
+
+size_t LabelCandidateMatrix::getCount(const Label label,
+                                      const size_t segment_idx) const {
+  const auto count_it = counts_.find(getKey(label, segment_idx));
+  return count_it == counts_.end() ? 0u : count_it->second;
+}
+
+void LabelCandidateMatrix::setCount(const Label label,
+                                    const size_t segment_idx,
+                                    const size_t count) {
+  DCHECK_LT(segment_idx, segments_.size());
+  const uint64_t key = getKey(label, segment_idx);
+  if (count == 0u) {
+    counts_.erase(key);
+    return;
+  }
+  const auto insert_status = counts_.emplace(key, count);
+  if (insert_status.second) {
+    label_segments_[label].push_back(segment_idx);
+    segment_labels_[segment_idx].push_back(label);
+  } else if (insert_status.first->second == count) {
+    return;
+  } else {
+    insert_status.first->second = count;
+  }
+  heap_.push(Entry{count, label, segment_idx, segments_[segment_idx]});
+  ++num_pushed_entries_;
+}
+
+void LabelCandidateMatrix::eraseSegment(const size_t segment_idx,
+                                        const Label keep_label) {
+  DCHECK_LT(segment_idx, segments_.size());
+  std::vector<Label>& segment_labels = segment_labels_[segment_idx];
+  bool has_keep_label = false;
+  for (const Label label : segment_labels) {
+    if (label == keep_label) {
+      has_keep_label = true;
+    } else {
+      counts_.erase(getKey(label, segment_idx));
+    }
+  }
+  segment_labels.clear();
+  if (has_keep_label &&
+      counts_.find(getKey(keep_label, segment_idx)) != counts_.end()) {
+    segment_labels.push_back(keep_label);
+  }
+}
+
+void LabelCandidateMatrix::getLabelSegments(
+    const Label label, std::vector<size_t>* segment_indices) const {
+  CHECK_NOTNULL(segment_indices);
+  segment_indices->clear();
+  const auto label_segments_it = label_segments_.find(label);
+  if (label_segments_it == label_segments_.end()) {
+    return;
+  }
+  // A removed pair that was added again is listed twice.
+  for (const size_t segment_idx : label_segments_it->second) {
+    if (counts_.find(getKey(label, segment_idx)) != counts_.end()) {
+      segment_indices->push_back(segment_idx);
+    }
+  }
+  std::sort(segment_indices->begin(), segment_indices->end());
+  segment_indices->erase(
+      std::unique(segment_indices->begin(), segment_indices->end()),
+      segment_indices->end());
+}
+
+bool LabelCandidateMatrix::popMaxCount(const size_t min_count, Label* label,
+                                       size_t* segment_idx, size_t* count) {
+  CHECK_NOTNULL(label);
+  CHECK_NOTNULL(segment_idx);
+  CHECK_NOTNULL(count);
+  while (!heap_.empty()) {
+    const Entry entry = heap_.top();
+    if (entry.count <= min_count) {
+      // All the remaining entries are smaller, but they stay valid for
+      // later calls.
+      return false;
+    }
+    heap_.pop();
+    if (is_label_assigned_[entry.label] ||
+        is_segment_labelled_[entry.segment_idx] ||
+        getCount(entry.label, entry.segment_idx) != entry.count) {
+      ++num_outdated_entries_;
+      continue;
+    }
+    *label = entry.label;
+    *segment_idx = entry.segment_idx;
+    *count = entry.count;
+    return true;
+  }
+  return false;
+}
+
+}  // namespace voxblox
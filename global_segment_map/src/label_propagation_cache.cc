@@ -0,0 +1,101 @@
+#include "global_segment_map/label_propagation_cache.h"
+
+#include <utility>
+
+#include <glog/logging.h>
+
+namespace voxblox {
+
+LabelPropagationCache::LabelPropagationCache() {}
+
+void LabelPropagationCache::clear() {
+  entries_.clear();
+  voxel_entries_.clear();
+}
+
+void LabelPropagationCache::update(const Transformation& T_G_C,
+                                   const std::vector<Segment*>& segments,
+                                   const FloatingPoint min_confidence,
+                                   std::vector<Entry>* entries) {
+  CHECK_NOTNULL(entries);
+  CHECK_EQ(segments.size(), entries->size());
+  clear();
+  T_G_C_ = T_G_C;
+  for (size_t segment_idx = 0u; segment_idx < segments.size();
+       ++segment_idx) {
+    const Segment* segment = CHECK_NOTNULL(segments[segment_idx]);
+    Entry& entry = (*entries)[segment_idx];
+    if (entry.confidence < min_confidence) {
+      continue;
+    }
+    const size_t entry_idx = entries_.size();
+    entries_.push_back(std::move(entry));
+    for (const GlobalIndex& voxel_idx : segment->voxel_indices_) {
+      voxel_entries_.emplace(voxel_idx, entry_idx);
+    }
+  }
+}
+
+bool LabelPropagationCache::isCameraCoherent(
+    const Transformation& T_G_C, const FloatingPoint max_translation_m,
+    const FloatingPoint max_rotation_rad) const {
+  const FloatingPoint translation =
+      (T_G_C.getPosition() - T_G_C_.getPosition()).norm();
+  const FloatingPoint rotation =
+      T_G_C.getRotation().toImplementation().angularDistance(
+          T_G_C_.getRotation().toImplementation());
+  return translation <= max_translation_m && rotation <= max_rotation_rad;
+}
+
+const LabelPropagationCache::Entry* LabelPropagationCache::lookup(
+    const Segment& segment, const FloatingPoint min_overlap_ratio,
+    size_t* overlap_count) const {
+  CHECK_NOTNULL(overlap_count);
+  // Raw points of the segment covered by each entry. A segment overlaps
+  // only a few entries, and consecutive voxels mostly the same one.
+  std::vector<std::pair<size_t, size_t>> entry_counts;
+  size_t num_raw_points = 0u;
+  for (size_t voxel = 0u; voxel < segment.getNumVoxels(); ++voxel) {
+    const uint32_t point_count = segment.voxel_point_counts_[voxel];
+    num_raw_points += point_count;
+    const auto voxel_entry_it =
+        voxel_entries_.find(segment.voxel_indices_[voxel]);
+    if (voxel_entry_it == voxel_entries_.end()) {
+      continue;
+    }
+    const size_t entry_idx = voxel_entry_it->second;
+    if (entry_counts.empty() || entry_counts.back().first != entry_idx) {
+      std::vector<std::pair<size_t, size_t>>::iterator entry_count_it =
+          entry_counts.begin();
+      while (entry_count_it != entry_counts.end() &&
+             entry_count_it->first != entry_idx) {
+        ++entry_count_it;
+      }
+      if (entry_count_it == entry_counts.end()) {
+        entry_counts.emplace_back(entry_idx, 0u);
+      } else {
+        // Keep the entry of the current voxel last.
+        std::swap(*entry_count_it, entry_counts.back());
+      }
+    }
+    entry_counts.back().second += point_count;
+  }
+
+  const std::pair<size_t, size_t>* best_entry_count = nullptr;
+  for (const std::pair<size_t, size_t>& entry_count : entry_counts) {
+    if (best_entry_count == nullptr ||
+        entry_count.second > best_entry_count->second ||
+        (entry_count.second == best_entry_count->second &&
+         entry_count.first < best_entry_count->first)) {
+      best_entry_count = &entry_count;
+    }
+  }
+  if (best_entry_count == nullptr ||
+      best_entry_count->second < min_overlap_ratio * num_raw_points) {
+    return nullptr;
+  }
+  *overlap_count = best_entry_count->second;
+  return &entries_[best_entry_count->first];
+}
+
+}  // namespace voxblox
@@ -1,18 +1,43 @@
 #include "global_segment_map/label_tsdf_integrator.h"
 
+#include <cmath>
+#include <random>
+
 namespace voxblox {
 
+namespace {
+
+// Hints the cache to load the voxel before it is updated.
+template <typename VoxelType>
+inline void prefetchForWrite(const VoxelType* voxel) {
+#if defined(__GNUC__)
+  constexpr int kWrite = 1;
+  constexpr int kHighTemporalLocality = 3;
+  __builtin_prefetch(voxel, kWrite, kHighTemporalLocality);
+#endif
+}
+
+}  // namespace
+
+constexpr int LabelTsdfIntegrator::SegmentedDepthImage::kNoSegment;
+
 LabelTsdfIntegrator::LabelTsdfIntegrator(
     const Config& tsdf_config, const LabelTsdfConfig& label_tsdf_config,
     LabelTsdfMap* map)
     : MergedTsdfIntegrator(tsdf_config, CHECK_NOTNULL(map->getTsdfLayerPtr())),
       label_tsdf_config_(label_tsdf_config),
       label_layer_(CHECK_NOTNULL(map->getLabelLayerPtr())),
-      label_count_map_ptr_(map->getLabelCountPtr()),
+      label_tsdf_map_(map),
+      thread_pool_(new ThreadPool(config_.integrator_threads)),
+      label_stats_per_thread_(thread_pool_->numThreads()),
+      ray_traversal_stats_per_thread_(thread_pool_->numThreads()),
+      candidate_arenas_per_thread_(thread_pool_->numThreads()),
+      map_version_(0u),
       highest_label_ptr_(CHECK_NOTNULL(map->getHighestLabelPtr())),
-      highest_instance_ptr_(CHECK_NOTNULL(map->getHighestInstancePtr())),
+      label_count_map_ptr_(map->getLabelCountPtr()),
       semantic_instance_label_fusion_ptr_(
-          map->getSemanticInstanceLabelFusionPtr()) {}
+          map->getSemanticInstanceLabelFusionPtr()),
+      highest_instance_ptr_(CHECK_NOTNULL(map->getHighestInstancePtr())) {}
 
 void LabelTsdfIntegrator::checkForSegmentLabelMergeCandidate(
     const Label& label, const int label_points_count,
@@ -31,29 +56,19 @@ void LabelTsdfIntegrator::checkForSegmentLabelMergeCandidate(
 
 void LabelTsdfIntegrator::increaseLabelCountForSegment(
     Segment* segment, const Label& label, const int segment_points_count,
-    std::map<Label, std::map<Segment*, size_t>>* candidates,
+    const uint32_t point_count, LabelCandidates* candidates,
     std::unordered_set<Label>* merge_candidate_labels) {
   CHECK_NOTNULL(segment);
   CHECK_NOTNULL(candidates);
   CHECK_NOTNULL(merge_candidate_labels);
-  auto label_it = candidates->find(label);
-  if (label_it != candidates->end()) {
-    auto segment_it = label_it->second.find(segment);
-    if (segment_it != label_it->second.end()) {
-      ++segment_it->second;
-
-      if (label_tsdf_config_.enable_pairwise_confidence_merging) {
-        checkForSegmentLabelMergeCandidate(label, segment_it->second,
-                                           segment_points_count,
-                                           merge_candidate_labels);
-      }
-    } else {
-      label_it->second.emplace(segment, 1u);
-    }
-  } else {
-    std::map<Segment*, size_t> segment_points_count;
-    segment_points_count.emplace(segment, 1u);
-    candidates->emplace(label, segment_points_count);
+  // A voxel adds all of its points at once, so the overlap is checked
+  // whenever the count grows, including when the pair is added.
+  size_t& label_points_count = (*candidates)[label][segment];
+  label_points_count += point_count;
+  if (label_tsdf_config_.enable_pairwise_confidence_merging) {
+    checkForSegmentLabelMergeCandidate(label, label_points_count,
+                                       segment_points_count,
+                                       merge_candidate_labels);
   }
 }
 
@@ -173,142 +188,759 @@ void LabelTsdfIntegrator::addVoxelLabelConfidence(
   }
 }
 
+template <typename VoxelLabelGetter>
+bool LabelTsdfIntegrator::countSegmentVoxelLabels(
+    Segment* segment, const VoxelLabelGetter& get_voxel_label,
+    LabelCandidates* candidates,
+    SegmentMergeCandidates* segment_merge_candidates,
+    LabelPropagationStats* stats) {
+  CHECK_NOTNULL(segment);
+  CHECK_NOTNULL(candidates);
+  CHECK_NOTNULL(segment_merge_candidates);
+  CHECK_NOTNULL(stats);
+  const int segment_points_count = segment->getNumRawPoints();
+  std::unordered_set<Label> merge_candidate_labels;
+
+  // Each voxel votes once, with the number of points falling into it.
+  segment->voxelize(voxel_size_inv_);
+  const size_t num_voxels = segment->getNumVoxels();
+  ++stats->num_counted_segments;
+  stats->num_counted_voxels += num_voxels;
+  std::map<Label, size_t> label_counts;
+  std::vector<size_t> sampled_voxels;
+  if (getSampledSegmentVoxels(*segment, &sampled_voxels)) {
+    ++stats->num_sampled_segments;
+    const size_t batch_size = getSampledLabelVotingBatchSize();
+    std::map<Label, std::pair<double, double>> label_sample_sums;
+    size_t num_samples = 0u;
+    do {
+      for (size_t sample = num_samples; sample < num_samples + batch_size;
+           ++sample) {
+        const size_t voxel = sampled_voxels[sample];
+        const Label label = get_voxel_label(voxel);
+        ++stats->num_voxel_lookups;
+        if (label != 0u) {
+          const double point_count = segment->voxel_point_counts_[voxel];
+          std::pair<double, double>& sample_sums = label_sample_sums[label];
+          sample_sums.first += point_count;
+          sample_sums.second += point_count * point_count;
+        }
+      }
+      num_samples += batch_size;
+    } while (num_samples < sampled_voxels.size() &&
+             !isTopLabelDecided(label_sample_sums, num_samples));
+
+    // Scaled up from the sampled to all the voxels of the segment.
+    const double scale = static_cast<double>(num_voxels) / num_samples;
+    for (const std::pair<const Label, std::pair<double, double>>&
+             label_sample_sum : label_sample_sums) {
+      label_counts[label_sample_sum.first] = std::max<size_t>(
+          std::llround(label_sample_sum.second.first * scale), 1u);
+    }
+  } else {
+    for (size_t voxel = 0u; voxel < num_voxels; ++voxel) {
+      const Label label = get_voxel_label(voxel);
+      ++stats->num_voxel_lookups;
+      if (label != 0u) {
+        label_counts[label] += segment->voxel_point_counts_[voxel];
+      }
+    }
+  }
+
+  for (const std::pair<const Label, size_t>& label_count : label_counts) {
+    increaseLabelCountForSegment(segment, label_count.first,
+                                 segment_points_count, label_count.second,
+                                 candidates, &merge_candidate_labels);
+  }
+
+  if (label_tsdf_config_.enable_pairwise_confidence_merging) {
+    std::vector<Label> merge_candidates;
+    std::copy(merge_candidate_labels.begin(), merge_candidate_labels.end(),
+              std::back_inserter(merge_candidates));
+    (*segment_merge_candidates)[segment] = merge_candidates;
+  }
+  // Flag to check whether there exists at least one label candidate.
+  return !label_counts.empty();
+}
+
 void LabelTsdfIntegrator::computeSegmentLabelCandidates(
-    Segment* segment, std::map<Label, std::map<Segment*, size_t>>* candidates,
-    std::map<Segment*, std::vector<Label>>* segment_merge_candidates,
+    Segment* segment, LabelCandidates* candidates,
+    SegmentMergeCandidates* segment_merge_candidates,
     const std::set<Label>& assigned_labels) {
   CHECK_NOTNULL(segment);
   CHECK_NOTNULL(candidates);
+  // Previously unobserved segment gets an unseen label.
+  if (!countSegmentLabelCandidates(segment, assigned_labels, candidates,
+                                   segment_merge_candidates,
+                                   &label_propagation_stats_)) {
+    Label fresh_label = getFreshLabel();
+    (*candidates)[fresh_label].emplace(segment, segment->getNumRawPoints());
+  }
+}
+
+void LabelTsdfIntegrator::computeFrameLabelCandidates(
+    const std::vector<Segment*>& segments,
+    std::vector<SegmentLabelVotes>* segment_label_votes,
+    LabelCandidates* candidates,
+    SegmentMergeCandidates* segment_merge_candidates) {
+  if (segment_label_votes != nullptr) {
+    CHECK_EQ(segment_label_votes->size(), segments.size());
+  }
+  CHECK_NOTNULL(candidates);
   CHECK_NOTNULL(segment_merge_candidates);
-  // Flag to check whether there exists at least one label candidate.
-  bool candidate_label_exists = false;
-  const int segment_points_count = segment->points_C_.size();
-  std::unordered_set<Label> merge_candidate_labels;
+  timing::Timer count_timer("compute_frame_label_candidates/count");
+  std::vector<LabelCandidates> candidates_per_thread;
+  std::vector<SegmentMergeCandidates> merge_candidates_per_thread;
+  candidates_per_thread.reserve(candidate_arenas_per_thread_.size());
+  merge_candidates_per_thread.reserve(candidate_arenas_per_thread_.size());
+  for (FrameArena& arena : candidate_arenas_per_thread_) {
+    candidates_per_thread.emplace_back(
+        LabelCandidates::allocator_type(ArenaAllocator<Label>(&arena)));
+    merge_candidates_per_thread.emplace_back(ArenaAllocator<Label>(&arena));
+  }
 
-  for (const Point& point_C : segment->points_C_) {
-    const Point point_G = segment->T_G_C_ * point_C;
+  const bool use_propagation_cache =
+      isPropagationCacheEnabled() && !segments.empty() &&
+      !propagation_cache_.empty() &&
+      propagation_cache_.isCameraCoherent(
+          segments.front()->T_G_C_,
+          label_tsdf_config_.propagation_cache_max_translation_m,
+          label_tsdf_config_.propagation_cache_max_rotation_rad);
+
+  // The map is not changed until the frame is integrated, so the segments
+  // only read it, and recount their own votes. Not a vector<bool>, as the
+  // threads write distinct elements concurrently.
+  std::vector<uint8_t> has_candidates(segments.size(), 0u);
+  std::vector<LabelPropagationStats> stats_per_thread(
+      thread_pool_->numThreads());
+  const std::set<Label> assigned_labels;
+  std::atomic<size_t> next_segment_idx(0u);
+  thread_pool_->run(segments.size(), [&](const size_t thread_idx) {
+    size_t segment_idx;
+    while ((segment_idx = next_segment_idx.fetch_add(1u)) < segments.size()) {
+      Segment* segment = CHECK_NOTNULL(segments[segment_idx]);
+      if (use_propagation_cache &&
+          lookupPropagationCache(segment, &candidates_per_thread[thread_idx])) {
+        ++stats_per_thread[thread_idx].num_propagation_cache_hits;
+        has_candidates[segment_idx] = 1u;
+        continue;
+      }
+      if (segment_label_votes == nullptr) {
+        has_candidates[segment_idx] = countSegmentLabelCandidates(
+            segment, assigned_labels, &candidates_per_thread[thread_idx],
+            &merge_candidates_per_thread[thread_idx],
+            &stats_per_thread[thread_idx]);
+        continue;
+      }
+      // The votes may have been counted before the previous frame was
+      // integrated and merged.
+      SegmentLabelVotes& segment_votes = (*segment_label_votes)[segment_idx];
+      segment->voxelize(voxel_size_inv_);
+      CHECK_EQ(segment_votes.voxel_labels.size(), segment->getNumVoxels());
+      stats_per_thread[thread_idx].num_recounted_vote_blocks +=
+          countSegmentLabelVotes(&segment_votes);
+      stats_per_thread[thread_idx].num_vote_blocks +=
+          segment_votes.block_votes.size();
+      has_candidates[segment_idx] = countSegmentVoxelLabels(
+          segment,
+          [&segment_votes](const size_t voxel) {
+            return segment_votes.voxel_labels[voxel];
+          },
+          &candidates_per_thread[thread_idx],
+          &merge_candidates_per_thread[thread_idx],
+          &stats_per_thread[thread_idx]);
+    }
+  });
+  count_timer.Stop();
+  if (use_propagation_cache) {
+    label_propagation_stats_.num_propagation_cache_lookups += segments.size();
+  }
+  for (const LabelPropagationStats& thread_stats : stats_per_thread) {
+    label_propagation_stats_.num_propagation_cache_hits +=
+        thread_stats.num_propagation_cache_hits;
+    label_propagation_stats_.num_counted_segments +=
+        thread_stats.num_counted_segments;
+    label_propagation_stats_.num_counted_voxels +=
+        thread_stats.num_counted_voxels;
+    label_propagation_stats_.num_voxel_lookups +=
+        thread_stats.num_voxel_lookups;
+    label_propagation_stats_.num_sampled_segments +=
+        thread_stats.num_sampled_segments;
+    label_propagation_stats_.num_vote_blocks += thread_stats.num_vote_blocks;
+    label_propagation_stats_.num_recounted_vote_blocks +=
+        thread_stats.num_recounted_vote_blocks;
+  }
+
+  // Every segment was handled by a single thread, so the tables of the
+  // threads have no segment in common.
+  timing::Timer merge_timer("compute_frame_label_candidates/merge");
+  for (size_t thread_idx = 0u; thread_idx < candidates_per_thread.size();
+       ++thread_idx) {
+    for (const LabelCandidates::value_type& label_candidates :
+         candidates_per_thread[thread_idx]) {
+      (*candidates)[label_candidates.first].insert(
+          label_candidates.second.begin(), label_candidates.second.end());
+    }
+    segment_merge_candidates->insert(
+        merge_candidates_per_thread[thread_idx].begin(),
+        merge_candidates_per_thread[thread_idx].end());
+    candidates_per_thread[thread_idx].clear();
+    merge_candidates_per_thread[thread_idx].clear();
+    candidate_arenas_per_thread_[thread_idx].reset();
+  }
+
+  // Fresh labels are drawn in the order of the segments, the same ones
+  // computing the candidates segment by segment would draw.
+  for (size_t segment_idx = 0u; segment_idx < segments.size(); ++segment_idx) {
+    if (has_candidates[segment_idx] == 0u) {
+      Segment* segment = segments[segment_idx];
+      Label fresh_label = getFreshLabel();
+      (*candidates)[fresh_label].emplace(segment, segment->getNumRawPoints());
+    }
+  }
+  merge_timer.Stop();
+}
+
+bool LabelTsdfIntegrator::lookupPropagationCache(
+    Segment* segment, LabelCandidates* candidates) {
+  CHECK_NOTNULL(segment);
+  CHECK_NOTNULL(candidates);
+  segment->voxelize(voxel_size_inv_);
+  size_t overlap_count = 0u;
+  const LabelPropagationCache::Entry* entry = propagation_cache_.lookup(
+      *segment, label_tsdf_config_.propagation_cache_min_overlap_ratio,
+      &overlap_count);
+  // The cached label may have been merged into another one since.
+  if (entry == nullptr || label_count_map_ptr_->count(entry->label) == 0u) {
+    return false;
+  }
+  (*candidates)[entry->label][segment] += overlap_count;
+  return true;
+}
 
-    // Get the corresponding voxel by 3D position in world frame.
-    Layer<LabelVoxel>::BlockType::ConstPtr label_block_ptr =
-        label_layer_->getBlockPtrByCoordinates(point_G);
-    // Get the corresponding voxel by 3D position in world frame.
-    Layer<TsdfVoxel>::BlockType::ConstPtr tsdf_block_ptr =
-        layer_->getBlockPtrByCoordinates(point_G);
+void LabelTsdfIntegrator::updatePropagationCache(
+    const std::vector<Segment*>& segments,
+    const std::map<std::pair<Segment*, Label>, size_t>& initial_counts) {
+  if (segments.empty()) {
+    propagation_cache_.clear();
+    return;
+  }
+  std::vector<LabelPropagationCache::Entry> entries(segments.size());
+  for (size_t segment_idx = 0u; segment_idx < segments.size();
+       ++segment_idx) {
+    Segment* segment = segments[segment_idx];
+    segment->voxelize(voxel_size_inv_);
+    LabelPropagationCache::Entry& entry = entries[segment_idx];
+    entry.label = segment->label_;
+    const auto count_it =
+        initial_counts.find(std::make_pair(segment, segment->label_));
+    if (count_it != initial_counts.end()) {
+      entry.confidence = static_cast<FloatingPoint>(count_it->second) /
+                         std::max<size_t>(segment->getNumRawPoints(), 1u);
+    }
+  }
+  propagation_cache_.update(segments.front()->T_G_C_, segments,
+                            label_tsdf_config_.propagation_cache_min_confidence,
+                            &entries);
+}
+
+bool LabelTsdfIntegrator::countSegmentLabelCandidates(
+    Segment* segment, const std::set<Label>& assigned_labels,
+    LabelCandidates* candidates,
+    SegmentMergeCandidates* segment_merge_candidates,
+    LabelPropagationStats* stats) {
+  CHECK_NOTNULL(segment);
+  CHECK_NOTNULL(candidates);
+  CHECK_NOTNULL(segment_merge_candidates);
+  CHECK_NOTNULL(stats);
+  // Label the voxel votes for, 0 if none. Consecutive voxels mostly fall
+  // into the same block.
+  BlockIndex last_block_idx;
+  bool has_last_block = false;
+  Layer<TsdfVoxel>::BlockType::ConstPtr tsdf_block_ptr;
+  Layer<LabelVoxel>::BlockType::ConstPtr label_block_ptr;
+  auto get_voxel_label = [&](const size_t voxel) -> Label {
+    const GlobalIndex& global_voxel_idx = segment->voxel_indices_[voxel];
+
+    // Get the corresponding blocks by 3D position in world frame.
+    const BlockIndex block_idx = getBlockIndexFromGlobalVoxelIndex(
+        global_voxel_idx, voxels_per_side_inv_);
+    if (!has_last_block || block_idx != last_block_idx) {
+      label_tsdf_map_->getBlockPair(block_idx, &tsdf_block_ptr,
+                                    &label_block_ptr);
+      last_block_idx = block_idx;
+      has_last_block = true;
+    }
+    if (label_block_ptr == nullptr) {
+      return 0u;
+    }
+    const VoxelIndex local_voxel_idx =
+        getLocalFromGlobalVoxelIndex(global_voxel_idx, voxels_per_side_);
+    const LabelVoxel& label_voxel =
+        label_block_ptr->getVoxelByVoxelIndex(local_voxel_idx);
+    const TsdfVoxel& tsdf_voxel =
+        tsdf_block_ptr->getVoxelByVoxelIndex(local_voxel_idx);
+    // Do not consider allocated but unobserved voxels which have
+    // label == 0.
+    if (std::abs(tsdf_voxel.distance) >=
+        label_tsdf_config_.label_propagation_td_factor * voxel_size_) {
+      return 0u;
+    }
+    return getNextUnassignedLabel(label_voxel, assigned_labels);
+  };
+
+  return countSegmentVoxelLabels(segment, get_voxel_label, candidates,
+                                 segment_merge_candidates, stats);
+}
+
+bool LabelTsdfIntegrator::getSampledSegmentVoxels(
+    const Segment& segment, std::vector<size_t>* sampled_voxels) const {
+  CHECK_NOTNULL(sampled_voxels);
+  sampled_voxels->clear();
+  const size_t num_voxels = segment.getNumVoxels();
+  const size_t max_samples =
+      label_tsdf_config_.sampled_label_voting_max_samples;
+  if (!label_tsdf_config_.enable_sampled_label_voting ||
+      num_voxels <= max_samples) {
+    return false;
+  }
+  const size_t batch_size = getSampledLabelVotingBatchSize();
+  const size_t num_batches = (max_samples + batch_size - 1u) / batch_size;
+  sampled_voxels->reserve(num_batches * batch_size);
+  // Seeded by the segment, so that a frame is labelled reproducibly.
+  std::minstd_rand random_engine(static_cast<uint32_t>(num_voxels));
+  std::uniform_real_distribution<double> stratum_offset(0.0, 1.0);
+  // The voxels are ordered by the first point hitting them, so the
+  // strata roughly split the segment into image regions.
+  const double stratum_size = static_cast<double>(num_voxels) / batch_size;
+  for (size_t batch = 0u; batch < num_batches; ++batch) {
+    for (size_t stratum = 0u; stratum < batch_size; ++stratum) {
+      sampled_voxels->push_back(std::min(
+          num_voxels - 1u,
+          static_cast<size_t>((stratum + stratum_offset(random_engine)) *
+                              stratum_size)));
+    }
+  }
+  return true;
+}
+
+bool LabelTsdfIntegrator::isTopLabelDecided(
+    const std::map<Label, std::pair<double, double>>& label_sample_sums,
+    const size_t num_samples) const {
+  CHECK_GT(num_samples, 0u);
+  // Sums of the two labels with the highest counts, the second one stays
+  // zero if a single label was sampled.
+  std::pair<double, double> top_sums(0.0, 0.0);
+  std::pair<double, double> second_sums(0.0, 0.0);
+  for (const std::pair<const Label, std::pair<double, double>>&
+           label_sample_sum : label_sample_sums) {
+    if (label_sample_sum.second.first > top_sums.first) {
+      second_sums = top_sums;
+      top_sums = label_sample_sum.second;
+    } else if (label_sample_sum.second.first > second_sums.first) {
+      second_sums = label_sample_sum.second;
+    }
+  }
+  // Every sampled voxel votes for at most one label, so the difference of
+  // the top and second label counts of a sample is its point count for
+  // either of them and 0 otherwise.
+  const double mean_margin = (top_sums.first - second_sums.first) / num_samples;
+  const double margin_variance =
+      std::max((top_sums.second + second_sums.second) / num_samples -
+                   mean_margin * mean_margin,
+               0.0);
+  return mean_margin > label_tsdf_config_.sampled_label_voting_z_score *
+                           std::sqrt(margin_variance / num_samples);
+}
+
+void LabelTsdfIntegrator::groupSegmentPointsByBlock(
+    Segment* segment, SegmentLabelVotes* segment_votes) const {
+  CHECK_NOTNULL(segment);
+  CHECK_NOTNULL(segment_votes);
+  segment_votes->block_votes.clear();
+  segment->voxelize(voxel_size_inv_);
+  segment_votes->voxel_labels.assign(segment->getNumVoxels(), 0u);
+
+  // Only the voxels the counting may sample are grouped, in the order of
+  // the segment.
+  std::vector<size_t> sampled_voxels;
+  const bool is_sampled = getSampledSegmentVoxels(*segment, &sampled_voxels);
+  if (is_sampled) {
+    std::sort(sampled_voxels.begin(), sampled_voxels.end());
+    sampled_voxels.erase(
+        std::unique(sampled_voxels.begin(), sampled_voxels.end()),
+        sampled_voxels.end());
+  }
+  const size_t num_grouped_voxels =
+      is_sampled ? sampled_voxels.size() : segment->getNumVoxels();
+
+  // Consecutive voxels mostly fall into the same block.
+  BlockIndex last_block_idx;
+  BlockLabelVotes* block_votes = nullptr;
+  for (size_t i = 0u; i < num_grouped_voxels; ++i) {
+    const size_t voxel = is_sampled ? sampled_voxels[i] : i;
+    const GlobalIndex& global_voxel_idx = segment->voxel_indices_[voxel];
+    const BlockIndex block_idx = getBlockIndexFromGlobalVoxelIndex(
+        global_voxel_idx, voxels_per_side_inv_);
+    const VoxelIndex local_voxel_idx =
+        getLocalFromGlobalVoxelIndex(global_voxel_idx, voxels_per_side_);
+    const size_t linear_idx =
+        local_voxel_idx.x() +
+        voxels_per_side_ *
+            (local_voxel_idx.y() + voxels_per_side_ * local_voxel_idx.z());
+
+    if (block_votes == nullptr || block_idx != last_block_idx) {
+      block_votes = &segment_votes->block_votes[block_idx];
+      last_block_idx = block_idx;
+    }
+    block_votes->voxels.emplace_back(linear_idx, voxel);
+  }
+}
 
-    if (label_block_ptr != nullptr) {
+size_t LabelTsdfIntegrator::countSegmentLabelVotes(
+    SegmentLabelVotes* segment_votes) const {
+  CHECK_NOTNULL(segment_votes);
+  CHECK(label_tsdf_config_.enable_block_versions);
+  size_t num_counted_blocks = 0u;
+  for (SegmentLabelVotes::BlockVotesMap::value_type& block_votes_pair :
+       segment_votes->block_votes) {
+    BlockLabelVotes& block_votes = block_votes_pair.second;
+    const uint64_t block_version = getBlockVersion(block_votes_pair.first);
+    if (block_votes.is_counted && block_votes.block_version == block_version) {
+      continue;
+    }
+    block_votes.is_counted = true;
+    block_votes.block_version = block_version;
+    ++num_counted_blocks;
+
+    Layer<TsdfVoxel>::BlockType::ConstPtr tsdf_block_ptr;
+    Layer<LabelVoxel>::BlockType::ConstPtr label_block_ptr;
+    label_tsdf_map_->getBlockPair(block_votes_pair.first, &tsdf_block_ptr,
+                                  &label_block_ptr);
+    for (const std::pair<size_t, size_t>& voxel : block_votes.voxels) {
+      Label& voxel_label = segment_votes->voxel_labels[voxel.second];
+      voxel_label = 0u;
+      if (label_block_ptr == nullptr) {
+        continue;
+      }
       const LabelVoxel& label_voxel =
-          label_block_ptr->getVoxelByCoordinates(point_G);
+          label_block_ptr->getVoxelByLinearIndex(voxel.first);
       const TsdfVoxel& tsdf_voxel =
-          tsdf_block_ptr->getVoxelByCoordinates(point_G);
-      Label label = 0u;
-      label = getNextUnassignedLabel(label_voxel, assigned_labels);
-      if (label != 0u &&
-          std::abs(tsdf_voxel.distance) <
-              label_tsdf_config_.label_propagation_td_factor * voxel_size_) {
-        // Do not consider allocated but unobserved voxels
-        // which have label == 0.
-        candidate_label_exists = true;
-        increaseLabelCountForSegment(segment, label, segment_points_count,
-                                     candidates, &merge_candidate_labels);
+          tsdf_block_ptr->getVoxelByLinearIndex(voxel.first);
+      // Do not consider allocated but unobserved voxels which have
+      // label == 0.
+      if (std::abs(tsdf_voxel.distance) <
+          label_tsdf_config_.label_propagation_td_factor * voxel_size_) {
+        voxel_label = label_voxel.label;
       }
     }
   }
+  return num_counted_blocks;
+}
+
+constexpr size_t LabelTsdfIntegrator::VoxelLabelVote::kMaxLabels;
+
+void LabelTsdfIntegrator::cacheSegmentVoxelVotes(
+    Segment* segment, const LabelCandidateMatrix& candidate_matrix,
+    SegmentVoxelVotes* segment_votes) {
+  CHECK_NOTNULL(segment);
+  CHECK_NOTNULL(segment_votes);
+  std::vector<VoxelLabelVote>& voxel_votes = segment_votes->voxel_votes;
+  segment->voxelize(voxel_size_inv_);
+
+  BlockIndex last_block_idx;
+  bool has_last_block = false;
+  Layer<TsdfVoxel>::BlockType::ConstPtr tsdf_block_ptr;
+  Layer<LabelVoxel>::BlockType::ConstPtr label_block_ptr;
+  for (size_t voxel = 0u; voxel < segment->getNumVoxels(); ++voxel) {
+    const GlobalIndex& global_voxel_idx = segment->voxel_indices_[voxel];
+    const BlockIndex block_idx = getBlockIndexFromGlobalVoxelIndex(
+        global_voxel_idx, voxels_per_side_inv_);
+    if (!has_last_block || block_idx != last_block_idx) {
+      label_tsdf_map_->getBlockPair(block_idx, &tsdf_block_ptr,
+                                    &label_block_ptr);
+      last_block_idx = block_idx;
+      has_last_block = true;
+    }
+    if (label_block_ptr == nullptr) {
+      continue;
+    }
+    const VoxelIndex local_voxel_idx =
+        getLocalFromGlobalVoxelIndex(global_voxel_idx, voxels_per_side_);
+    const LabelVoxel& label_voxel =
+        label_block_ptr->getVoxelByVoxelIndex(local_voxel_idx);
+    const TsdfVoxel& tsdf_voxel =
+        tsdf_block_ptr->getVoxelByVoxelIndex(local_voxel_idx);
+    if (std::abs(tsdf_voxel.distance) >=
+        label_tsdf_config_.label_propagation_td_factor * voxel_size_) {
+      continue;
+    }
+
+    // getNextUnassignedLabel() picks the voxel label first, then the
+    // label counts by decreasing confidence, the last one on ties.
+    std::array<size_t, 3u> count_indices = {{2u, 1u, 0u}};
+    std::stable_sort(count_indices.begin(), count_indices.end(),
+                     [&label_voxel](const size_t lhs, const size_t rhs) {
+                       return label_voxel.label_count[lhs].label_confidence >
+                              label_voxel.label_count[rhs].label_confidence;
+                     });
+    VoxelLabelVote voxel_vote;
+    voxel_vote.labels[0] = label_voxel.label;
+    for (size_t i = 0u; i < count_indices.size(); ++i) {
+      voxel_vote.labels[i + 1u] =
+          label_voxel.label_count[count_indices[i]].label;
+    }
+    while (voxel_vote.num_labels < VoxelLabelVote::kMaxLabels &&
+           voxel_vote.labels[voxel_vote.num_labels] != 0u) {
+      ++voxel_vote.num_labels;
+    }
+    if (voxel_vote.num_labels == 0u) {
+      continue;
+    }
+    voxel_vote.point_count = segment->voxel_point_counts_[voxel];
+    voxel_votes.push_back(voxel_vote);
+  }
 
+  for (size_t vote_idx = 0u; vote_idx < voxel_votes.size(); ++vote_idx) {
+    VoxelLabelVote& voxel_vote = voxel_votes[vote_idx];
+    while (voxel_vote.label_idx < voxel_vote.num_labels &&
+           candidate_matrix.isLabelAssigned(
+               voxel_vote.labels[voxel_vote.label_idx])) {
+      ++voxel_vote.label_idx;
+    }
+    if (voxel_vote.label_idx < voxel_vote.num_labels) {
+      const Label label = voxel_vote.labels[voxel_vote.label_idx];
+      segment_votes->voxel_votes_by_label[label].push_back(vote_idx);
+      segment_votes->label_counts[label] += voxel_vote.point_count;
+    }
+  }
+  label_propagation_stats_.num_cached_voxel_votes += voxel_votes.size();
+}
+
+void LabelTsdfIntegrator::reassignSegmentVoxelVotes(
+    const Label assigned_label, const LabelCandidateMatrix& candidate_matrix,
+    SegmentVoxelVotes* segment_votes, std::vector<Label>* changed_labels) {
+  CHECK_NOTNULL(segment_votes);
+  CHECK_NOTNULL(changed_labels);
+  auto votes_by_label_it =
+      segment_votes->voxel_votes_by_label.find(assigned_label);
+  if (votes_by_label_it == segment_votes->voxel_votes_by_label.end()) {
+    return;
+  }
+  std::vector<size_t> vote_indices;
+  vote_indices.swap(votes_by_label_it->second);
+  segment_votes->voxel_votes_by_label.erase(votes_by_label_it);
+  segment_votes->label_counts.erase(assigned_label);
+
+  for (const size_t vote_idx : vote_indices) {
+    VoxelLabelVote& voxel_vote = segment_votes->voxel_votes[vote_idx];
+    DCHECK_EQ(voxel_vote.labels[voxel_vote.label_idx], assigned_label);
+    do {
+      ++voxel_vote.label_idx;
+    } while (voxel_vote.label_idx < voxel_vote.num_labels &&
+             candidate_matrix.isLabelAssigned(
+                 voxel_vote.labels[voxel_vote.label_idx]));
+    if (voxel_vote.label_idx < voxel_vote.num_labels) {
+      const Label label = voxel_vote.labels[voxel_vote.label_idx];
+      segment_votes->voxel_votes_by_label[label].push_back(vote_idx);
+      segment_votes->label_counts[label] += voxel_vote.point_count;
+      changed_labels->push_back(label);
+    }
+  }
+  std::sort(changed_labels->begin(), changed_labels->end());
+  changed_labels->erase(
+      std::unique(changed_labels->begin(), changed_labels->end()),
+      changed_labels->end());
+  label_propagation_stats_.num_reassigned_voxel_votes += vote_indices.size();
+}
+
+void LabelTsdfIntegrator::setSegmentLabelCandidates(
+    const size_t segment_idx, const SegmentVoxelVotes& segment_votes,
+    const std::vector<Label>& changed_labels,
+    LabelCandidateMatrix* candidate_matrix,
+    SegmentMergeCandidates* segment_merge_candidates) {
+  CHECK_NOTNULL(candidate_matrix);
+  CHECK_NOTNULL(segment_merge_candidates);
+  Segment* segment = candidate_matrix->getSegment(segment_idx);
+  for (const Label label : changed_labels) {
+    candidate_matrix->setCount(label, segment_idx,
+                               segment_votes.label_counts.at(label));
+  }
+
+  const int segment_points_count = segment->getNumRawPoints();
   if (label_tsdf_config_.enable_pairwise_confidence_merging) {
+    std::unordered_set<Label> merge_candidate_labels;
+    for (const std::pair<const Label, size_t>& label_count :
+         segment_votes.label_counts) {
+      checkForSegmentLabelMergeCandidate(label_count.first, label_count.second,
+                                         segment_points_count,
+                                         &merge_candidate_labels);
+    }
     std::vector<Label> merge_candidates;
     std::copy(merge_candidate_labels.begin(), merge_candidate_labels.end(),
               std::back_inserter(merge_candidates));
     (*segment_merge_candidates)[segment] = merge_candidates;
   }
 
-  // Previously unobserved segment gets an unseen label.
-  if (!candidate_label_exists) {
+  // A segment without votes left gets an unseen label.
+  if (segment_votes.label_counts.empty()) {
     Label fresh_label = getFreshLabel();
-    std::map<Segment*, size_t> map;
-    map.insert(std::pair<Segment*, size_t>(segment, segment->points_C_.size()));
-    candidates->insert(
-        std::pair<Label, std::map<Segment*, size_t>>(fresh_label, map));
+    candidate_matrix->setCount(fresh_label, segment_idx, segment_points_count);
   }
 }
 
 bool LabelTsdfIntegrator::getNextSegmentLabelPair(
-    const std::set<Segment*>& labelled_segments,
-    std::set<Label>* assigned_labels,
-    std::map<voxblox::Label, std::map<voxblox::Segment*, size_t>>* candidates,
-    std::map<Segment*, std::vector<Label>>* segment_merge_candidates,
+    LabelCandidateMatrix* candidate_matrix,
+    SegmentMergeCandidates* segment_merge_candidates,
+    SegmentVoxelVotesMap* segment_voxel_votes,
     std::pair<Segment*, Label>* segment_label_pair) {
-  CHECK_NOTNULL(assigned_labels);
-  CHECK_NOTNULL(candidates);
+  CHECK_NOTNULL(candidate_matrix);
   CHECK_NOTNULL(segment_merge_candidates);
+  CHECK_NOTNULL(segment_voxel_votes);
   CHECK_NOTNULL(segment_label_pair);
 
   Label max_label;
-  size_t max_count = 0u;
-  Segment* max_segment;
-  std::map<voxblox::Segment*, size_t> segments_to_recompute;
-
-  for (auto label_it = candidates->begin(); label_it != candidates->end();
-       ++label_it) {
-    for (auto segment_it = label_it->second.begin();
-         segment_it != label_it->second.end(); segment_it++) {
-      bool count_greater_than_max = segment_it->second > max_count;
-      bool count_greater_than_min =
-          segment_it->second > label_tsdf_config_.min_label_voxel_count;
-      bool is_unlabelled =
-          labelled_segments.find(segment_it->first) == labelled_segments.end();
-      if (count_greater_than_max && count_greater_than_min && is_unlabelled) {
-        max_count = segment_it->second;
-        max_segment = segment_it->first;
-        max_label = label_it->first;
-        segments_to_recompute = label_it->second;
-      }
-    }
-  }
-  if (max_count == 0u) {
+  size_t max_segment_idx;
+  size_t max_count;
+  if (!candidate_matrix->popMaxCount(label_tsdf_config_.min_label_voxel_count,
+                                     &max_label, &max_segment_idx,
+                                     &max_count)) {
     return false;
   }
 
-  segment_label_pair->first = max_segment;
+  segment_label_pair->first = candidate_matrix->getSegment(max_segment_idx);
   segment_label_pair->second = max_label;
-  assigned_labels->emplace(max_label);
-
-  // For all segments that need to have their label
-  // count recomputed, first clean their relative entries and recompute.
-  for (auto segment : segments_to_recompute) {
-    if (segment.first != max_segment) {
-      for (auto label_it = candidates->begin(); label_it != candidates->end();
-           ++label_it) {
-        if (label_it->first != max_label) {
-          label_it->second.erase(segment.first);
+  std::vector<size_t> segments_to_recompute;
+  candidate_matrix->getLabelSegments(max_label, &segments_to_recompute);
+  candidate_matrix->assignLabel(max_label);
+  candidate_matrix->setSegmentLabelled(max_segment_idx);
+
+  // For all segments that need to have their label count recomputed, only
+  // the cached voxel votes for the assigned label move on to another label.
+  for (const size_t segment_idx : segments_to_recompute) {
+    if (segment_idx != max_segment_idx) {
+      ++label_propagation_stats_.num_recomputed_segments;
+      std::vector<Label> changed_labels;
+      auto votes_it = segment_voxel_votes->find(segment_idx);
+      if (votes_it == segment_voxel_votes->end()) {
+        // The first recomputation replaces the candidates of the segment
+        // by those of its cached votes.
+        candidate_matrix->eraseSegment(segment_idx, max_label);
+        votes_it =
+            segment_voxel_votes->emplace(segment_idx, SegmentVoxelVotes())
+                .first;
+        cacheSegmentVoxelVotes(candidate_matrix->getSegment(segment_idx),
+                               *candidate_matrix, &votes_it->second);
+        for (const std::pair<const Label, size_t>& label_count :
+             votes_it->second.label_counts) {
+          changed_labels.push_back(label_count.first);
         }
+      } else {
+        reassignSegmentVoxelVotes(max_label, *candidate_matrix,
+                                  &votes_it->second, &changed_labels);
       }
-      computeSegmentLabelCandidates(segment.first, candidates,
-                                    segment_merge_candidates, *assigned_labels);
+      setSegmentLabelCandidates(segment_idx, votes_it->second, changed_labels,
+                                candidate_matrix, segment_merge_candidates);
     }
   }
   return true;
 }
+
+void LabelTsdfIntegrator::assignLabelsByMatching(
+    const std::vector<Segment*>& segments, const LabelCandidates& candidates,
+    std::set<Segment*>* labelled_segments) {
+  CHECK_NOTNULL(labelled_segments);
+  std::unordered_map<const Segment*, size_t> segment_indices;
+  segment_indices.reserve(segments.size());
+  for (size_t segment_idx = 0u; segment_idx < segments.size();
+       ++segment_idx) {
+    segment_indices.emplace(segments[segment_idx], segment_idx);
+  }
+
+  // Every label with a pair above the minimum count is a column.
+  std::vector<Label> col_labels;
+  std::vector<WeightedEdge> edges;
+  for (const LabelCandidates::value_type& label_candidates : candidates) {
+    const size_t col = col_labels.size();
+    for (const SegmentCandidates::value_type& segment_count :
+         label_candidates.second) {
+      if (segment_count.second <= label_tsdf_config_.min_label_voxel_count) {
+        continue;
+      }
+      const auto segment_it = segment_indices.find(segment_count.first);
+      CHECK(segment_it != segment_indices.end());
+      edges.push_back(
+          WeightedEdge{segment_it->second, col, segment_count.second});
+    }
+    if (edges.size() > 0u && edges.back().col == col) {
+      col_labels.push_back(label_candidates.first);
+    }
+  }
+
+  std::vector<int> row_matches;
+  computeMaxWeightMatching(segments.size(), col_labels.size(), edges,
+                           &row_matches);
+  for (size_t segment_idx = 0u; segment_idx < segments.size();
+       ++segment_idx) {
+    if (row_matches[segment_idx] != kUnmatched) {
+      segments[segment_idx]->label_ = col_labels[row_matches[segment_idx]];
+      labelled_segments->insert(segments[segment_idx]);
+    }
+  }
+  label_propagation_stats_.num_matching_edges += edges.size();
+  label_propagation_stats_.num_matched_segments += labelled_segments->size();
+}
+
 void LabelTsdfIntegrator::decideLabelPointClouds(
     std::vector<voxblox::Segment*>* segments_to_integrate,
-    std::map<voxblox::Label, std::map<voxblox::Segment*, size_t>>* candidates,
-    std::map<Segment*, std::vector<Label>>* segment_merge_candidates) {
+    LabelCandidates* candidates,
+    SegmentMergeCandidates* segment_merge_candidates) {
   CHECK_NOTNULL(segments_to_integrate);
   CHECK_NOTNULL(candidates);
   CHECK_NOTNULL(segment_merge_candidates);
-  std::set<Label> assigned_labels;
   std::set<Segment*> labelled_segments;
   std::pair<Segment*, Label> pair;
   std::set<InstanceLabel> assigned_instances;
 
-  while (getNextSegmentLabelPair(labelled_segments, &assigned_labels,
-                                 candidates, segment_merge_candidates, &pair)) {
-    Segment* segment = pair.first;
-    CHECK_NOTNULL(segment);
-    Label& label = pair.second;
+  // The overlap of the segments with their labels, before any is assigned,
+  // rates the decided labels for the propagation cache.
+  std::map<std::pair<Segment*, Label>, size_t> initial_counts;
+  if (isPropagationCacheEnabled()) {
+    for (const LabelCandidates::value_type& label_candidates : *candidates) {
+      for (const SegmentCandidates::value_type& segment_count :
+           label_candidates.second) {
+        initial_counts.emplace(
+            std::make_pair(segment_count.first, label_candidates.first),
+            segment_count.second);
+      }
+    }
+  }
 
-    segment->label_ = label;
-    labelled_segments.insert(segment);
-    candidates->erase(label);
+  if (label_tsdf_config_.enable_optimal_label_assignment) {
+    assignLabelsByMatching(*segments_to_integrate, *candidates,
+                           &labelled_segments);
+    candidates->clear();
+  } else {
+    // The candidates are tracked in the matrix while labels are assigned.
+    LabelCandidateMatrix candidate_matrix(*segments_to_integrate,
+                                          *candidates);
+    candidates->clear();
+    SegmentVoxelVotesMap segment_voxel_votes;
+
+    while (getNextSegmentLabelPair(&candidate_matrix,
+                                   segment_merge_candidates,
+                                   &segment_voxel_votes, &pair)) {
+      Segment* segment = pair.first;
+      CHECK_NOTNULL(segment);
+      Label& label = pair.second;
+
+      segment->label_ = label;
+      labelled_segments.insert(segment);
+    }
+    label_propagation_stats_.num_heap_entries +=
+        candidate_matrix.getNumPushedEntries();
+    label_propagation_stats_.num_outdated_heap_entries +=
+        candidate_matrix.getNumOutdatedEntries();
   }
 
   for (auto merge_candidates : *segment_merge_candidates) {
@@ -326,6 +958,10 @@ void LabelTsdfIntegrator::decideLabelPointClouds(
     }
   }
 
+  if (isPropagationCacheEnabled()) {
+    updatePropagationCache(*segments_to_integrate, initial_counts);
+  }
+
   if (label_tsdf_config_.enable_semantic_instance_segmentation) {
     // Instance stuff.
     for (auto segment_it = labelled_segments.begin();
@@ -466,16 +1102,23 @@ void LabelTsdfIntegrator::updateLabelLayerWithStoredBlocks() {
 }
 
 // Updates label_voxel. Thread safe.
-void LabelTsdfIntegrator::updateLabelVoxel(const Point& point_G,
+void LabelTsdfIntegrator::updateLabelVoxel(const GlobalIndex& global_voxel_idx,
                                            const Label& label,
+                                           const LabelConfidence& confidence,
                                            LabelVoxel* label_voxel,
-                                           const LabelConfidence& confidence) {
+                                           LabelStatsDelta* label_stats) {
   CHECK_NOTNULL(label_voxel);
   // Lookup the mutex that is responsible for this voxel and lock it.
-  std::lock_guard<std::mutex> lock(mutexes_.get(
-      getGridIndexFromPoint<GlobalIndex>(point_G, voxel_size_inv_)));
+  std::lock_guard<std::mutex> lock(mutexes_.get(global_voxel_idx));
+
+  updateLabelVoxelUnlocked(label, confidence, label_voxel, label_stats);
+}
 
+void LabelTsdfIntegrator::updateLabelVoxelUnlocked(
+    const Label& label, const LabelConfidence& confidence,
+    LabelVoxel* label_voxel, LabelStatsDelta* label_stats) {
   CHECK_NOTNULL(label_voxel);
+  CHECK_NOTNULL(label_stats);
 
   // label_voxel->semantic_label = semantic_label;
   Label previous_label = label_voxel->label;
@@ -490,19 +1133,51 @@ void LabelTsdfIntegrator::updateLabelVoxel(const Point& point_G,
   if (new_label != previous_label) {
     // Both of the segments corresponding to the two labels are
     // updated, one gains a voxel, one loses a voxel.
-    std::lock_guard<std::mutex> lock(updated_labels_mutex_);
-
-    updated_labels_.insert(new_label);
-    changeLabelCount(new_label, 1);
+    if (!label_stats->is_label_updated[new_label]) {
+      label_stats->is_label_updated[new_label] = true;
+      label_stats->updated_labels.push_back(new_label);
+    }
+    ++label_stats->label_count_deltas[new_label];
 
     if (previous_label != 0u) {
-      updated_labels_.insert(previous_label);
-      changeLabelCount(previous_label, -1);
+      if (!label_stats->is_label_updated[previous_label]) {
+        label_stats->is_label_updated[previous_label] = true;
+        label_stats->updated_labels.push_back(previous_label);
+      }
+      --label_stats->label_count_deltas[previous_label];
+    }
+
+    label_stats->max_label = std::max(label_stats->max_label, new_label);
+  }
+}
+
+void LabelTsdfIntegrator::reduceLabelStats() {
+  for (LabelStatsDelta& label_stats : label_stats_per_thread_) {
+    for (const Label label : label_stats.updated_labels) {
+      updated_labels_.insert(label);
+      // Changes that cancel out are skipped, as changeLabelCount() would
+      // insert a zero count for a label not in the map.
+      const int label_count_delta = label_stats.label_count_deltas[label];
+      if (label_count_delta != 0) {
+        changeLabelCount(label, label_count_delta);
+      }
+      label_stats.label_count_deltas[label] = 0;
+      label_stats.is_label_updated[label] = false;
+    }
+    label_stats.updated_labels.clear();
+
+    label_update_stats_ += label_stats.update_stats;
+    label_stats.update_stats = LabelUpdateStats();
+
+    if (*highest_label_ptr_ < label_stats.max_label) {
+      *highest_label_ptr_ = label_stats.max_label;
     }
+    label_stats.max_label = 0u;
 
-    if (*highest_label_ptr_ < new_label) {
-      *highest_label_ptr_ = new_label;
+    for (const BlockIndex& block_idx : label_stats.changed_blocks) {
+      block_versions_[block_idx] = map_version_;
     }
+    label_stats.changed_blocks.clear();
   }
 }
 
@@ -511,7 +1186,119 @@ void LabelTsdfIntegrator::integratePointCloud(const Transformation& T_G_C,
                                               const Colors& colors,
                                               const Label& label,
                                               const bool freespace_points) {
+  const Labels labels(points_C.size(), label);
+  integrateLabelledPointCloud(T_G_C, points_C, colors, labels, PointCounts(),
+                              freespace_points);
+}
+
+void LabelTsdfIntegrator::integrateFrame(
+    const Transformation& T_G_C, const std::vector<Segment*>& segments) {
+  size_t num_points = 0u;
+  bool has_point_counts = false;
+  for (const Segment* segment : segments) {
+    CHECK_NOTNULL(segment);
+    CHECK_EQ(segment->points_C_.size(), segment->colors_.size());
+    // The rays are bundled from the voxels of the segments, which are
+    // computed with the transform of the segment.
+    CHECK(segment->T_G_C_.getTransformationMatrix() ==
+          T_G_C.getTransformationMatrix())
+        << "All the segments of a frame must be integrated with their own "
+           "transform.";
+    num_points += segment->points_C_.size();
+    has_point_counts |= !segment->point_counts_.empty();
+  }
+
+  if (label_tsdf_config_.enable_projective_integration) {
+    timing::Timer render_timer("integrate_frame/projective/render");
+    SegmentedDepthImage image;
+    renderSegmentedDepthImage(segments, label_tsdf_config_.projective_camera,
+                              &image);
+    render_timer.Stop();
+    integrateSegmentedDepthImage(T_G_C, segments, image);
+    return;
+  }
+
+  timing::Timer concatenate_timer("integrate_frame/concatenate_segments");
+  Pointcloud points_C;
+  Colors colors;
+  Labels labels;
+  PointCounts point_counts;
+  points_C.reserve(num_points);
+  colors.reserve(num_points);
+  labels.reserve(num_points);
+  if (has_point_counts) {
+    point_counts.reserve(num_points);
+  }
+  for (const Segment* segment : segments) {
+    points_C.insert(points_C.end(), segment->points_C_.begin(),
+                    segment->points_C_.end());
+    colors.insert(colors.end(), segment->colors_.begin(),
+                  segment->colors_.end());
+    labels.insert(labels.end(), segment->points_C_.size(), segment->label_);
+    // Segments that were not downsampled count each point once.
+    if (has_point_counts && segment->point_counts_.empty()) {
+      point_counts.insert(point_counts.end(), segment->points_C_.size(), 1u);
+    } else if (has_point_counts) {
+      point_counts.insert(point_counts.end(), segment->point_counts_.begin(),
+                          segment->point_counts_.end());
+    }
+  }
+  concatenate_timer.Stop();
+
+  // The rays are bundled from the voxels of the segments, which label
+  // propagation already computed, instead of transforming and hashing every
+  // point again. The points of a bundle are in increasing index order, as
+  // with the "sorted" integration order, whatever integration_order_mode is.
+  if (config_.integration_order_mode != "sorted") {
+    LOG_FIRST_N(INFO, 1)
+        << "integrateFrame() bundles the points of the segments in sorted "
+           "order, integration_order_mode \""
+        << config_.integration_order_mode
+        << "\" only applies to integrateLabelledPointCloud().";
+  }
+  timing::Timer bundle_timer("integrate_frame/bundle_segment_voxels");
+  VoxelMap voxel_map;
+  VoxelMap clear_map;
+  constexpr bool kIsFreespacePointcloud = false;
+  size_t point_offset = 0u;
+  for (Segment* segment : segments) {
+    segment->voxelize(voxel_size_inv_);
+    for (size_t voxel = 0u; voxel < segment->getNumVoxels(); ++voxel) {
+      AlignedVector<size_t>* voxel_points = nullptr;
+      AlignedVector<size_t>* clear_points = nullptr;
+      for (size_t i = segment->voxel_point_offsets_[voxel];
+           i < segment->voxel_point_offsets_[voxel + 1u]; ++i) {
+        const size_t pt_idx = segment->voxel_point_indices_[i];
+        bool is_clearing;
+        if (!isPointValid(segment->points_C_[pt_idx], kIsFreespacePointcloud,
+                          &is_clearing)) {
+          continue;
+        }
+        AlignedVector<size_t>*& ray_points =
+            is_clearing ? clear_points : voxel_points;
+        if (ray_points == nullptr) {
+          ray_points =
+              &(is_clearing ? clear_map
+                            : voxel_map)[segment->voxel_indices_[voxel]];
+        }
+        ray_points->push_back(point_offset + pt_idx);
+      }
+    }
+    point_offset += segment->points_C_.size();
+  }
+  bundle_timer.Stop();
+
+  integrateBundledRays(T_G_C, points_C, colors, labels, point_counts,
+                       voxel_map, clear_map);
+}
+
+void LabelTsdfIntegrator::integrateLabelledPointCloud(
+    const Transformation& T_G_C, const Pointcloud& points_C,
+    const Colors& colors, const Labels& labels,
+    const PointCounts& point_counts, const bool freespace_points) {
   CHECK_EQ(points_C.size(), colors.size());
+  CHECK_EQ(points_C.size(), labels.size());
+  CHECK(point_counts.empty() || point_counts.size() == points_C.size());
   CHECK_GE(points_C.size(), 0u);
 
   // Pre-compute a list of unique voxels to end on.
@@ -527,142 +1314,764 @@ void LabelTsdfIntegrator::integratePointCloud(const Transformation& T_G_C,
   bundleRays(T_G_C, points_C, freespace_points, index_getter.get(), &voxel_map,
              &clear_map);
 
-  integrateRays(T_G_C, points_C, colors, label, config_.enable_anti_grazing,
-                false, voxel_map, clear_map);
-
-  integrateRays(T_G_C, points_C, colors, label, config_.enable_anti_grazing,
-                true, voxel_map, clear_map);
+  integrateBundledRays(T_G_C, points_C, colors, labels, point_counts,
+                       voxel_map, clear_map);
 }
 
-void LabelTsdfIntegrator::integrateVoxel(
+void LabelTsdfIntegrator::integrateBundledRays(
     const Transformation& T_G_C, const Pointcloud& points_C,
-    const Colors& colors, const Label& label, const bool enable_anti_grazing,
-    const bool clearing_ray,
-    const VoxelMapElement& global_voxel_idx_to_point_indices,
-    const VoxelMap& voxel_map) {
-  if (global_voxel_idx_to_point_indices.second.empty()) {
-    return;
+    const Colors& colors, const Labels& labels,
+    const PointCounts& point_counts, const VoxelMap& voxel_map,
+    const VoxelMap& clear_map) {
+  ++map_version_;
+
+  if (config_.enable_anti_grazing) {
+    anti_grazing_filter_.reset(voxel_map.size());
+    for (const VoxelMapElement& voxel_map_element : voxel_map) {
+      anti_grazing_filter_.insert(voxel_map_element.first);
+    }
   }
 
-  const Point& origin = T_G_C.getPosition();
+  integrateRays(T_G_C, points_C, colors, labels, point_counts,
+                config_.enable_anti_grazing, false, voxel_map, clear_map);
+
+  integrateRays(T_G_C, points_C, colors, labels, point_counts,
+                config_.enable_anti_grazing, true, voxel_map, clear_map);
+}
+
+void LabelTsdfIntegrator::mergeRay(const Transformation& T_G_C,
+                                   const Pointcloud& points_C,
+                                   const Colors& colors, const Labels& labels,
+                                   const PointCounts& point_counts,
+                                   const bool clearing_ray,
+                                   const AlignedVector<size_t>& point_indices,
+                                   MergedRay* merged_ray) {
+  CHECK_NOTNULL(merged_ray);
   Color merged_color;
   Point merged_point_C = Point::Zero();
   FloatingPoint merged_weight = 0.0f;
-  Label merged_label = label;
-  LabelConfidence merged_label_confidence;
-
-  for (const size_t pt_idx : global_voxel_idx_to_point_indices.second) {
-    const Point& point_C = points_C[pt_idx];
-    const Color& color = colors[pt_idx];
-
-    const float point_weight = getVoxelWeight(point_C);
-    merged_point_C = (merged_point_C * merged_weight + point_C * point_weight) /
-                     (merged_weight + point_weight);
-    merged_color =
-        Color::blendTwoColors(merged_color, merged_weight, color, point_weight);
-    merged_weight += point_weight;
-    // Assuming all the points of a segment pointcloud
-    // are assigned the same label.
+  // A voxel bundle may contain points of several segments of the frame,
+  // the ray votes once for each of their labels.
+  std::vector<LabelCount>& label_votes = merged_ray->label_votes;
+  label_votes.clear();
+
+  if (!clearing_ray && label_tsdf_config_.enable_vectorized_point_merging) {
+    mergeWeightedPoints(points_C, colors, point_counts, point_indices,
+                        config_.use_const_weight, &merged_point_C,
+                        &merged_color, &merged_weight);
+  } else {
+    for (const size_t pt_idx : point_indices) {
+      const Point& point_C = points_C[pt_idx];
+      const Color& color = colors[pt_idx];
+
+      // Downsampled points weigh as much as the raw points they replace.
+      float point_weight = getVoxelWeight(point_C);
+      if (!point_counts.empty()) {
+        point_weight *= point_counts[pt_idx];
+      }
+      merged_point_C =
+          (merged_point_C * merged_weight + point_C * point_weight) /
+          (merged_weight + point_weight);
+      merged_color = Color::blendTwoColors(merged_color, merged_weight, color,
+                                           point_weight);
+      merged_weight += point_weight;
+
+      // only take first point when clearing
+      if (clearing_ray) {
+        break;
+      }
+    }
+  }
+
+  merged_ray->point_G = T_G_C * merged_point_C;
+  merged_ray->color = merged_color;
+  merged_ray->weight = merged_weight;
+
+  // Clearing rays end in free space and do not update any label.
+  if (clearing_ray) {
+    return;
+  }
+  for (const size_t pt_idx : point_indices) {
+    LabelConfidence label_confidence;
     if (label_tsdf_config_.enable_confidence_weight_dropoff) {
-      const FloatingPoint ray_distance = point_C.norm();
-      merged_label_confidence = computeConfidenceWeight(ray_distance);
+      const FloatingPoint ray_distance = points_C[pt_idx].norm();
+      label_confidence = computeConfidenceWeight(ray_distance);
     } else {
-      merged_label_confidence = 1u;
+      label_confidence = 1u;
     }
+    // The last point of each label determines the confidence of its vote.
+    const Label& label = labels[pt_idx];
+    std::vector<LabelCount>::iterator label_vote_it = std::find_if(
+        label_votes.begin(), label_votes.end(),
+        [&label](const LabelCount& vote) { return vote.label == label; });
+    if (label_vote_it == label_votes.end()) {
+      label_votes.emplace_back();
+      label_vote_it = label_votes.end() - 1;
+      label_vote_it->label = label;
+    }
+    label_vote_it->label_confidence = label_confidence;
+  }
+}
 
-    // only take first point when clearing
-    if (clearing_ray) {
-      break;
+void LabelTsdfIntegrator::addRayBlockFootprint(
+    const Point& origin, const Point& point_G, const bool clearing_ray,
+    IndexSet* block_footprint, IndexSet* label_block_footprint) const {
+  CHECK_NOTNULL(block_footprint);
+  CHECK_NOTNULL(label_block_footprint);
+  const FloatingPoint truncation_distance = config_.default_truncation_distance;
+
+  // Ray extent as computed by the RayCaster constructor.
+  const Ray unit_ray = (point_G - origin).normalized();
+  Point ray_start, ray_end;
+  if (clearing_ray) {
+    FloatingPoint ray_length = (point_G - origin).norm();
+    ray_length = std::min(
+        std::max(ray_length - truncation_distance,
+                 static_cast<FloatingPoint>(0.0)),
+        config_.max_ray_length_m);
+    ray_end = origin + unit_ray * ray_length;
+    ray_start = config_.voxel_carving_enabled ? origin : ray_end;
+  } else {
+    ray_end = point_G + unit_ray * truncation_distance;
+    ray_start = config_.voxel_carving_enabled
+                    ? origin
+                    : (point_G - unit_ray * truncation_distance);
+  }
+
+  RayCaster block_ray_caster(ray_start * block_size_inv_,
+                             ray_end * block_size_inv_);
+  GlobalIndex block_idx;
+  while (block_ray_caster.nextRayIndex(&block_idx)) {
+    block_footprint->insert(block_idx.cast<IndexElement>());
+  }
+
+  if (clearing_ray) {
+    return;
+  }
+  // Part of the ray extent within the label band around its end point.
+  const FloatingPoint label_band_distance =
+      label_tsdf_config_.label_band_factor * truncation_distance;
+  const Point label_band_start =
+      point_G -
+      unit_ray * std::min(label_band_distance, (point_G - ray_start).norm());
+  const Point label_band_end =
+      point_G + unit_ray * std::min(label_band_distance, truncation_distance);
+  RayCaster label_block_ray_caster(label_band_start * block_size_inv_,
+                                   label_band_end * block_size_inv_);
+  while (label_block_ray_caster.nextRayIndex(&block_idx)) {
+    label_block_footprint->insert(block_idx.cast<IndexElement>());
+  }
+}
+
+void LabelTsdfIntegrator::mergeRaysAndComputeBlockFootprint(
+    const Transformation& T_G_C, const Pointcloud& points_C,
+    const Colors& colors, const Labels& labels,
+    const PointCounts& point_counts, const bool clearing_ray,
+    const std::vector<const VoxelMapElement*>& rays,
+    std::atomic<size_t>* next_ray_idx, AlignedVector<MergedRay>* merged_rays,
+    IndexSet* block_footprint, IndexSet* label_block_footprint) {
+  CHECK_NOTNULL(next_ray_idx);
+  CHECK_NOTNULL(merged_rays);
+  CHECK_NOTNULL(block_footprint);
+  CHECK_NOTNULL(label_block_footprint);
+  const Point& origin = T_G_C.getPosition();
+  const size_t grain_size = label_tsdf_config_.integration_grain_size;
+  size_t begin_idx;
+  while ((begin_idx = next_ray_idx->fetch_add(grain_size)) < rays.size()) {
+    const size_t end_idx = std::min(begin_idx + grain_size, rays.size());
+    for (size_t ray_idx = begin_idx; ray_idx < end_idx; ++ray_idx) {
+      const AlignedVector<size_t>& point_indices = rays[ray_idx]->second;
+      if (point_indices.empty()) {
+        continue;
+      }
+      // Every ray index is taken by exactly one thread.
+      MergedRay& merged_ray = (*merged_rays)[ray_idx];
+      mergeRay(T_G_C, points_C, colors, labels, point_counts, clearing_ray,
+               point_indices, &merged_ray);
+      addRayBlockFootprint(origin, merged_ray.point_G, clearing_ray,
+                           block_footprint, label_block_footprint);
     }
   }
+}
+
+void LabelTsdfIntegrator::allocateTsdfAndLabelBlock(
+    const BlockIndex& block_idx) {
+  if (!label_layer_->hasBlock(block_idx)) {
+    ++label_update_stats_.num_label_blocks;
+  }
+  Block<TsdfVoxel>::Ptr tsdf_block;
+  Block<LabelVoxel>::Ptr label_block;
+  label_tsdf_map_->allocateBlockPair(block_idx, &tsdf_block, &label_block);
+  tsdf_block->updated() = true;
+}
+
+void LabelTsdfIntegrator::allocateTsdfBlock(const BlockIndex& block_idx) {
+  Block<TsdfVoxel>::Ptr tsdf_block = layer_->getBlockPtrByIndex(block_idx);
+  if (!tsdf_block) {
+    tsdf_block = layer_->allocateBlockPtrByIndex(block_idx);
+    ++label_update_stats_.num_tsdf_only_blocks;
+  }
+  tsdf_block->updated() = true;
+}
 
-  const Point merged_point_G = T_G_C * merged_point_C;
+bool LabelTsdfIntegrator::isGrazingVoxel(
+    const GlobalIndex& global_voxel_idx, const bool clearing_ray,
+    const VoxelMapElement& global_voxel_idx_to_point_indices,
+    const VoxelMap& voxel_map, RayTraversalStats* ray_stats) const {
+  // Check if this one is already the block hash map for this
+  // insertion. Skip this to avoid grazing.
+  if (!clearing_ray &&
+      global_voxel_idx == global_voxel_idx_to_point_indices.first) {
+    return false;
+  }
+  if (!anti_grazing_filter_.mayContain(global_voxel_idx)) {
+    return false;
+  }
+  ++ray_stats->num_anti_grazing_lookups;
+  return voxel_map.find(global_voxel_idx) != voxel_map.end();
+}
+
+bool LabelTsdfIntegrator::nextRayStep(
+    const bool enable_anti_grazing, const bool clearing_ray,
+    const VoxelMapElement& global_voxel_idx_to_point_indices,
+    const VoxelMap& voxel_map, const RayStep* previous_step,
+    RayCaster* ray_caster, RayStep* step, RayTraversalStats* ray_stats) {
+  while (ray_caster->nextRayIndex(&step->global_voxel_idx)) {
+    ++ray_stats->num_steps;
+    if (enable_anti_grazing &&
+        isGrazingVoxel(step->global_voxel_idx, clearing_ray,
+                       global_voxel_idx_to_point_indices, voxel_map,
+                       ray_stats)) {
+      ++ray_stats->num_anti_grazing_skips;
+      continue;
+    }
 
-  RayCaster ray_caster(origin, merged_point_G, clearing_ray,
+    step->block_idx = getBlockIndexFromGlobalVoxelIndex(step->global_voxel_idx,
+                                                        voxels_per_side_inv_);
+    if (previous_step != nullptr &&
+        previous_step->block_idx == step->block_idx) {
+      step->tsdf_block = previous_step->tsdf_block;
+      step->label_block = previous_step->label_block;
+    } else {
+      ++ray_stats->num_block_lookups;
+      // The layers keep the blocks alive, no reference is held here.
+      Block<TsdfVoxel>::Ptr tsdf_block;
+      Block<LabelVoxel>::Ptr label_block;
+      if (clearing_ray) {
+        tsdf_block = layer_->getBlockPtrByIndex(step->block_idx);
+      } else {
+        label_tsdf_map_->getBlockPair(step->block_idx, &tsdf_block,
+                                      &label_block);
+      }
+      step->tsdf_block = tsdf_block.get();
+      step->label_block = label_block.get();
+      if (step->tsdf_block != nullptr) {
+        step->tsdf_block->updated() = true;
+      }
+    }
+
+    const VoxelIndex local_voxel_idx =
+        getLocalFromGlobalVoxelIndex(step->global_voxel_idx, voxels_per_side_);
+    step->tsdf_voxel = nullptr;
+    step->label_voxel = nullptr;
+    if (step->tsdf_block != nullptr) {
+      step->tsdf_voxel =
+          &step->tsdf_block->getVoxelByVoxelIndex(local_voxel_idx);
+      prefetchForWrite(step->tsdf_voxel);
+    }
+    if (step->label_block != nullptr) {
+      step->label_voxel =
+          &step->label_block->getVoxelByVoxelIndex(local_voxel_idx);
+      prefetchForWrite(step->label_voxel);
+    }
+    return true;
+  }
+  return false;
+}
+
+void LabelTsdfIntegrator::integrateVoxel(
+    const Transformation& T_G_C, const MergedRay& merged_ray,
+    const bool enable_anti_grazing, const bool clearing_ray,
+    const VoxelMapElement& global_voxel_idx_to_point_indices,
+    const VoxelMap& voxel_map, LabelStatsDelta* label_stats,
+    RayTraversalStats* ray_stats) {
+  CHECK_NOTNULL(ray_stats);
+  if (global_voxel_idx_to_point_indices.second.empty()) {
+    return;
+  }
+
+  const Point& origin = T_G_C.getPosition();
+  RayCaster ray_caster(origin, merged_ray.point_G, clearing_ray,
                        config_.voxel_carving_enabled, config_.max_ray_length_m,
                        voxel_size_inv_, config_.default_truncation_distance);
+  ++ray_stats->num_rays;
+
+  // The ray is traversed one step ahead, so that the blocks of the next
+  // voxel are looked up and its voxels prefetched while the current one is
+  // updated.
+  RayStep step;
+  RayStep next_step;
+  bool has_step = nextRayStep(enable_anti_grazing, clearing_ray,
+                              global_voxel_idx_to_point_indices, voxel_map,
+                              nullptr, &ray_caster, &step, ray_stats);
+  bool is_new_block = true;
+  while (has_step) {
+    const bool has_next_step = nextRayStep(
+        enable_anti_grazing, clearing_ray, global_voxel_idx_to_point_indices,
+        voxel_map, &step, &ray_caster, &next_step, ray_stats);
+
+    // Blocks are recorded once per ray, when the ray enters them.
+    if (is_new_block && label_tsdf_config_.enable_block_versions) {
+      label_stats->changed_blocks.insert(step.block_idx);
+    }
+    is_new_block = has_next_step && next_step.block_idx != step.block_idx;
+
+    // Voxels of blocks that are not in the layers yet are allocated in the
+    // temporary block maps.
+    TsdfVoxel* tsdf_voxel = step.tsdf_voxel;
+    if (tsdf_voxel == nullptr) {
+      Block<TsdfVoxel>::Ptr tsdf_block = nullptr;
+      BlockIndex block_idx;
+      tsdf_voxel = allocateStorageAndGetVoxelPtr(step.global_voxel_idx,
+                                                 &tsdf_block, &block_idx);
+    }
+
+    updateTsdfVoxel(origin, merged_ray.point_G, step.global_voxel_idx,
+                    merged_ray.color, merged_ray.weight, tsdf_voxel);
 
-  GlobalIndex global_voxel_idx;
-  while (ray_caster.nextRayIndex(&global_voxel_idx)) {
-    if (enable_anti_grazing) {
-      // Check if this one is already the block hash map for this
-      // insertion. Skip this to avoid grazing.
-      if ((clearing_ray ||
-           global_voxel_idx != global_voxel_idx_to_point_indices.first) &&
-          voxel_map.find(global_voxel_idx) != voxel_map.end()) {
+    if (merged_ray.label_votes.empty()) {
+      ++label_stats->update_stats.num_clearing_voxels;
+    } else if (!isInLabelBand(computeDistance(
+                   origin, merged_ray.point_G,
+                   getCenterPointFromGridIndex(step.global_voxel_idx,
+                                               voxel_size_)))) {
+      ++label_stats->update_stats.num_out_of_band_voxels;
+    } else {
+      ++label_stats->update_stats.num_label_updates;
+      LabelVoxel* label_voxel = step.label_voxel;
+      if (label_voxel == nullptr) {
+        Block<LabelVoxel>::Ptr label_block = nullptr;
+        BlockIndex block_idx;
+        label_voxel = allocateStorageAndGetLabelVoxelPtr(
+            step.global_voxel_idx, &label_block, &block_idx);
+      }
+      for (const LabelCount& label_vote : merged_ray.label_votes) {
+        updateLabelVoxel(step.global_voxel_idx, label_vote.label,
+                         label_vote.label_confidence, label_voxel,
+                         label_stats);
+      }
+    }
+
+    std::swap(step, next_step);
+    has_step = has_next_step;
+  }
+}
+
+void LabelTsdfIntegrator::integrateVoxels(
+    const Transformation& T_G_C, const bool enable_anti_grazing,
+    const bool clearing_ray, const std::vector<const VoxelMapElement*>& rays,
+    const AlignedVector<MergedRay>& merged_rays, const VoxelMap& voxel_map,
+    std::atomic<size_t>* next_ray_idx, LabelStatsDelta* label_stats,
+    RayTraversalStats* ray_stats) {
+  CHECK_NOTNULL(next_ray_idx);
+  const size_t grain_size = label_tsdf_config_.integration_grain_size;
+  size_t begin_idx;
+  while ((begin_idx = next_ray_idx->fetch_add(grain_size)) < rays.size()) {
+    const size_t end_idx = std::min(begin_idx + grain_size, rays.size());
+    for (size_t ray_idx = begin_idx; ray_idx < end_idx; ++ray_idx) {
+      integrateVoxel(T_G_C, merged_rays[ray_idx], enable_anti_grazing,
+                     clearing_ray, *rays[ray_idx], voxel_map, label_stats,
+                     ray_stats);
+    }
+  }
+}
+
+void LabelTsdfIntegrator::castRaysToBlocks(
+    const Transformation& T_G_C, const Pointcloud& points_C,
+    const Colors& colors, const Labels& labels,
+    const PointCounts& point_counts, const bool enable_anti_grazing,
+    const bool clearing_ray,
+    const std::vector<const VoxelMapElement*>& rays,
+    const VoxelMap& voxel_map, std::atomic<size_t>* next_ray_idx,
+    AlignedVector<MergedRay>* merged_rays, BlockRayVoxelsMap* block_ray_voxels,
+    IndexSet* label_blocks, RayTraversalStats* ray_stats) {
+  CHECK_NOTNULL(next_ray_idx);
+  CHECK_NOTNULL(merged_rays);
+  CHECK_NOTNULL(block_ray_voxels);
+  CHECK_NOTNULL(label_blocks);
+  CHECK_NOTNULL(ray_stats);
+  const Point& origin = T_G_C.getPosition();
+  const size_t grain_size = label_tsdf_config_.integration_grain_size;
+
+  // Consecutive voxels of a ray mostly fall in the same block, so the bucket
+  // of the last block is kept to save hash map lookups.
+  BlockIndex last_block_idx;
+  AlignedVector<RayVoxel>* last_block_ray_voxels = nullptr;
+  bool is_last_block_in_label_blocks = false;
+
+  size_t begin_idx;
+  while ((begin_idx = next_ray_idx->fetch_add(grain_size)) < rays.size()) {
+    const size_t end_idx = std::min(begin_idx + grain_size, rays.size());
+    for (size_t ray_idx = begin_idx; ray_idx < end_idx; ++ray_idx) {
+      const VoxelMapElement& global_voxel_idx_to_point_indices = *rays[ray_idx];
+      if (global_voxel_idx_to_point_indices.second.empty()) {
         continue;
       }
+
+      // Every ray index is taken by exactly one thread.
+      MergedRay& merged_ray = (*merged_rays)[ray_idx];
+      mergeRay(T_G_C, points_C, colors, labels, point_counts, clearing_ray,
+               global_voxel_idx_to_point_indices.second, &merged_ray);
+
+      RayCaster ray_caster(
+          origin, merged_ray.point_G, clearing_ray,
+          config_.voxel_carving_enabled, config_.max_ray_length_m,
+          voxel_size_inv_, config_.default_truncation_distance);
+      ++ray_stats->num_rays;
+
+      GlobalIndex global_voxel_idx;
+      while (ray_caster.nextRayIndex(&global_voxel_idx)) {
+        ++ray_stats->num_steps;
+        if (enable_anti_grazing &&
+            isGrazingVoxel(global_voxel_idx, clearing_ray,
+                           global_voxel_idx_to_point_indices, voxel_map,
+                           ray_stats)) {
+          ++ray_stats->num_anti_grazing_skips;
+          continue;
+        }
+
+        const BlockIndex block_idx = getBlockIndexFromGlobalVoxelIndex(
+            global_voxel_idx, voxels_per_side_inv_);
+        if (last_block_ray_voxels == nullptr || block_idx != last_block_idx) {
+          ++ray_stats->num_block_lookups;
+          last_block_ray_voxels = &(*block_ray_voxels)[block_idx];
+          last_block_idx = block_idx;
+          is_last_block_in_label_blocks = false;
+        }
+        last_block_ray_voxels->push_back({global_voxel_idx, ray_idx});
+
+        if (!is_last_block_in_label_blocks &&
+            !merged_ray.label_votes.empty() &&
+            isInLabelBand(computeDistance(
+                origin, merged_ray.point_G,
+                getCenterPointFromGridIndex(global_voxel_idx, voxel_size_)))) {
+          label_blocks->insert(block_idx);
+          is_last_block_in_label_blocks = true;
+        }
+      }
     }
-    BlockIndex block_idx;
+  }
+}
 
-    Block<TsdfVoxel>::Ptr tsdf_block = nullptr;
-    TsdfVoxel* tsdf_voxel = allocateStorageAndGetVoxelPtr(
-        global_voxel_idx, &tsdf_block, &block_idx);
+void LabelTsdfIntegrator::updateBlock(
+    const Point& origin, const BlockIndex& block_idx,
+    const std::vector<const AlignedVector<RayVoxel>*>& ray_voxels_per_thread,
+    const AlignedVector<MergedRay>& merged_rays,
+    const bool deduplicate_clearing_voxels, LabelStatsDelta* label_stats,
+    RayTraversalStats* ray_stats) {
+  CHECK(!ray_voxels_per_thread.empty());
+  CHECK_NOTNULL(label_stats);
+  CHECK_NOTNULL(ray_stats);
+  Block<TsdfVoxel>::Ptr tsdf_block;
+  Block<LabelVoxel>::Ptr label_block;
+  label_tsdf_map_->getBlockPair(block_idx, &tsdf_block, &label_block);
+  CHECK(tsdf_block);
+  if (label_tsdf_config_.enable_block_versions) {
+    label_stats->changed_blocks.insert(block_idx);
+  }
 
-    updateTsdfVoxel(origin, merged_point_G, global_voxel_idx, merged_color,
-                    merged_weight, tsdf_voxel);
+  // Each thread casts its rays in increasing order, so the voxels of a
+  // single thread are already sorted. Voxels coming from several threads
+  // are sorted to apply the rays in the same order as a single thread would.
+  const AlignedVector<RayVoxel>* ray_voxels = ray_voxels_per_thread.front();
+  AlignedVector<RayVoxel> sorted_ray_voxels;
+  if (ray_voxels_per_thread.size() > 1u) {
+    for (const AlignedVector<RayVoxel>* thread_ray_voxels :
+         ray_voxels_per_thread) {
+      sorted_ray_voxels.insert(sorted_ray_voxels.end(),
+                               thread_ray_voxels->begin(),
+                               thread_ray_voxels->end());
+    }
+    std::sort(sorted_ray_voxels.begin(), sorted_ray_voxels.end(),
+              [](const RayVoxel& lhs, const RayVoxel& rhs) {
+                return lhs.ray_idx < rhs.ray_idx;
+              });
+    ray_voxels = &sorted_ray_voxels;
+  }
 
-    // TODO(margaritaG): parametrize.
-    // If voxel carving is enabled, then only allocate the label voxels
-    // within three times the truncation distance from the surface.
-    if (!config_.voxel_carving_enabled ||
-        std::abs(tsdf_voxel->distance) <
-            3 * config_.default_truncation_distance) {
-      Block<LabelVoxel>::Ptr label_block = nullptr;
-      LabelVoxel* label_voxel = allocateStorageAndGetLabelVoxelPtr(
-          global_voxel_idx, &label_block, &block_idx);
-      updateLabelVoxel(merged_point_G, merged_label, label_voxel,
-                       merged_label_confidence);
+  if (deduplicate_clearing_voxels) {
+    clearVoxelsOnce(origin, *ray_voxels, merged_rays, tsdf_block.get(),
+                    label_stats, ray_stats);
+    return;
+  }
+
+  for (const RayVoxel& ray_voxel : *ray_voxels) {
+    const MergedRay& merged_ray = merged_rays[ray_voxel.ray_idx];
+    const VoxelIndex local_voxel_idx = getLocalFromGlobalVoxelIndex(
+        ray_voxel.global_voxel_idx, voxels_per_side_);
+
+    TsdfVoxel& tsdf_voxel = tsdf_block->getVoxelByVoxelIndex(local_voxel_idx);
+    updateTsdfVoxel(origin, merged_ray.point_G, ray_voxel.global_voxel_idx,
+                    merged_ray.color, merged_ray.weight, &tsdf_voxel);
+
+    if (merged_ray.label_votes.empty()) {
+      ++label_stats->update_stats.num_clearing_voxels;
+    } else if (!isInLabelBand(computeDistance(
+                   origin, merged_ray.point_G,
+                   getCenterPointFromGridIndex(ray_voxel.global_voxel_idx,
+                                               voxel_size_)))) {
+      ++label_stats->update_stats.num_out_of_band_voxels;
+    } else {
+      ++label_stats->update_stats.num_label_updates;
+      CHECK(label_block);
+      LabelVoxel& label_voxel =
+          label_block->getVoxelByVoxelIndex(local_voxel_idx);
+      for (const LabelCount& label_vote : merged_ray.label_votes) {
+        updateLabelVoxelUnlocked(label_vote.label, label_vote.label_confidence,
+                                 &label_voxel, label_stats);
+      }
     }
   }
 }
 
-void LabelTsdfIntegrator::integrateVoxels(
+void LabelTsdfIntegrator::clearVoxelsOnce(
+    const Point& origin, const AlignedVector<RayVoxel>& ray_voxels,
+    const AlignedVector<MergedRay>& merged_rays, Block<TsdfVoxel>* tsdf_block,
+    LabelStatsDelta* label_stats, RayTraversalStats* ray_stats) {
+  CHECK_NOTNULL(tsdf_block);
+  const FloatingPoint truncation_distance =
+      config_.default_truncation_distance;
+  // Clearing update of a voxel, merged over all the rays passing it.
+  struct MergedClearing {
+    const RayVoxel* first_ray_voxel = nullptr;
+    Color color;
+    FloatingPoint weight = 0.0f;
+    // Whether every ray passing the voxel ends at least the truncation
+    // distance behind it.
+    bool is_clamped = true;
+  };
+  std::vector<MergedClearing> merged_clearings(tsdf_block->num_voxels());
+  // Voxels in the order they are first passed by a ray.
+  std::vector<size_t> cleared_voxels;
+
+  // The rays are sorted by index, so the first ray of a voxel does not
+  // depend on how the rays were distributed over the threads.
+  for (const RayVoxel& ray_voxel : ray_voxels) {
+    const MergedRay& merged_ray = merged_rays[ray_voxel.ray_idx];
+    DCHECK(merged_ray.label_votes.empty());
+    const size_t linear_idx = tsdf_block->computeLinearIndexFromVoxelIndex(
+        getLocalFromGlobalVoxelIndex(ray_voxel.global_voxel_idx,
+                                     voxels_per_side_));
+    MergedClearing& clearing = merged_clearings[linear_idx];
+    if (clearing.first_ray_voxel == nullptr) {
+      clearing.first_ray_voxel = &ray_voxel;
+      cleared_voxels.push_back(linear_idx);
+    }
+    if (clearing.is_clamped &&
+        computeDistance(origin, merged_ray.point_G,
+                        getCenterPointFromGridIndex(
+                            ray_voxel.global_voxel_idx, voxel_size_)) <
+            truncation_distance) {
+      clearing.is_clamped = false;
+    }
+    if (merged_ray.weight > 0.0f) {
+      clearing.color = Color::blendTwoColors(clearing.color, clearing.weight,
+                                             merged_ray.color,
+                                             merged_ray.weight);
+      clearing.weight += merged_ray.weight;
+    }
+  }
+  label_stats->update_stats.num_clearing_voxels += ray_voxels.size();
+
+  // A voxel whose distance is clamped to the truncation distance stays
+  // clamped under any number of rays ending behind it, and neither weight
+  // dropoff nor sparsity compensation apply to it, so a single update with
+  // the summed weight has the same result as one update per ray, up to
+  // rounding. All other voxels are updated once per ray, in ray order.
+  std::vector<bool> is_merged(tsdf_block->num_voxels(), false);
+  for (const size_t linear_idx : cleared_voxels) {
+    const MergedClearing& clearing = merged_clearings[linear_idx];
+    TsdfVoxel& tsdf_voxel = tsdf_block->getVoxelByLinearIndex(linear_idx);
+    if (!clearing.is_clamped || (tsdf_voxel.weight > 0.0f &&
+                                 tsdf_voxel.distance < truncation_distance)) {
+      continue;
+    }
+    is_merged[linear_idx] = true;
+    const RayVoxel& ray_voxel = *clearing.first_ray_voxel;
+    updateTsdfVoxel(origin, merged_rays[ray_voxel.ray_idx].point_G,
+                    ray_voxel.global_voxel_idx, clearing.color,
+                    clearing.weight, &tsdf_voxel);
+  }
+  for (const RayVoxel& ray_voxel : ray_voxels) {
+    const size_t linear_idx = tsdf_block->computeLinearIndexFromVoxelIndex(
+        getLocalFromGlobalVoxelIndex(ray_voxel.global_voxel_idx,
+                                     voxels_per_side_));
+    if (is_merged[linear_idx]) {
+      if (&ray_voxel != merged_clearings[linear_idx].first_ray_voxel) {
+        ++ray_stats->num_merged_clearing_steps;
+      }
+      continue;
+    }
+    const MergedRay& merged_ray = merged_rays[ray_voxel.ray_idx];
+    updateTsdfVoxel(origin, merged_ray.point_G, ray_voxel.global_voxel_idx,
+                    merged_ray.color, merged_ray.weight,
+                    &tsdf_block->getVoxelByLinearIndex(linear_idx));
+  }
+}
+
+void LabelTsdfIntegrator::integrateRaysBlockPartitioned(
     const Transformation& T_G_C, const Pointcloud& points_C,
-    const Colors& colors, const Label& label, const bool enable_anti_grazing,
-    const bool clearing_ray, const VoxelMap& voxel_map,
-    const VoxelMap& clear_map, const size_t thread_idx) {
-  VoxelMap::const_iterator it;
-  size_t map_size;
-  if (clearing_ray) {
-    it = clear_map.begin();
-    map_size = clear_map.size();
-  } else {
-    it = voxel_map.begin();
-    map_size = voxel_map.size();
+    const Colors& colors, const Labels& labels,
+    const PointCounts& point_counts, const bool enable_anti_grazing,
+    const bool clearing_ray,
+    const std::vector<const VoxelMapElement*>& rays,
+    const VoxelMap& voxel_map) {
+  const size_t grain_size = label_tsdf_config_.integration_grain_size;
+  const size_t num_chunks = (rays.size() + grain_size - 1u) / grain_size;
+
+  timing::Timer cast_timer("integrate_rays/block_partitioned/cast");
+  AlignedVector<MergedRay> merged_rays(rays.size());
+  std::vector<BlockRayVoxelsMap> block_ray_voxels_per_thread(
+      thread_pool_->numThreads());
+  std::vector<IndexSet> label_blocks_per_thread(thread_pool_->numThreads());
+  std::atomic<size_t> next_ray_idx(0u);
+  thread_pool_->run(num_chunks, [&](const size_t thread_idx) {
+    castRaysToBlocks(T_G_C, points_C, colors, labels, point_counts,
+                     enable_anti_grazing, clearing_ray, rays, voxel_map,
+                     &next_ray_idx, &merged_rays,
+                     &block_ray_voxels_per_thread[thread_idx],
+                     &label_blocks_per_thread[thread_idx],
+                     &ray_traversal_stats_per_thread_[thread_idx]);
+  });
+  cast_timer.Stop();
+
+  // Gather the buckets of all threads per block and allocate the blocks
+  // up front, so that the layers are not modified while updating.
+  timing::Timer allocate_timer("integrate_rays/block_partitioned/allocate");
+  typedef AnyIndexHashMapType<
+      std::vector<const AlignedVector<RayVoxel>*>>::type BlockWorkMap;
+  BlockWorkMap block_work;
+  for (const BlockRayVoxelsMap& block_ray_voxels :
+       block_ray_voxels_per_thread) {
+    for (const std::pair<const BlockIndex, AlignedVector<RayVoxel>>&
+             block_ray_voxels_pair : block_ray_voxels) {
+      block_work[block_ray_voxels_pair.first].push_back(
+          &block_ray_voxels_pair.second);
+    }
+  }
+  IndexSet label_blocks;
+  for (const IndexSet& thread_label_blocks : label_blocks_per_thread) {
+    label_blocks.insert(thread_label_blocks.begin(),
+                        thread_label_blocks.end());
   }
-  for (size_t i = 0u; i < map_size; ++i) {
-    if (((i + thread_idx + 1) % config_.integrator_threads) == 0u) {
-      integrateVoxel(T_G_C, points_C, colors, label, enable_anti_grazing,
-                     clearing_ray, *it, voxel_map);
+  std::vector<const BlockWorkMap::value_type*> blocks;
+  blocks.reserve(block_work.size());
+  for (const BlockWorkMap::value_type& block_work_pair : block_work) {
+    if (label_blocks.count(block_work_pair.first) > 0u) {
+      allocateTsdfAndLabelBlock(block_work_pair.first);
+    } else {
+      allocateTsdfBlock(block_work_pair.first);
     }
-    ++it;
+    blocks.push_back(&block_work_pair);
   }
+  allocate_timer.Stop();
+
+  // Every block is owned by exactly one thread for the whole pass.
+  timing::Timer update_timer("integrate_rays/block_partitioned/update");
+  const Point& origin = T_G_C.getPosition();
+  const bool deduplicate_clearing_voxels =
+      clearing_ray && label_tsdf_config_.enable_clearing_voxel_deduplication;
+  std::atomic<size_t> next_block_idx(0u);
+  thread_pool_->run(blocks.size(), [&](const size_t thread_idx) {
+    size_t block_idx;
+    while ((block_idx = next_block_idx.fetch_add(1u)) < blocks.size()) {
+      updateBlock(origin, blocks[block_idx]->first, blocks[block_idx]->second,
+                  merged_rays, deduplicate_clearing_voxels,
+                  &label_stats_per_thread_[thread_idx],
+                  &ray_traversal_stats_per_thread_[thread_idx]);
+    }
+  });
+  update_timer.Stop();
 }
 
 void LabelTsdfIntegrator::integrateRays(
     const Transformation& T_G_C, const Pointcloud& points_C,
-    const Colors& colors, const Label& label, const bool enable_anti_grazing,
-    const bool clearing_ray, const VoxelMap& voxel_map,
-    const VoxelMap& clear_map) {
-  const Point& origin = T_G_C.getPosition();
+    const Colors& colors, const Labels& labels,
+    const PointCounts& point_counts, const bool enable_anti_grazing,
+    const bool clearing_ray,
+    const VoxelMap& voxel_map, const VoxelMap& clear_map) {
+  CHECK_GT(label_tsdf_config_.integration_grain_size, 0u);
+  const VoxelMap& ray_map = clearing_ray ? clear_map : voxel_map;
+
+  // Flatten the bundled rays so that threads can take them in chunks.
+  std::vector<const VoxelMapElement*> rays;
+  rays.reserve(ray_map.size());
+  for (const VoxelMapElement& ray : ray_map) {
+    rays.push_back(&ray);
+  }
 
-  // if only 1 thread just do function call, otherwise spawn threads
-  if (config_.integrator_threads == 1u) {
-    constexpr size_t thread_idx = 0u;
-    integrateVoxels(T_G_C, points_C, colors, label, enable_anti_grazing,
-                    clearing_ray, voxel_map, clear_map, thread_idx);
+  // Only wake up as many threads as there are chunks of rays, small segments
+  // are integrated on the calling thread.
+  const size_t grain_size = label_tsdf_config_.integration_grain_size;
+  const size_t num_chunks = (rays.size() + grain_size - 1u) / grain_size;
+  // Clearing rays of the whole frame are always cast before updating when
+  // their voxels are deduplicated.
+  if (label_tsdf_config_.enable_block_partitioned_integration ||
+      (clearing_ray &&
+       label_tsdf_config_.enable_clearing_voxel_deduplication)) {
+    integrateRaysBlockPartitioned(T_G_C, points_C, colors, labels,
+                                  point_counts, enable_anti_grazing,
+                                  clearing_ray, rays, voxel_map);
   } else {
-    std::list<std::thread> integration_threads;
-    for (size_t i = 0u; i < config_.integrator_threads; ++i) {
-      integration_threads.emplace_back(
-          &LabelTsdfIntegrator::integrateVoxels, this, T_G_C, points_C, colors,
-          label, enable_anti_grazing, clearing_ray, voxel_map, clear_map, i);
+    // Merge the rays and allocate all the blocks they will touch up front,
+    // so that the voxel pass neither allocates nor locks for new blocks.
+    timing::Timer preallocation_timer("integrate_rays/preallocate_blocks");
+    AlignedVector<MergedRay> merged_rays(rays.size());
+    std::vector<IndexSet> block_footprint_per_thread(
+        thread_pool_->numThreads());
+    std::vector<IndexSet> label_block_footprint_per_thread(
+        thread_pool_->numThreads());
+    std::atomic<size_t> next_merge_ray_idx(0u);
+    thread_pool_->run(num_chunks, [&](const size_t thread_idx) {
+      mergeRaysAndComputeBlockFootprint(
+          T_G_C, points_C, colors, labels, point_counts, clearing_ray, rays,
+          &next_merge_ray_idx, &merged_rays,
+          &block_footprint_per_thread[thread_idx],
+          &label_block_footprint_per_thread[thread_idx]);
+    });
+    // The label blocks are allocated first, so that their TSDF blocks are
+    // not counted as TSDF only blocks.
+    for (const IndexSet& label_block_footprint :
+         label_block_footprint_per_thread) {
+      for (const BlockIndex& block_idx : label_block_footprint) {
+        allocateTsdfAndLabelBlock(block_idx);
+      }
     }
-
-    for (std::thread& thread : integration_threads) {
-      thread.join();
+    for (const IndexSet& block_footprint : block_footprint_per_thread) {
+      for (const BlockIndex& block_idx : block_footprint) {
+        allocateTsdfBlock(block_idx);
+      }
     }
+    preallocation_timer.Stop();
+
+    // Blocks missed by the footprint, e.g. due to rounding at block
+    // borders, are still allocated through the temporary block maps.
+    std::atomic<size_t> next_ray_idx(0u);
+    thread_pool_->run(num_chunks, [&](const size_t thread_idx) {
+      integrateVoxels(T_G_C, enable_anti_grazing, clearing_ray, rays,
+                      merged_rays, voxel_map, &next_ray_idx,
+                      &label_stats_per_thread_[thread_idx],
+                      &ray_traversal_stats_per_thread_[thread_idx]);
+    });
+  }
+
+  timing::Timer reduction_timer("integrate_rays/reduce_label_stats");
+  reduceLabelStats();
+  reduction_timer.Stop();
+
+  for (RayTraversalStats& ray_stats : ray_traversal_stats_per_thread_) {
+    ray_traversal_stats_ += ray_stats;
+    ray_stats = RayTraversalStats();
   }
 
   timing::Timer insertion_timer("inserting_missed_blocks");
@@ -672,6 +2081,366 @@ void LabelTsdfIntegrator::integrateRays(
   insertion_timer.Stop();
 }
 
+void LabelTsdfIntegrator::renderSegmentedDepthImage(
+    const std::vector<Segment*>& segments, const CameraIntrinsics& camera,
+    SegmentedDepthImage* image) const {
+  CHECK_NOTNULL(image);
+  CHECK_GT(camera.fx, 0.0f);
+  CHECK_GT(camera.fy, 0.0f);
+  const size_t num_pixels = camera.width * camera.height;
+  image->camera = camera;
+  image->depths.assign(num_pixels, 0.0f);
+  image->colors.assign(num_pixels, Color());
+  image->segment_indices.assign(num_pixels, SegmentedDepthImage::kNoSegment);
+
+  for (size_t segment_idx = 0u; segment_idx < segments.size();
+       ++segment_idx) {
+    const Segment* segment = CHECK_NOTNULL(segments[segment_idx]);
+    CHECK_EQ(segment->points_C_.size(), segment->colors_.size());
+    for (size_t pt_idx = 0u; pt_idx < segment->points_C_.size(); ++pt_idx) {
+      const Point& point_C = segment->points_C_[pt_idx];
+      if (point_C.z() <= kEpsilon) {
+        continue;
+      }
+      const int u = static_cast<int>(
+          std::round(camera.fx * point_C.x() / point_C.z() + camera.cx));
+      const int v = static_cast<int>(
+          std::round(camera.fy * point_C.y() / point_C.z() + camera.cy));
+      if (u < 0 || v < 0 || u >= static_cast<int>(camera.width) ||
+          v >= static_cast<int>(camera.height)) {
+        continue;
+      }
+      const size_t pixel_idx = v * camera.width + u;
+      float& depth = image->depths[pixel_idx];
+      if (depth <= 0.0f || point_C.z() < depth) {
+        depth = point_C.z();
+        image->colors[pixel_idx] = segment->colors_[pt_idx];
+        image->segment_indices[pixel_idx] = static_cast<int>(segment_idx);
+      }
+    }
+  }
+}
+
+void LabelTsdfIntegrator::integrateSegmentedDepthImage(
+    const Transformation& T_G_C, const std::vector<Segment*>& segments,
+    const SegmentedDepthImage& image) {
+  const CameraIntrinsics& camera = image.camera;
+  const size_t num_pixels = camera.width * camera.height;
+  ++map_version_;
+  CHECK_EQ(image.depths.size(), num_pixels);
+  CHECK_EQ(image.colors.size(), num_pixels);
+  CHECK_EQ(image.segment_indices.size(), num_pixels);
+
+  // Allocate the blocks around the observed surface, the threads take the
+  // rows of the image one by one.
+  timing::Timer allocation_timer("integrate_frame/projective/allocate_blocks");
+  std::vector<IndexSet> surface_blocks_per_thread(thread_pool_->numThreads());
+  std::atomic<size_t> next_row(0u);
+  thread_pool_->run(camera.height, [&](const size_t thread_idx) {
+    size_t row;
+    while ((row = next_row.fetch_add(1u)) < camera.height) {
+      addSurfaceBlocks(T_G_C, image, row, row + 1u,
+                       &surface_blocks_per_thread[thread_idx]);
+    }
+  });
+  for (const IndexSet& surface_blocks : surface_blocks_per_thread) {
+    for (const BlockIndex& block_idx : surface_blocks) {
+      allocateTsdfAndLabelBlock(block_idx);
+    }
+  }
+
+  allocation_timer.Stop();
+
+  // Collect the allocated blocks that may be seen by the camera, looking up
+  // the blocks of the bounding box of the frustum instead of scanning the
+  // whole map, the threads take the x slices of the box one by one. Only
+  // the blocks around the surface have a label block.
+  timing::Timer frustum_timer("integrate_frame/projective/frustum_blocks");
+  const Transformation T_C_G = T_G_C.inverse();
+  BlockIndex min_block_idx;
+  BlockIndex max_block_idx;
+  getFrustumBlockRange(T_G_C, camera, &min_block_idx, &max_block_idx);
+  const size_t num_slices =
+      static_cast<size_t>(max_block_idx.x() - min_block_idx.x() + 1);
+  std::vector<BlockIndexList> frustum_blocks_per_thread(
+      thread_pool_->numThreads());
+  std::atomic<size_t> next_slice(0u);
+  thread_pool_->run(num_slices, [&](const size_t thread_idx) {
+    size_t slice;
+    while ((slice = next_slice.fetch_add(1u)) < num_slices) {
+      BlockIndex block_idx;
+      block_idx.x() = min_block_idx.x() + static_cast<IndexElement>(slice);
+      for (block_idx.y() = min_block_idx.y();
+           block_idx.y() <= max_block_idx.y(); ++block_idx.y()) {
+        for (block_idx.z() = min_block_idx.z();
+             block_idx.z() <= max_block_idx.z(); ++block_idx.z()) {
+          if (isBlockInFrustum(T_C_G, camera, block_idx) &&
+              layer_->getBlockPtrByIndex(block_idx)) {
+            frustum_blocks_per_thread[thread_idx].push_back(block_idx);
+          }
+        }
+      }
+    }
+  });
+  BlockIndexList frustum_blocks;
+  for (const BlockIndexList& thread_frustum_blocks :
+       frustum_blocks_per_thread) {
+    frustum_blocks.insert(frustum_blocks.end(), thread_frustum_blocks.begin(),
+                          thread_frustum_blocks.end());
+  }
+  frustum_timer.Stop();
+
+  // Every block is owned by exactly one thread for the whole pass.
+  timing::Timer update_timer("integrate_frame/projective/update_blocks");
+  std::vector<ProjectiveIntegrationStats> projective_stats_per_thread(
+      thread_pool_->numThreads());
+  std::atomic<size_t> next_block_idx(0u);
+  thread_pool_->run(frustum_blocks.size(), [&](const size_t thread_idx) {
+    size_t block_idx;
+    while ((block_idx = next_block_idx.fetch_add(1u)) <
+           frustum_blocks.size()) {
+      updateBlockProjective(T_G_C, segments, image, frustum_blocks[block_idx],
+                            &label_stats_per_thread_[thread_idx],
+                            &projective_stats_per_thread[thread_idx]);
+    }
+  });
+  update_timer.Stop();
+
+  timing::Timer reduction_timer("integrate_rays/reduce_label_stats");
+  reduceLabelStats();
+  reduction_timer.Stop();
+
+  ++projective_integration_stats_.num_frames;
+  projective_integration_stats_.num_box_blocks +=
+      num_slices *
+      static_cast<size_t>(max_block_idx.y() - min_block_idx.y() + 1) *
+      static_cast<size_t>(max_block_idx.z() - min_block_idx.z() + 1);
+  projective_integration_stats_.num_frustum_blocks += frustum_blocks.size();
+  for (const ProjectiveIntegrationStats& projective_stats :
+       projective_stats_per_thread) {
+    projective_integration_stats_ += projective_stats;
+  }
+}
+
+void LabelTsdfIntegrator::addSurfaceBlocks(const Transformation& T_G_C,
+                                           const SegmentedDepthImage& image,
+                                           const size_t begin_row,
+                                           const size_t end_row,
+                                           IndexSet* surface_blocks) const {
+  CHECK_NOTNULL(surface_blocks);
+  const CameraIntrinsics& camera = image.camera;
+  const FloatingPoint truncation_distance = config_.default_truncation_distance;
+  const Point& origin = T_G_C.getPosition();
+  // With voxel carving the label band may reach further in front of the
+  // surface than the truncation distance.
+  FloatingPoint band_front_distance = truncation_distance;
+  if (config_.voxel_carving_enabled) {
+    band_front_distance =
+        std::max(band_front_distance,
+                 label_tsdf_config_.label_band_factor * truncation_distance);
+  }
+
+  for (size_t v = begin_row; v < end_row; ++v) {
+    for (size_t u = 0u; u < camera.width; ++u) {
+      const float depth = image.depths[v * camera.width + u];
+      if (depth <= 0.0f) {
+        continue;
+      }
+      const Ray ray_C((u - camera.cx) / camera.fx, (v - camera.cy) / camera.fy,
+                      1.0f);
+      const FloatingPoint ray_length = depth * ray_C.norm();
+      if (ray_length < config_.min_ray_length_m ||
+          ray_length > config_.max_ray_length_m) {
+        continue;
+      }
+      const Point point_G = T_G_C * Point(ray_C * depth);
+      const Ray direction_G = (point_G - origin).normalized();
+      // Every block the band of the ray passes, as in
+      // addRayBlockFootprint().
+      RayCaster block_ray_caster(
+          (point_G - direction_G * band_front_distance) * block_size_inv_,
+          (point_G + direction_G * truncation_distance) * block_size_inv_);
+      GlobalIndex block_idx;
+      while (block_ray_caster.nextRayIndex(&block_idx)) {
+        surface_blocks->insert(block_idx.cast<IndexElement>());
+      }
+    }
+  }
+}
+
+void LabelTsdfIntegrator::getFrustumBlockRange(
+    const Transformation& T_G_C, const CameraIntrinsics& camera,
+    BlockIndex* min_block_idx, BlockIndex* max_block_idx) const {
+  CHECK_NOTNULL(min_block_idx);
+  CHECK_NOTNULL(max_block_idx);
+  const FloatingPoint max_ray_length = config_.max_ray_length_m;
+  const Point& origin = T_G_C.getPosition();
+  // The frustum up to max_ray_length_m lies within the pyramid spanned by
+  // the camera center and the image corners at that depth, and within the
+  // sphere of that radius around the camera center.
+  Point min_point = origin;
+  Point max_point = origin;
+  for (const FloatingPoint u :
+       {0.0f, static_cast<FloatingPoint>(camera.width)}) {
+    for (const FloatingPoint v :
+         {0.0f, static_cast<FloatingPoint>(camera.height)}) {
+      const Point corner_G =
+          T_G_C * Point(max_ray_length * Ray((u - camera.cx) / camera.fx,
+                                             (v - camera.cy) / camera.fy,
+                                             1.0f));
+      min_point = min_point.cwiseMin(corner_G);
+      max_point = max_point.cwiseMax(corner_G);
+    }
+  }
+  const Point sphere_extent = Point::Constant(max_ray_length);
+  min_point = min_point.cwiseMax(origin - sphere_extent);
+  max_point = max_point.cwiseMin(origin + sphere_extent);
+  // isBlockInFrustum() keeps the blocks whose bounding sphere reaches into
+  // the frustum.
+  const Point margin = Point::Constant(block_size_);
+  *min_block_idx = getGridIndexFromPoint<BlockIndex>(
+      Point(min_point - margin), block_size_inv_);
+  *max_block_idx = getGridIndexFromPoint<BlockIndex>(
+      Point(max_point + margin), block_size_inv_);
+}
+
+bool LabelTsdfIntegrator::isBlockInFrustum(const Transformation& T_C_G,
+                                           const CameraIntrinsics& camera,
+                                           const BlockIndex& block_idx) const {
+  const Point block_center_C =
+      T_C_G * getCenterPointFromGridIndex(block_idx, block_size_);
+  const FloatingPoint block_radius = 0.5f * std::sqrt(3.0f) * block_size_;
+  const FloatingPoint z = block_center_C.z();
+  if (z + block_radius <= 0.0f ||
+      block_center_C.norm() - block_radius > config_.max_ray_length_m) {
+    return false;
+  }
+  // Blocks crossing the image plane of the camera are kept.
+  if (z <= block_radius) {
+    return true;
+  }
+  // Project the center and grow the image by the largest projected radius
+  // of the block.
+  const FloatingPoint u = camera.fx * block_center_C.x() / z + camera.cx;
+  const FloatingPoint v = camera.fy * block_center_C.y() / z + camera.cy;
+  const FloatingPoint margin_u = camera.fx * block_radius / (z - block_radius);
+  const FloatingPoint margin_v = camera.fy * block_radius / (z - block_radius);
+  return u >= -margin_u && u < camera.width + margin_u && v >= -margin_v &&
+         v < camera.height + margin_v;
+}
+
+void LabelTsdfIntegrator::updateBlockProjective(
+    const Transformation& T_G_C, const std::vector<Segment*>& segments,
+    const SegmentedDepthImage& image, const BlockIndex& block_idx,
+    LabelStatsDelta* label_stats,
+    ProjectiveIntegrationStats* projective_stats) {
+  CHECK_NOTNULL(label_stats);
+  CHECK_NOTNULL(projective_stats);
+  Block<TsdfVoxel>::Ptr tsdf_block;
+  Block<LabelVoxel>::Ptr label_block;
+  label_tsdf_map_->getBlockPair(block_idx, &tsdf_block, &label_block);
+  CHECK(tsdf_block);
+
+  const CameraIntrinsics& camera = image.camera;
+  const Transformation T_C_G = T_G_C.inverse();
+  const Point& origin = T_G_C.getPosition();
+  const FloatingPoint truncation_distance = config_.default_truncation_distance;
+
+  bool is_block_updated = false;
+  for (size_t linear_idx = 0u; linear_idx < tsdf_block->num_voxels();
+       ++linear_idx) {
+    const Point voxel_center_G =
+        tsdf_block->computeCoordinatesFromLinearIndex(linear_idx);
+    const Point voxel_center_C = T_C_G * voxel_center_G;
+    if (voxel_center_C.z() <= kEpsilon) {
+      continue;
+    }
+    const int u = static_cast<int>(std::round(
+        camera.fx * voxel_center_C.x() / voxel_center_C.z() + camera.cx));
+    const int v = static_cast<int>(std::round(
+        camera.fy * voxel_center_C.y() / voxel_center_C.z() + camera.cy));
+    if (u < 0 || v < 0 || u >= static_cast<int>(camera.width) ||
+        v >= static_cast<int>(camera.height)) {
+      continue;
+    }
+    ++projective_stats->num_projected_voxels;
+
+    const size_t pixel_idx = v * camera.width + u;
+    const float depth = image.depths[pixel_idx];
+    if (depth <= 0.0f) {
+      continue;
+    }
+    const Point point_C((u - camera.cx) / camera.fx * depth,
+                        (v - camera.cy) / camera.fy * depth, depth);
+    const FloatingPoint ray_length = point_C.norm();
+    if (ray_length < config_.min_ray_length_m) {
+      continue;
+    }
+    // Like the clearing rays of the ray casting integrators, pixels beyond
+    // the maximum ray length only clear the free space up to it.
+    const bool is_clearing_pixel = ray_length > config_.max_ray_length_m;
+    if (is_clearing_pixel && !config_.allow_clear) {
+      continue;
+    }
+
+    // Same distance along the ray through the pixel as computed by
+    // updateTsdfVoxel(). Voxels far behind the surface are occluded.
+    const Point point_G = T_G_C * point_C;
+    const FloatingPoint sdf =
+        computeDistance(origin, point_G, voxel_center_G);
+    if (is_clearing_pixel) {
+      // Distance to the end of the ray cut at the maximum ray length.
+      const FloatingPoint clearing_sdf =
+          sdf - (ray_length - config_.max_ray_length_m);
+      if (clearing_sdf < 0.0f || (!config_.voxel_carving_enabled &&
+                                  clearing_sdf > truncation_distance)) {
+        continue;
+      }
+    } else if (sdf < -truncation_distance ||
+               (!config_.voxel_carving_enabled &&
+                sdf > truncation_distance)) {
+      continue;
+    }
+    ++projective_stats->num_updated_voxels;
+    is_block_updated = true;
+
+    const GlobalIndex global_voxel_idx =
+        getGlobalVoxelIndexFromBlockAndVoxelIndex(
+            block_idx, tsdf_block->computeVoxelIndexFromLinearIndex(linear_idx),
+            voxels_per_side_);
+    TsdfVoxel& tsdf_voxel = tsdf_block->getVoxelByLinearIndex(linear_idx);
+    updateTsdfVoxel(origin, point_G, global_voxel_idx, image.colors[pixel_idx],
+                    getVoxelWeight(point_C), &tsdf_voxel);
+
+    // Pixels without a segment are treated like clearing rays. Label band
+    // voxels in blocks without a label block project to another pixel than
+    // the rays whose band allocated the label blocks in addSurfaceBlocks().
+    const int segment_idx = image.segment_indices[pixel_idx];
+    if (is_clearing_pixel || segment_idx == SegmentedDepthImage::kNoSegment) {
+      ++label_stats->update_stats.num_clearing_voxels;
+    } else if (!isInLabelBand(sdf) || !label_block) {
+      ++label_stats->update_stats.num_out_of_band_voxels;
+    } else {
+      ++label_stats->update_stats.num_label_updates;
+      CHECK_LT(static_cast<size_t>(segment_idx), segments.size());
+      LabelConfidence label_confidence = 1u;
+      if (label_tsdf_config_.enable_confidence_weight_dropoff) {
+        label_confidence = computeConfidenceWeight(ray_length);
+      }
+      updateLabelVoxelUnlocked(segments[segment_idx]->label_, label_confidence,
+                               &label_block->getVoxelByLinearIndex(linear_idx),
+                               label_stats);
+    }
+  }
+
+  if (is_block_updated) {
+    tsdf_block->updated() = true;
+    if (label_tsdf_config_.enable_block_versions) {
+      label_stats->changed_blocks.insert(block_idx);
+    }
+  }
+}
+
 FloatingPoint LabelTsdfIntegrator::computeConfidenceWeight(
     const FloatingPoint& distance) {
   const FloatingPoint mu = label_tsdf_config_.lognormal_weight_mean;
@@ -705,6 +2474,7 @@ void LabelTsdfIntegrator::swapLabels(const Label& old_label,
                                      const Label& new_label) {
   BlockIndexList all_label_blocks;
   label_layer_->getAllAllocatedBlocks(&all_label_blocks);
+  ++map_version_;
 
   for (const BlockIndex& block_index : all_label_blocks) {
     Block<TsdfVoxel>::Ptr tsdf_block = layer_->getBlockPtrByIndex(block_index);
@@ -743,6 +2513,9 @@ void LabelTsdfIntegrator::swapLabels(const Label& old_label,
         if (!tsdf_block->updated()) {
           label_block->updated() = true;
         }
+        if (label_tsdf_config_.enable_block_versions) {
+          block_versions_[block_index] = map_version_;
+        }
       }
     }
   }
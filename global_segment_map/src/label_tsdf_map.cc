@@ -66,6 +66,35 @@ void LabelTsdfMap::getSemanticInstanceList(InstanceLabels* instance_labels,
   }
 }
 
+void LabelTsdfMap::getBlockPair(const BlockIndex& block_index,
+                                Block<TsdfVoxel>::Ptr* tsdf_block,
+                                Block<LabelVoxel>::Ptr* label_block) {
+  CHECK_NOTNULL(tsdf_block);
+  CHECK_NOTNULL(label_block);
+  *tsdf_block = tsdf_layer_->getBlockPtrByIndex(block_index);
+  *label_block = label_layer_->getBlockPtrByIndex(block_index);
+}
+
+void LabelTsdfMap::getBlockPair(
+    const BlockIndex& block_index, Block<TsdfVoxel>::ConstPtr* tsdf_block,
+    Block<LabelVoxel>::ConstPtr* label_block) const {
+  CHECK_NOTNULL(tsdf_block);
+  CHECK_NOTNULL(label_block);
+  const Layer<TsdfVoxel>& tsdf_layer = *tsdf_layer_;
+  const Layer<LabelVoxel>& label_layer = *label_layer_;
+  *tsdf_block = tsdf_layer.getBlockPtrByIndex(block_index);
+  *label_block = label_layer.getBlockPtrByIndex(block_index);
+}
+
+void LabelTsdfMap::allocateBlockPair(const BlockIndex& block_index,
+                                     Block<TsdfVoxel>::Ptr* tsdf_block,
+                                     Block<LabelVoxel>::Ptr* label_block) {
+  CHECK_NOTNULL(tsdf_block);
+  CHECK_NOTNULL(label_block);
+  *tsdf_block = tsdf_layer_->allocateBlockPtrByIndex(block_index);
+  *label_block = label_layer_->allocateBlockPtrByIndex(block_index);
+}
+
 void LabelTsdfMap::extractSegmentLayers(
     const std::vector<Label>& labels,
     std::unordered_map<Label, LayerPair>* label_layers_map,
@@ -86,10 +115,13 @@ void LabelTsdfMap::extractSegmentLayers(
   tsdf_layer_->getAllAllocatedBlocks(&all_label_blocks);
 
   for (const BlockIndex& block_index : all_label_blocks) {
-    Block<TsdfVoxel>::Ptr global_tsdf_block =
-        tsdf_layer_->getBlockPtrByIndex(block_index);
-    Block<LabelVoxel>::Ptr global_label_block =
-        label_layer_->getBlockPtrByIndex(block_index);
+    Block<TsdfVoxel>::Ptr global_tsdf_block;
+    Block<LabelVoxel>::Ptr global_label_block;
+    getBlockPair(block_index, &global_tsdf_block, &global_label_block);
+    // Blocks away from any surface have no label block.
+    if (!global_label_block) {
+      continue;
+    }
 
     const size_t vps = global_label_block->voxels_per_side();
     for (size_t i = 0u; i < vps * vps * vps; ++i) {
@@ -153,10 +185,13 @@ void LabelTsdfMap::extractInstanceLayers(
   tsdf_layer_->getAllAllocatedBlocks(&all_label_blocks);
 
   for (const BlockIndex& block_index : all_label_blocks) {
-    Block<TsdfVoxel>::Ptr global_tsdf_block =
-        tsdf_layer_->getBlockPtrByIndex(block_index);
-    Block<LabelVoxel>::Ptr global_label_block =
-        label_layer_->getBlockPtrByIndex(block_index);
+    Block<TsdfVoxel>::Ptr global_tsdf_block;
+    Block<LabelVoxel>::Ptr global_label_block;
+    getBlockPair(block_index, &global_tsdf_block, &global_label_block);
+    // Blocks away from any surface have no label block.
+    if (!global_label_block) {
+      continue;
+    }
 
     const size_t vps = global_label_block->voxels_per_side();
     for (size_t i = 0u; i < vps * vps * vps; ++i) {
@@ -125,7 +125,9 @@ void MeshLabelIntegrator::generateMeshBlocksFunction(
           label_layer_mutable_ptr_->getBlockPtrByIndex(block_idx);
 
       tsdf_block->updated() = false;
-      label_block->updated() = false;
+      if (label_block) {
+        label_block->updated() = false;
+      }
     }
   }
 }
@@ -196,17 +198,17 @@ void MeshLabelIntegrator::updateMeshBlockColor(
       updateMeshColor(*tsdf_block, mesh_block);
       break;
     default:
-      if (!label_block) {
-        LOG(FATAL)
-            << "Trying to color a mesh using a non-existent label block.";
-      }
-      updateMeshColor(*label_block, mesh_block);
+      // TSDF blocks only passed by clearing rays or outside of the label
+      // band have no label block.
+      updateMeshColor(label_block.get(), mesh_block);
   }
 }
 
-void MeshLabelIntegrator::updateMeshColor(const Block<LabelVoxel>& label_block,
+void MeshLabelIntegrator::updateMeshColor(const Block<LabelVoxel>* label_block,
                                           Mesh* mesh) {
   CHECK_NOTNULL(mesh);
+  // Color of the vertices without a label voxel.
+  static const LabelVoxel kDefaultVoxel;
 
   mesh->colors.clear();
   mesh->colors.resize(mesh->indices.size());
@@ -214,83 +216,50 @@ void MeshLabelIntegrator::updateMeshColor(const Block<LabelVoxel>& label_block,
   // Use nearest-neighbor search.
   for (size_t i = 0u; i < mesh->vertices.size(); ++i) {
     const Point& vertex = mesh->vertices[i];
-    VoxelIndex voxel_index =
-        label_block.computeVoxelIndexFromCoordinates(vertex);
-    if (label_block.isValidVoxelIndex(voxel_index)) {
-      const LabelVoxel& voxel = label_block.getVoxelByVoxelIndex(voxel_index);
-      switch (label_tsdf_config_.color_scheme) {
-        case kLabelConfidence: {
-          utils::getColorFromLabelConfidence(
-              voxel, label_tsdf_config_.max_confidence, &(mesh->colors[i]));
-        } break;
-        case kLabel: {
-          label_color_map_.getColor(voxel.label, &(mesh->colors[i]));
-        } break;
-        case kSemantic: {
-          SemanticLabel semantic_label = 0u;
-          InstanceLabel instance_label = getInstanceLabel(voxel.label);
-          if (instance_label != BackgroundLabel) {
-            semantic_label =
-                semantic_instance_label_fusion_ptr_->getSemanticLabel(
-                    voxel.label);
-          }
-          semantic_color_map_.getColor(semantic_label, &(mesh->colors[i]));
-        } break;
-        case kInstance: {
-          InstanceLabel instance_label = getInstanceLabel(voxel.label);
-          instance_color_map_.getColor(instance_label, &(mesh->colors[i]));
-        } break;
-        case kMerged: {
-          InstanceLabel instance_label = getInstanceLabel(voxel.label);
-          if (instance_label == BackgroundLabel) {
-            label_color_map_.getColor(voxel.label, &(mesh->colors[i]));
-          } else {
-            instance_color_map_.getColor(instance_label, &(mesh->colors[i]));
-          }
-        } break;
-        default: {
-          LOG(FATAL) << "Unknown mesh color scheme: "
-                     << label_tsdf_config_.color_scheme;
+    const Block<LabelVoxel>* vertex_block = label_block;
+    typename Block<LabelVoxel>::ConstPtr neighbor_block;
+    if (vertex_block == nullptr ||
+        !vertex_block->isValidVoxelIndex(
+            vertex_block->computeVoxelIndexFromCoordinates(vertex))) {
+      neighbor_block = label_layer_const_ptr_->getBlockPtrByCoordinates(vertex);
+      vertex_block = neighbor_block.get();
+    }
+    const LabelVoxel* voxel =
+        vertex_block != nullptr ? &vertex_block->getVoxelByCoordinates(vertex)
+                                : &kDefaultVoxel;
+    switch (label_tsdf_config_.color_scheme) {
+      case kLabelConfidence: {
+        utils::getColorFromLabelConfidence(
+            *voxel, label_tsdf_config_.max_confidence, &(mesh->colors[i]));
+      } break;
+      case kLabel: {
+        label_color_map_.getColor(voxel->label, &(mesh->colors[i]));
+      } break;
+      case kSemantic: {
+        SemanticLabel semantic_label = 0u;
+        InstanceLabel instance_label = getInstanceLabel(voxel->label);
+        if (instance_label != BackgroundLabel) {
+          semantic_label =
+              semantic_instance_label_fusion_ptr_->getSemanticLabel(
+                  voxel->label);
         }
-      }
-    } else {
-      const typename Block<LabelVoxel>::ConstPtr neighbor_block =
-          label_layer_const_ptr_->getBlockPtrByCoordinates(vertex);
-      const LabelVoxel& voxel = neighbor_block->getVoxelByCoordinates(vertex);
-      switch (label_tsdf_config_.color_scheme) {
-        case kLabel: {
-          label_color_map_.getColor(voxel.label, &(mesh->colors[i]));
-        } break;
-        case kLabelConfidence: {
-          utils::getColorFromLabelConfidence(
-              voxel, label_tsdf_config_.max_confidence, &(mesh->colors[i]));
-        } break;
-        case kSemantic: {
-          SemanticLabel semantic_label = 0u;
-          InstanceLabel instance_label = getInstanceLabel(voxel.label);
-          if (instance_label != BackgroundLabel) {
-            semantic_label =
-                semantic_instance_label_fusion_ptr_->getSemanticLabel(
-                    voxel.label);
-          }
-          semantic_color_map_.getColor(semantic_label, &(mesh->colors[i]));
-        } break;
-        case kInstance: {
-          InstanceLabel instance_label = getInstanceLabel(voxel.label);
+        semantic_color_map_.getColor(semantic_label, &(mesh->colors[i]));
+      } break;
+      case kInstance: {
+        InstanceLabel instance_label = getInstanceLabel(voxel->label);
+        instance_color_map_.getColor(instance_label, &(mesh->colors[i]));
+      } break;
+      case kMerged: {
+        InstanceLabel instance_label = getInstanceLabel(voxel->label);
+        if (instance_label == BackgroundLabel) {
+          label_color_map_.getColor(voxel->label, &(mesh->colors[i]));
+        } else {
           instance_color_map_.getColor(instance_label, &(mesh->colors[i]));
-        } break;
-        case kMerged: {
-          InstanceLabel instance_label = getInstanceLabel(voxel.label);
-          if (instance_label == BackgroundLabel) {
-            label_color_map_.getColor(voxel.label, &(mesh->colors[i]));
-          } else {
-            instance_color_map_.getColor(instance_label, &(mesh->colors[i]));
-          }
-        } break;
-        default: {
-          LOG(FATAL) << "Unknown mesh color scheme: "
-                     << label_tsdf_config_.color_scheme;
         }
+      } break;
+      default: {
+        LOG(FATAL) << "Unknown mesh color scheme: "
+                   << label_tsdf_config_.color_scheme;
       }
     }
   }
@@ -323,9 +292,14 @@ void MeshLabelIntegrator::updateMeshColor(const Block<TsdfVoxel>& tsdf_block,
         }
       }
     } else {
+      // Vertices outside of the allocated blocks get the color of an
+      // unobserved voxel.
+      static const TsdfVoxel kDefaultVoxel;
       const typename Block<TsdfVoxel>::ConstPtr neighbor_block =
           sdf_layer_const_->getBlockPtrByCoordinates(vertex);
-      const TsdfVoxel& voxel = neighbor_block->getVoxelByCoordinates(vertex);
+      const TsdfVoxel& voxel =
+          neighbor_block ? neighbor_block->getVoxelByCoordinates(vertex)
+                         : kDefaultVoxel;
       switch (label_tsdf_config_.color_scheme) {
         case kColor: {
           utils::getColorIfValid(voxel, config_.min_weight, &(mesh->colors[i]));
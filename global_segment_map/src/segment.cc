@@ -1,6 +1,50 @@
 #include "global_segment_map/segment.h"
+
+#include <cmath>
+#include <unordered_map>
+
+#include <voxblox/core/block_hash.h>
+
 namespace voxblox {
 
+namespace {
+
+// Appends every finite point of the cloud to the segment returned by
+// get_segment for it. The segment of the previous point is reused while the
+// key of the points does not change, as points of a segment are mostly
+// stored contiguously.
+template <typename PointT, typename KeyT, typename GetKey,
+          typename CreateSegment>
+void splitPointCloud(const pcl::PointCloud<PointT>& point_cloud,
+                     const GetKey& get_key,
+                     const CreateSegment& create_segment,
+                     std::vector<Segment*>* segments) {
+  CHECK_NOTNULL(segments);
+  std::unordered_map<KeyT, Segment*> segments_by_key;
+  KeyT last_key = KeyT();
+  Segment* segment = nullptr;
+  for (const PointT& point : point_cloud.points) {
+    if (!std::isfinite(point.x) || !std::isfinite(point.y) ||
+        !std::isfinite(point.z)) {
+      continue;
+    }
+    const KeyT key = get_key(point);
+    if (segment == nullptr || key != last_key) {
+      Segment*& key_segment = segments_by_key[key];
+      if (key_segment == nullptr) {
+        key_segment = create_segment(point);
+        segments->push_back(key_segment);
+      }
+      segment = key_segment;
+      last_key = key;
+    }
+    segment->points_C_.push_back(Point(point.x, point.y, point.z));
+    segment->colors_.push_back(Color(point.r, point.g, point.b, point.a));
+  }
+}
+
+}  // namespace
+
 Segment::Segment(const pcl::PointCloud<voxblox::PointType>& point_cloud,
                  const Transformation& T_G_C)
     : T_G_C_(T_G_C), semantic_label_(0u), instance_label_(0u) {
@@ -67,4 +111,269 @@ Segment::Segment(
   }
 }
 
+Segment::Segment(const Transformation& T_G_C, const Label label,
+                 const SemanticLabel semantic_label,
+                 const InstanceLabel instance_label)
+    : T_G_C_(T_G_C),
+      label_(label),
+      semantic_label_(semantic_label),
+      instance_label_(instance_label) {}
+
+void Segment::downsampleVoxelGrid(const FloatingPoint voxel_size) {
+  CHECK_GT(voxel_size, 0.0f);
+  CHECK_EQ(points_C_.size(), colors_.size());
+  const FloatingPoint voxel_size_inv = 1.0f / voxel_size;
+
+  // Weighted sums of the points and colors falling into each cell, in the
+  // order the cells are first hit.
+  struct CellSums {
+    Point point_C = Point::Zero();
+    float r = 0.0f;
+    float g = 0.0f;
+    float b = 0.0f;
+    float a = 0.0f;
+    uint32_t count = 0u;
+  };
+  AlignedVector<CellSums> cells;
+  cells.reserve(points_C_.size());
+  LongIndexHashMapType<size_t>::type cell_indices;
+  cell_indices.reserve(points_C_.size());
+
+  for (size_t i = 0u; i < points_C_.size(); ++i) {
+    const GlobalIndex cell_idx = getGridIndexFromPoint<GlobalIndex>(
+        T_G_C_ * points_C_[i], voxel_size_inv);
+    const auto insert_status = cell_indices.emplace(cell_idx, cells.size());
+    if (insert_status.second) {
+      cells.emplace_back();
+    }
+    CellSums& cell = cells[insert_status.first->second];
+    // Points already merged by a previous call keep their weight.
+    const uint32_t count = getPointCount(i);
+    const Color& color = colors_[i];
+    cell.point_C += count * points_C_[i];
+    cell.r += count * color.r;
+    cell.g += count * color.g;
+    cell.b += count * color.b;
+    cell.a += count * color.a;
+    cell.count += count;
+  }
+
+  points_C_.resize(cells.size());
+  colors_.resize(cells.size());
+  point_counts_.resize(cells.size());
+  for (size_t i = 0u; i < cells.size(); ++i) {
+    const CellSums& cell = cells[i];
+    const float count_inv = 1.0f / cell.count;
+    points_C_[i] = cell.point_C * count_inv;
+    colors_[i] = Color(static_cast<uint8_t>(std::round(cell.r * count_inv)),
+                       static_cast<uint8_t>(std::round(cell.g * count_inv)),
+                       static_cast<uint8_t>(std::round(cell.b * count_inv)),
+                       static_cast<uint8_t>(std::round(cell.a * count_inv)));
+    point_counts_[i] = cell.count;
+  }
+  clearVoxels();
+}
+
+size_t Segment::getNumRawPoints() const {
+  if (point_counts_.empty()) {
+    return points_C_.size();
+  }
+  size_t num_raw_points = 0u;
+  for (const uint32_t count : point_counts_) {
+    num_raw_points += count;
+  }
+  return num_raw_points;
+}
+
+void Segment::voxelize(const FloatingPoint voxel_size_inv) {
+  CHECK_GT(voxel_size_inv, 0.0f);
+  if (isVoxelized(voxel_size_inv)) {
+    return;
+  }
+  clearVoxels();
+  const size_t num_points = points_C_.size();
+  points_G_.resize(num_points);
+  if (num_points == 0u) {
+    voxel_point_offsets_.push_back(0u);
+    voxelized_voxel_size_inv_ = voxel_size_inv;
+    voxelized_T_G_C_ = T_G_C_;
+    return;
+  }
+
+  // A single 3xN product, which Eigen vectorizes, instead of transforming
+  // every point on its own.
+  typedef Eigen::Matrix<FloatingPoint, 3, Eigen::Dynamic> Points;
+  const Eigen::Map<const Points> points_C(points_C_.front().data(), 3,
+                                          num_points);
+  Eigen::Map<Points> points_G(points_G_.front().data(), 3, num_points);
+  points_G.noalias() = T_G_C_.getRotationMatrix() * points_C;
+  points_G.colwise() += T_G_C_.getPosition();
+
+  // Index of the voxel of every point, in voxel_indices_.
+  std::vector<size_t> point_voxels(num_points);
+  LongIndexHashMapType<size_t>::type voxel_map;
+  voxel_map.reserve(num_points);
+  for (size_t i = 0u; i < num_points; ++i) {
+    const GlobalIndex voxel_idx =
+        getGridIndexFromPoint<GlobalIndex>(points_G_[i], voxel_size_inv);
+    const auto insert_status =
+        voxel_map.emplace(voxel_idx, voxel_indices_.size());
+    if (insert_status.second) {
+      voxel_indices_.push_back(voxel_idx);
+      voxel_point_counts_.push_back(0u);
+    }
+    point_voxels[i] = insert_status.first->second;
+    voxel_point_counts_[point_voxels[i]] += getPointCount(i);
+  }
+
+  // Counting sort of the points by voxel.
+  const size_t num_voxels = voxel_indices_.size();
+  voxel_point_offsets_.assign(num_voxels + 1u, 0u);
+  for (const size_t voxel : point_voxels) {
+    ++voxel_point_offsets_[voxel + 1u];
+  }
+  for (size_t voxel = 1u; voxel < num_voxels; ++voxel) {
+    voxel_point_offsets_[voxel] += voxel_point_offsets_[voxel - 1u];
+  }
+  voxel_point_indices_.resize(num_points);
+  for (size_t i = 0u; i < num_points; ++i) {
+    voxel_point_indices_[voxel_point_offsets_[point_voxels[i]]++] = i;
+  }
+  // Each offset was advanced to the start of the next voxel.
+  for (size_t voxel = num_voxels; voxel > 0u; --voxel) {
+    voxel_point_offsets_[voxel] = voxel_point_offsets_[voxel - 1u];
+  }
+  voxel_point_offsets_[0] = 0u;
+  voxelized_voxel_size_inv_ = voxel_size_inv;
+  voxelized_T_G_C_ = T_G_C_;
+}
+
+void Segment::clearVoxels() {
+  // Clearing keeps the capacity of the buffers.
+  points_G_.clear();
+  voxel_indices_.clear();
+  voxel_point_counts_.clear();
+  voxel_point_offsets_.clear();
+  voxel_point_indices_.clear();
+  voxelized_voxel_size_inv_ = 0.0f;
+}
+
+constexpr size_t SegmentPool::kDefaultMaxPooledSegments;
+
+SegmentPool::SegmentPool(const size_t max_pooled_segments)
+    : max_pooled_segments_(max_pooled_segments) {
+  free_segments_.reserve(max_pooled_segments_);
+}
+
+SegmentPool::~SegmentPool() {
+  for (Segment* segment : free_segments_) {
+    delete segment;
+  }
+}
+
+Segment* SegmentPool::acquire(const Transformation& T_G_C, const Label label,
+                              const SemanticLabel semantic_label,
+                              const InstanceLabel instance_label) {
+  Segment* segment = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.num_acquired_segments;
+    if (free_segments_.empty()) {
+      ++stats_.num_allocated_segments;
+    } else {
+      segment = free_segments_.back();
+      free_segments_.pop_back();
+    }
+  }
+  if (segment == nullptr) {
+    return new Segment(T_G_C, label, semantic_label, instance_label);
+  }
+  // Clearing keeps the capacity of the buffers.
+  segment->T_G_C_ = T_G_C;
+  segment->points_C_.clear();
+  segment->colors_.clear();
+  segment->point_counts_.clear();
+  segment->clearVoxels();
+  segment->label_ = label;
+  segment->semantic_label_ = semantic_label;
+  segment->instance_label_ = instance_label;
+  return segment;
+}
+
+void SegmentPool::release(Segment* segment) {
+  CHECK_NOTNULL(segment);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_segments_.size() < max_pooled_segments_) {
+      free_segments_.push_back(segment);
+      return;
+    }
+    ++stats_.num_deleted_segments;
+  }
+  delete segment;
+}
+
+void SegmentPool::release(std::vector<Segment*>* segments) {
+  CHECK_NOTNULL(segments);
+  std::vector<Segment*> segments_to_delete;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (Segment* segment : *segments) {
+      if (free_segments_.size() < max_pooled_segments_) {
+        free_segments_.push_back(segment);
+      } else {
+        segments_to_delete.push_back(segment);
+      }
+    }
+    stats_.num_deleted_segments += segments_to_delete.size();
+  }
+  segments->clear();
+  for (Segment* segment : segments_to_delete) {
+    delete segment;
+  }
+}
+
+SegmentPool::Stats SegmentPool::getStats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+void SegmentPool::resetStats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_ = Stats();
+}
+
+void splitFramePointCloud(
+    const pcl::PointCloud<voxblox::PointLabelType>& point_cloud,
+    const Transformation& T_G_C, SegmentPool* segment_pool,
+    std::vector<Segment*>* segments) {
+  CHECK_NOTNULL(segment_pool);
+  splitPointCloud<voxblox::PointLabelType, uint32_t>(
+      point_cloud,
+      [](const voxblox::PointLabelType& point) { return point.label; },
+      [&T_G_C, segment_pool](const voxblox::PointLabelType& point) {
+        return segment_pool->acquire(T_G_C, point.label, 0u, 0u);
+      },
+      segments);
+}
+
+void splitFramePointCloud(
+    const pcl::PointCloud<voxblox::PointSemanticInstanceLabelType>&
+        point_cloud,
+    const Transformation& T_G_C, SegmentPool* segment_pool,
+    std::vector<Segment*>* segments) {
+  CHECK_NOTNULL(segment_pool);
+  splitPointCloud<voxblox::PointSemanticInstanceLabelType, uint32_t>(
+      point_cloud,
+      [](const voxblox::PointSemanticInstanceLabelType& point) {
+        return point.label;
+      },
+      [&T_G_C,
+       segment_pool](const voxblox::PointSemanticInstanceLabelType& point) {
+        return segment_pool->acquire(T_G_C, 0u, point.semantic_label,
+                                     point.instance_label);
+      },
+      segments);
+}
+
 }  // namespace voxblox
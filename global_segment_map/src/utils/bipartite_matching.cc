@@ -0,0 +1,146 @@
+#include "global_segment_map/utils/bipartite_matching.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <utility>
+
+#include <glog/logging.h>
+
+namespace voxblox {
+
+void computeMaxWeightMatching(const size_t num_rows, const size_t num_cols,
+                              const std::vector<WeightedEdge>& edges,
+                              std::vector<int>* row_matches) {
+  CHECK_NOTNULL(row_matches);
+  CHECK_LE(num_cols, static_cast<size_t>(std::numeric_limits<int>::max()));
+
+  // Maximizing the weight of a matching in which every row takes a column is
+  // minimizing the cost max_weight + 1 - weight. The private column
+  // num_cols + row of every row, costing max_weight + 1, leaves it unmatched.
+  uint64_t max_weight = 0u;
+  for (const WeightedEdge& edge : edges) {
+    max_weight = std::max(max_weight, edge.weight);
+  }
+  const int64_t unmatched_cost = static_cast<int64_t>(max_weight) + 1;
+  const size_t num_all_cols = num_cols + num_rows;
+  std::vector<std::vector<std::pair<size_t, int64_t>>> row_edges(num_rows);
+  for (const WeightedEdge& edge : edges) {
+    CHECK_LT(edge.row, num_rows);
+    CHECK_LT(edge.col, num_cols);
+    row_edges[edge.row].emplace_back(
+        edge.col, unmatched_cost - static_cast<int64_t>(edge.weight));
+  }
+  for (size_t row = 0u; row < num_rows; ++row) {
+    row_edges[row].emplace_back(num_cols + row, unmatched_cost);
+  }
+
+  // Dual potentials, the reduced cost cost - row_potential - col_potential
+  // is non-negative for every edge and 0 for matched edges.
+  constexpr int64_t kInfinity = std::numeric_limits<int64_t>::max();
+  std::vector<int64_t> row_potentials(num_rows, 0);
+  std::vector<int64_t> col_potentials(num_all_cols, 0);
+  std::vector<size_t> row_cols(num_rows, num_all_cols);
+  std::vector<size_t> col_rows(num_all_cols, num_rows);
+
+  // Search state, reset for the visited nodes only.
+  std::vector<int64_t> row_distances(num_rows, kInfinity);
+  std::vector<int64_t> col_distances(num_all_cols, kInfinity);
+  std::vector<size_t> col_predecessors(num_all_cols, num_rows);
+  std::vector<bool> is_col_done(num_all_cols, false);
+  std::vector<size_t> visited_rows;
+  std::vector<size_t> reached_cols;
+  typedef std::pair<int64_t, size_t> DistanceCol;
+  std::priority_queue<DistanceCol, std::vector<DistanceCol>,
+                      std::greater<DistanceCol>>
+      queue;
+
+  for (size_t start_row = 0u; start_row < num_rows; ++start_row) {
+    // Dijkstra search for the closest free column along alternating paths.
+    size_t row = start_row;
+    row_distances[row] = 0;
+    visited_rows.push_back(row);
+    size_t free_col = num_all_cols;
+    int64_t free_col_distance = 0;
+    while (true) {
+      for (const std::pair<size_t, int64_t>& col_cost : row_edges[row]) {
+        const size_t col = col_cost.first;
+        if (is_col_done[col]) {
+          continue;
+        }
+        const int64_t distance = row_distances[row] + col_cost.second -
+                                 row_potentials[row] - col_potentials[col];
+        if (distance < col_distances[col]) {
+          if (col_distances[col] == kInfinity) {
+            reached_cols.push_back(col);
+          }
+          col_distances[col] = distance;
+          col_predecessors[col] = row;
+          queue.emplace(distance, col);
+        }
+      }
+
+      size_t col = num_all_cols;
+      while (!queue.empty()) {
+        const DistanceCol distance_col = queue.top();
+        queue.pop();
+        if (!is_col_done[distance_col.second] &&
+            distance_col.first == col_distances[distance_col.second]) {
+          col = distance_col.second;
+          break;
+        }
+      }
+      // The private column of the start row is always reachable.
+      CHECK_LT(col, num_all_cols);
+      is_col_done[col] = true;
+      if (col_rows[col] == num_rows) {
+        free_col = col;
+        free_col_distance = col_distances[col];
+        break;
+      }
+      row = col_rows[col];
+      row_distances[row] = col_distances[col];
+      visited_rows.push_back(row);
+    }
+
+    // Update the potentials so that the path becomes tight, then flip it.
+    for (const size_t visited_row : visited_rows) {
+      row_potentials[visited_row] +=
+          free_col_distance - row_distances[visited_row];
+      row_distances[visited_row] = kInfinity;
+    }
+    for (const size_t reached_col : reached_cols) {
+      if (is_col_done[reached_col] && reached_col != free_col) {
+        col_potentials[reached_col] -=
+            free_col_distance - col_distances[reached_col];
+      }
+      col_distances[reached_col] = kInfinity;
+      is_col_done[reached_col] = false;
+    }
+    visited_rows.clear();
+    reached_cols.clear();
+    queue = decltype(queue)();
+
+    size_t col = free_col;
+    while (true) {
+      const size_t path_row = col_predecessors[col];
+      const size_t previous_col = row_cols[path_row];
+      row_cols[path_row] = col;
+      col_rows[col] = path_row;
+      if (path_row == start_row) {
+        break;
+      }
+      col = previous_col;
+    }
+  }
+
+  row_matches->assign(num_rows, kUnmatched);
+  for (size_t row = 0u; row < num_rows; ++row) {
+    if (row_cols[row] < num_cols) {
+      (*row_matches)[row] = static_cast<int>(row_cols[row]);
+    }
+  }
+}
+
+}  // namespace voxblox
@@ -0,0 +1,71 @@
+#include "global_segment_map/utils/frame_arena.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+namespace voxblox {
+
+constexpr size_t FrameArena::kDefaultChunkSize;
+
+FrameArena::FrameArena(const size_t initial_chunk_size)
+    : chunk_offset_(0u), num_used_bytes_(0u) {
+  allocateChunk(initial_chunk_size);
+}
+
+FrameArena::~FrameArena() {
+  for (const Chunk& chunk : chunks_) {
+    ::operator delete(chunk.data);
+  }
+}
+
+void* FrameArena::allocate(const size_t num_bytes, const size_t alignment) {
+  DCHECK_GT(alignment, 0u);
+  DCHECK_EQ(alignment & (alignment - 1u), 0u);
+  Chunk* chunk = &chunks_.back();
+  size_t offset = (reinterpret_cast<uintptr_t>(chunk->data) + chunk_offset_ +
+                   alignment - 1u) &
+                  ~(alignment - 1u);
+  offset -= reinterpret_cast<uintptr_t>(chunk->data);
+  if (offset + num_bytes > chunk->size) {
+    // Twice the size of the last chunk, so that the number of chunks stays
+    // logarithmic in the memory used by a frame.
+    allocateChunk(std::max(2u * chunk->size, num_bytes + alignment));
+    chunk = &chunks_.back();
+    offset = (reinterpret_cast<uintptr_t>(chunk->data) + alignment - 1u) &
+             ~(alignment - 1u);
+    offset -= reinterpret_cast<uintptr_t>(chunk->data);
+  }
+  num_used_bytes_ += offset + num_bytes - chunk_offset_;
+  chunk_offset_ = offset + num_bytes;
+
+  ++stats_.num_allocations;
+  stats_.num_allocated_bytes += num_bytes;
+  return chunk->data + offset;
+}
+
+void FrameArena::reset() {
+  if (chunks_.size() > 1u) {
+    // Replace the chunks by a single one that fits the whole frame.
+    size_t total_size = 0u;
+    for (const Chunk& chunk : chunks_) {
+      total_size += chunk.size;
+      ::operator delete(chunk.data);
+    }
+    chunks_.clear();
+    allocateChunk(std::max(total_size, num_used_bytes_));
+  }
+  chunk_offset_ = 0u;
+  num_used_bytes_ = 0u;
+}
+
+void FrameArena::allocateChunk(const size_t min_size) {
+  Chunk chunk;
+  chunk.size = std::max<size_t>(min_size, 1u);
+  chunk.data = static_cast<uint8_t*>(::operator new(chunk.size));
+  chunks_.push_back(chunk);
+  chunk_offset_ = 0u;
+  ++stats_.num_chunk_allocations;
+}
+
+}  // namespace voxblox
@@ -0,0 +1,230 @@
+#include "global_segment_map/utils/point_merging.h"
+
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <glog/logging.h>
+
+namespace voxblox {
+
+namespace {
+
+// Weighted sums of the coordinates and color channels of merged points.
+struct WeightedSums {
+  FloatingPoint weight = 0.0f;
+  FloatingPoint x = 0.0f;
+  FloatingPoint y = 0.0f;
+  FloatingPoint z = 0.0f;
+  FloatingPoint r = 0.0f;
+  FloatingPoint g = 0.0f;
+  FloatingPoint b = 0.0f;
+  FloatingPoint a = 0.0f;
+};
+
+inline void accumulatePoint(const Point& point_C, const Color& color,
+                            const FloatingPoint point_count,
+                            const bool use_const_weight, WeightedSums* sums) {
+  FloatingPoint weight = point_count;
+  if (!use_const_weight) {
+    const FloatingPoint dist_z = std::abs(point_C.z());
+    weight = dist_z > kEpsilon ? point_count / (dist_z * dist_z) : 0.0f;
+  }
+  sums->weight += weight;
+  sums->x += weight * point_C.x();
+  sums->y += weight * point_C.y();
+  sums->z += weight * point_C.z();
+  sums->r += weight * color.r;
+  sums->g += weight * color.g;
+  sums->b += weight * color.b;
+  sums->a += weight * color.a;
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+
+#if defined(__AVX2__)
+typedef __m256 FloatVector;
+constexpr size_t kLanes = 8u;
+
+inline FloatVector load(const float* values) { return _mm256_loadu_ps(values); }
+inline void store(const FloatVector& vector, float* values) {
+  _mm256_storeu_ps(values, vector);
+}
+inline FloatVector broadcast(const float value) {
+  return _mm256_set1_ps(value);
+}
+inline FloatVector add(const FloatVector& lhs, const FloatVector& rhs) {
+  return _mm256_add_ps(lhs, rhs);
+}
+inline FloatVector multiply(const FloatVector& lhs, const FloatVector& rhs) {
+  return _mm256_mul_ps(lhs, rhs);
+}
+inline FloatVector divide(const FloatVector& lhs, const FloatVector& rhs) {
+  return _mm256_div_ps(lhs, rhs);
+}
+inline FloatVector absolute(const FloatVector& vector) {
+  return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), vector);
+}
+// Returns rhs in the lanes where lhs > threshold and 0 elsewhere.
+inline FloatVector selectIfGreater(const FloatVector& lhs,
+                                   const FloatVector& threshold,
+                                   const FloatVector& rhs) {
+  return _mm256_and_ps(_mm256_cmp_ps(lhs, threshold, _CMP_GT_OQ), rhs);
+}
+#else
+typedef __m128 FloatVector;
+constexpr size_t kLanes = 4u;
+
+inline FloatVector load(const float* values) { return _mm_loadu_ps(values); }
+inline void store(const FloatVector& vector, float* values) {
+  _mm_storeu_ps(values, vector);
+}
+inline FloatVector broadcast(const float value) { return _mm_set1_ps(value); }
+inline FloatVector add(const FloatVector& lhs, const FloatVector& rhs) {
+  return _mm_add_ps(lhs, rhs);
+}
+inline FloatVector multiply(const FloatVector& lhs, const FloatVector& rhs) {
+  return _mm_mul_ps(lhs, rhs);
+}
+inline FloatVector divide(const FloatVector& lhs, const FloatVector& rhs) {
+  return _mm_div_ps(lhs, rhs);
+}
+inline FloatVector absolute(const FloatVector& vector) {
+  return _mm_andnot_ps(_mm_set1_ps(-0.0f), vector);
+}
+// Returns rhs in the lanes where lhs > threshold and 0 elsewhere.
+inline FloatVector selectIfGreater(const FloatVector& lhs,
+                                   const FloatVector& threshold,
+                                   const FloatVector& rhs) {
+  return _mm_and_ps(_mm_cmpgt_ps(lhs, threshold), rhs);
+}
+#endif
+
+inline float sumLanes(const FloatVector& vector) {
+  float lanes[kLanes];
+  store(vector, lanes);
+  float sum = 0.0f;
+  for (size_t lane = 0u; lane < kLanes; ++lane) {
+    sum += lanes[lane];
+  }
+  return sum;
+}
+
+// Accumulates the points in batches of kLanes and returns the number of
+// points processed. The remaining points are left to the scalar loop.
+size_t accumulatePointBatches(const Pointcloud& points_C, const Colors& colors,
+                              const PointCounts& point_counts,
+                              const AlignedVector<size_t>& point_indices,
+                              const bool use_const_weight,
+                              WeightedSums* sums) {
+  const FloatVector epsilon = broadcast(kEpsilon);
+  FloatVector sum_weight = broadcast(0.0f);
+  FloatVector sum_x = sum_weight, sum_y = sum_weight, sum_z = sum_weight;
+  FloatVector sum_r = sum_weight, sum_g = sum_weight, sum_b = sum_weight,
+              sum_a = sum_weight;
+
+  // The points are scattered in the cloud, so they are gathered lane by
+  // lane into structure of arrays form first.
+  float x[kLanes], y[kLanes], z[kLanes];
+  float r[kLanes], g[kLanes], b[kLanes], a[kLanes];
+  float count[kLanes];
+  for (size_t lane = 0u; lane < kLanes; ++lane) {
+    count[lane] = 1.0f;
+  }
+
+  size_t i = 0u;
+  for (; i + kLanes <= point_indices.size(); i += kLanes) {
+    for (size_t lane = 0u; lane < kLanes; ++lane) {
+      const size_t pt_idx = point_indices[i + lane];
+      const Point& point_C = points_C[pt_idx];
+      const Color& color = colors[pt_idx];
+      x[lane] = point_C.x();
+      y[lane] = point_C.y();
+      z[lane] = point_C.z();
+      r[lane] = color.r;
+      g[lane] = color.g;
+      b[lane] = color.b;
+      a[lane] = color.a;
+      if (!point_counts.empty()) {
+        count[lane] = point_counts[pt_idx];
+      }
+    }
+
+    const FloatVector point_z = load(z);
+    FloatVector weight = load(count);
+    if (!use_const_weight) {
+      weight = selectIfGreater(absolute(point_z), epsilon,
+                               divide(weight, multiply(point_z, point_z)));
+    }
+
+    sum_weight = add(sum_weight, weight);
+    sum_x = add(sum_x, multiply(weight, load(x)));
+    sum_y = add(sum_y, multiply(weight, load(y)));
+    sum_z = add(sum_z, multiply(weight, point_z));
+    sum_r = add(sum_r, multiply(weight, load(r)));
+    sum_g = add(sum_g, multiply(weight, load(g)));
+    sum_b = add(sum_b, multiply(weight, load(b)));
+    sum_a = add(sum_a, multiply(weight, load(a)));
+  }
+
+  sums->weight += sumLanes(sum_weight);
+  sums->x += sumLanes(sum_x);
+  sums->y += sumLanes(sum_y);
+  sums->z += sumLanes(sum_z);
+  sums->r += sumLanes(sum_r);
+  sums->g += sumLanes(sum_g);
+  sums->b += sumLanes(sum_b);
+  sums->a += sumLanes(sum_a);
+  return i;
+}
+
+#endif
+
+inline uint8_t roundToColorChannel(const FloatingPoint value) {
+  return static_cast<uint8_t>(std::round(value));
+}
+
+}  // namespace
+
+void mergeWeightedPoints(const Pointcloud& points_C, const Colors& colors,
+                         const PointCounts& point_counts,
+                         const AlignedVector<size_t>& point_indices,
+                         const bool use_const_weight, Point* merged_point_C,
+                         Color* merged_color, FloatingPoint* merged_weight) {
+  CHECK_NOTNULL(merged_point_C);
+  CHECK_NOTNULL(merged_color);
+  CHECK_NOTNULL(merged_weight);
+
+  WeightedSums sums;
+  size_t i = 0u;
+#if defined(__AVX2__) || defined(__SSE2__)
+  i = accumulatePointBatches(points_C, colors, point_counts, point_indices,
+                             use_const_weight, &sums);
+#endif
+  for (; i < point_indices.size(); ++i) {
+    const size_t pt_idx = point_indices[i];
+    const FloatingPoint point_count =
+        point_counts.empty() ? 1.0f : point_counts[pt_idx];
+    accumulatePoint(points_C[pt_idx], colors[pt_idx], point_count,
+                    use_const_weight, &sums);
+  }
+
+  *merged_weight = sums.weight;
+  if (sums.weight <= 0.0f) {
+    *merged_point_C = Point::Zero();
+    *merged_color = Color();
+    return;
+  }
+  const FloatingPoint weight_inv = 1.0f / sums.weight;
+  *merged_point_C = Point(sums.x, sums.y, sums.z) * weight_inv;
+  merged_color->r = roundToColorChannel(sums.r * weight_inv);
+  merged_color->g = roundToColorChannel(sums.g * weight_inv);
+  merged_color->b = roundToColorChannel(sums.b * weight_inv);
+  merged_color->a = roundToColorChannel(sums.a * weight_inv);
+}
+
+}  // namespace voxblox
@@ -0,0 +1,92 @@
+#include "global_segment_map/utils/thread_pool.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+namespace voxblox {
+
+ThreadPool::ThreadPool(const size_t num_threads)
+    : num_threads_(std::max<size_t>(num_threads, 1u)),
+      task_(nullptr),
+      num_task_threads_(0u),
+      num_pending_threads_(0u),
+      task_generation_(0u),
+      shutdown_(false) {
+  workers_.reserve(num_threads_ - 1u);
+  for (size_t thread_idx = 1u; thread_idx < num_threads_; ++thread_idx) {
+    workers_.emplace_back(&ThreadPool::workerLoop, this, thread_idx);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutdown_ = true;
+  }
+  task_available_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+void ThreadPool::run(const size_t num_threads, const Task& task) {
+  const size_t num_task_threads = std::min(num_threads, num_threads_);
+  if (num_task_threads <= 1u) {
+    constexpr size_t kThreadIdx = 0u;
+    task(kThreadIdx);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    task_ = &task;
+    num_task_threads_ = num_task_threads;
+    // The calling thread is not counted as it does not need to be waited on.
+    num_pending_threads_ = num_task_threads - 1u;
+    ++task_generation_;
+  }
+  task_available_.notify_all();
+
+  constexpr size_t kThreadIdx = 0u;
+  task(kThreadIdx);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  task_done_.wait(lock, [this] { return num_pending_threads_ == 0u; });
+  task_ = nullptr;
+}
+
+void ThreadPool::workerLoop(const size_t thread_idx) {
+  size_t last_task_generation = 0u;
+  while (true) {
+    const Task* task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      task_available_.wait(lock, [this, last_task_generation] {
+        return shutdown_ || task_generation_ != last_task_generation;
+      });
+      if (shutdown_) {
+        return;
+      }
+      last_task_generation = task_generation_;
+      if (thread_idx >= num_task_threads_) {
+        // This thread is not needed for the current task.
+        continue;
+      }
+      task = CHECK_NOTNULL(task_);
+    }
+
+    (*task)(thread_idx);
+
+    bool is_last_thread;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      is_last_thread = --num_pending_threads_ == 0u;
+    }
+    if (is_last_thread) {
+      task_done_.notify_one();
+    }
+  }
+}
+
+}  // namespace voxblox
@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <map>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "global_segment_map/utils/bipartite_matching.h"
+
+using namespace voxblox;  // NOLINT
+
+namespace {
+
+// Total weight of the matching, checking that it only uses edges of the
+// graph and every column at most once.
+uint64_t getMatchingWeight(const size_t num_cols,
+                           const std::vector<WeightedEdge>& edges,
+                           const std::vector<int>& row_matches) {
+  std::map<std::pair<size_t, size_t>, uint64_t> edge_weights;
+  for (const WeightedEdge& edge : edges) {
+    edge_weights[std::make_pair(edge.row, edge.col)] = edge.weight;
+  }
+  std::vector<bool> is_col_matched(num_cols, false);
+  uint64_t weight = 0u;
+  for (size_t row = 0u; row < row_matches.size(); ++row) {
+    if (row_matches[row] == kUnmatched) {
+      continue;
+    }
+    const size_t col = static_cast<size_t>(row_matches[row]);
+    EXPECT_LT(col, num_cols);
+    EXPECT_FALSE(is_col_matched[col]) << "Column " << col << " matched twice.";
+    is_col_matched[col] = true;
+    const auto edge_it = edge_weights.find(std::make_pair(row, col));
+    EXPECT_TRUE(edge_it != edge_weights.end())
+        << "Row " << row << " matched to column " << col << " without edge.";
+    if (edge_it != edge_weights.end()) {
+      weight += edge_it->second;
+    }
+  }
+  return weight;
+}
+
+// Weight of the best matching of rows [row, num_rows), trying every column
+// or none for each row.
+uint64_t getMaxMatchingWeight(
+    const size_t row, const size_t num_rows,
+    const std::vector<std::vector<uint64_t>>& weights,
+    std::vector<bool>* is_col_matched) {
+  if (row == num_rows) {
+    return 0u;
+  }
+  uint64_t max_weight =
+      getMaxMatchingWeight(row + 1u, num_rows, weights, is_col_matched);
+  for (size_t col = 0u; col < is_col_matched->size(); ++col) {
+    if (weights[row][col] == 0u || (*is_col_matched)[col]) {
+      continue;
+    }
+    (*is_col_matched)[col] = true;
+    max_weight = std::max(
+        max_weight, weights[row][col] + getMaxMatchingWeight(
+                                            row + 1u, num_rows, weights,
+                                            is_col_matched));
+    (*is_col_matched)[col] = false;
+  }
+  return max_weight;
+}
+
+}  // namespace
+
+TEST(BipartiteMatchingTest, HandlesEmptyGraph) {
+  std::vector<int> row_matches;
+  computeMaxWeightMatching(3u, 2u, std::vector<WeightedEdge>(),
+                           &row_matches);
+  EXPECT_EQ(row_matches, std::vector<int>(3u, kUnmatched));
+
+  computeMaxWeightMatching(0u, 0u, std::vector<WeightedEdge>(),
+                           &row_matches);
+  EXPECT_TRUE(row_matches.empty());
+}
+
+// Greedily picking the heaviest edge would match row 0 to column 0 and
+// leave row 1 unmatched, for a total of 10 instead of 9 + 8.
+TEST(BipartiteMatchingTest, BeatsGreedyMatching) {
+  const std::vector<WeightedEdge> edges = {
+      {0u, 0u, 10u}, {0u, 1u, 9u}, {1u, 0u, 8u}};
+  std::vector<int> row_matches;
+  computeMaxWeightMatching(2u, 2u, edges, &row_matches);
+  EXPECT_EQ(row_matches, std::vector<int>({1, 0}));
+  EXPECT_EQ(getMatchingWeight(2u, edges, row_matches), 17u);
+}
+
+// A row whose only edge is better used by another row stays unmatched.
+TEST(BipartiteMatchingTest, LeavesRowsUnmatched) {
+  const std::vector<WeightedEdge> edges = {{0u, 0u, 5u}, {1u, 0u, 7u}};
+  std::vector<int> row_matches;
+  computeMaxWeightMatching(2u, 1u, edges, &row_matches);
+  EXPECT_EQ(row_matches, std::vector<int>({kUnmatched, 0}));
+}
+
+TEST(BipartiteMatchingTest, MatchesExhaustiveSearch) {
+  std::mt19937 random_engine(7u);
+  std::uniform_int_distribution<size_t> size_distribution(1u, 6u);
+  std::uniform_int_distribution<uint64_t> weight_distribution(0u, 20u);
+  for (size_t trial = 0u; trial < 200u; ++trial) {
+    const size_t num_rows = size_distribution(random_engine);
+    const size_t num_cols = size_distribution(random_engine);
+    std::vector<std::vector<uint64_t>> weights(
+        num_rows, std::vector<uint64_t>(num_cols, 0u));
+    std::vector<WeightedEdge> edges;
+    for (size_t row = 0u; row < num_rows; ++row) {
+      for (size_t col = 0u; col < num_cols; ++col) {
+        // Sparse, with many equal weights.
+        const uint64_t weight = weight_distribution(random_engine);
+        if (weight > 10u) {
+          weights[row][col] = weight;
+          edges.push_back(WeightedEdge{row, col, weight});
+        }
+      }
+    }
+
+    std::vector<int> row_matches;
+    computeMaxWeightMatching(num_rows, num_cols, edges, &row_matches);
+    ASSERT_EQ(row_matches.size(), num_rows);
+    std::vector<bool> is_col_matched(num_cols, false);
+    EXPECT_EQ(getMatchingWeight(num_cols, edges, row_matches),
+              getMaxMatchingWeight(0u, num_rows, weights, &is_col_matched))
+        << "Trial " << trial << " with " << num_rows << " rows and "
+        << num_cols << " columns.";
+  }
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_alsologtostderr = true;
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,106 @@
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "global_segment_map/utils/frame_arena.h"
+
+using namespace voxblox;  // NOLINT
+
+TEST(FrameArenaTest, AllocatesAlignedDisjointMemory) {
+  FrameArena arena(256u);
+  std::vector<std::pair<uint8_t*, size_t>> allocations;
+  for (size_t i = 0u; i < 100u; ++i) {
+    const size_t num_bytes = 1u + (i * 7u) % 40u;
+    const size_t alignment = size_t(1u) << (i % 5u);
+    uint8_t* data =
+        static_cast<uint8_t*>(arena.allocate(num_bytes, alignment));
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(data) % alignment, 0u);
+    std::memset(data, static_cast<int>(i), num_bytes);
+    allocations.emplace_back(data, num_bytes);
+  }
+  // Every allocation still holds its own pattern.
+  for (size_t i = 0u; i < allocations.size(); ++i) {
+    for (size_t j = 0u; j < allocations[i].second; ++j) {
+      ASSERT_EQ(allocations[i].first[j], static_cast<uint8_t>(i));
+    }
+  }
+  EXPECT_EQ(arena.getStats().num_allocations, allocations.size());
+}
+
+TEST(FrameArenaTest, ServesAllocationsLargerThanChunk) {
+  FrameArena arena(64u);
+  uint8_t* data = static_cast<uint8_t*>(arena.allocate(1000u, 16u));
+  std::memset(data, 1, 1000u);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(data) % 16u, 0u);
+  EXPECT_EQ(arena.getStats().num_allocated_bytes, 1000u);
+}
+
+// A frame that needed several chunks leaves a single chunk behind that
+// fits the next frame of the same size.
+TEST(FrameArenaTest, DoesNotAllocateInSteadyState) {
+  constexpr size_t kNumAllocations = 1000u;
+  FrameArena arena(128u);
+  const size_t initial_num_chunks = arena.getStats().num_chunk_allocations;
+  for (size_t i = 0u; i < kNumAllocations; ++i) {
+    arena.allocate(24u, 8u);
+  }
+  EXPECT_GT(arena.getStats().num_chunk_allocations, initial_num_chunks + 1u);
+  arena.reset();
+
+  for (size_t frame = 0u; frame < 3u; ++frame) {
+    arena.resetStats();
+    for (size_t i = 0u; i < kNumAllocations; ++i) {
+      arena.allocate(24u, 8u);
+    }
+    EXPECT_EQ(arena.getStats().num_chunk_allocations, 0u);
+    EXPECT_EQ(arena.getStats().num_allocations, kNumAllocations);
+    arena.reset();
+  }
+}
+
+TEST(FrameArenaTest, BacksStandardContainers) {
+  FrameArena arena;
+  typedef std::map<int, int, std::less<int>,
+                   ArenaAllocator<std::pair<const int, int>>>
+      ArenaMap;
+  {
+    ArenaMap map{ArenaAllocator<std::pair<const int, int>>(&arena)};
+    std::vector<int, ArenaAllocator<int>> vector{ArenaAllocator<int>(&arena)};
+    for (int i = 0; i < 100; ++i) {
+      map[i] = 2 * i;
+      vector.push_back(i);
+    }
+    for (int i = 0; i < 100; ++i) {
+      EXPECT_EQ(map[i], 2 * i);
+      EXPECT_EQ(vector[i], i);
+    }
+    EXPECT_GE(arena.getStats().num_allocations, 100u);
+  }
+  arena.reset();
+
+  // Without an arena the allocator uses the heap.
+  const size_t num_allocations = arena.getStats().num_allocations;
+  ArenaMap heap_map;
+  heap_map[1] = 1;
+  EXPECT_EQ(heap_map.get_allocator().getArena(), nullptr);
+  EXPECT_EQ(arena.getStats().num_allocations, num_allocations);
+}
+
+TEST(FrameArenaTest, ComparesAllocatorsByArena) {
+  FrameArena arena;
+  FrameArena other_arena;
+  EXPECT_EQ(ArenaAllocator<int>(&arena), ArenaAllocator<double>(&arena));
+  EXPECT_NE(ArenaAllocator<int>(&arena), ArenaAllocator<int>(&other_arena));
+  EXPECT_NE(ArenaAllocator<int>(&arena), ArenaAllocator<int>());
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_alsologtostderr = true;
+  return RUN_ALL_TESTS();
+}
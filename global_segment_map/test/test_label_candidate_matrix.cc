@@ -0,0 +1,238 @@
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "global_segment_map/label_candidate_matrix.h"
+
+using namespace voxblox;  // NOLINT
+
+namespace {
+
+typedef std::map<Label, std::map<Segment*, size_t>> LabelCandidates;
+
+class LabelCandidateMatrixTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    for (size_t i = 0u; i < 4u; ++i) {
+      segment_storage_.emplace_back(
+          new Segment(Transformation(), 0u, 0u, 0u));
+      segments_.push_back(segment_storage_.back().get());
+    }
+  }
+
+  std::vector<std::unique_ptr<Segment>> segment_storage_;
+  std::vector<Segment*> segments_;
+};
+
+}  // namespace
+
+TEST_F(LabelCandidateMatrixTest, CopiesCandidates) {
+  LabelCandidates candidates;
+  candidates[3u][segments_[0]] = 10u;
+  candidates[3u][segments_[2]] = 5u;
+  candidates[7u][segments_[1]] = 8u;
+  const LabelCandidateMatrix matrix(segments_, candidates);
+
+  EXPECT_EQ(matrix.getNumSegments(), segments_.size());
+  for (size_t segment_idx = 0u; segment_idx < segments_.size();
+       ++segment_idx) {
+    EXPECT_EQ(matrix.getSegment(segment_idx), segments_[segment_idx]);
+    EXPECT_EQ(matrix.getSegmentIndex(segments_[segment_idx]), segment_idx);
+  }
+  EXPECT_EQ(matrix.getCount(3u, 0u), 10u);
+  EXPECT_EQ(matrix.getCount(3u, 2u), 5u);
+  EXPECT_EQ(matrix.getCount(7u, 1u), 8u);
+  EXPECT_EQ(matrix.getCount(7u, 0u), 0u);
+  EXPECT_EQ(matrix.getCount(4u, 3u), 0u);
+
+  std::vector<size_t> segment_indices;
+  matrix.getLabelSegments(3u, &segment_indices);
+  EXPECT_EQ(segment_indices, std::vector<size_t>({0u, 2u}));
+  matrix.getLabelSegments(5u, &segment_indices);
+  EXPECT_TRUE(segment_indices.empty());
+}
+
+TEST_F(LabelCandidateMatrixTest, PopsPairsByDecreasingCount) {
+  LabelCandidates candidates;
+  candidates[1u][segments_[0]] = 10u;
+  candidates[2u][segments_[0]] = 30u;
+  candidates[2u][segments_[1]] = 20u;
+  candidates[3u][segments_[1]] = 15u;
+  candidates[4u][segments_[2]] = 5u;
+  LabelCandidateMatrix matrix(segments_, candidates);
+
+  Label label;
+  size_t segment_idx;
+  size_t count;
+  ASSERT_TRUE(matrix.popMaxCount(0u, &label, &segment_idx, &count));
+  EXPECT_EQ(label, 2u);
+  EXPECT_EQ(segment_idx, 0u);
+  EXPECT_EQ(count, 30u);
+  matrix.assignLabel(label);
+  matrix.setSegmentLabelled(segment_idx);
+
+  // Label 2 is taken, so segment 1 falls back to label 3, and segment 0 is
+  // labelled already.
+  ASSERT_TRUE(matrix.popMaxCount(0u, &label, &segment_idx, &count));
+  EXPECT_EQ(label, 3u);
+  EXPECT_EQ(segment_idx, 1u);
+  EXPECT_EQ(count, 15u);
+  matrix.assignLabel(label);
+  matrix.setSegmentLabelled(segment_idx);
+
+  // Pairs up to min_count are not popped, but stay in the matrix.
+  EXPECT_FALSE(matrix.popMaxCount(5u, &label, &segment_idx, &count));
+  ASSERT_TRUE(matrix.popMaxCount(4u, &label, &segment_idx, &count));
+  EXPECT_EQ(label, 4u);
+  EXPECT_EQ(segment_idx, 2u);
+  matrix.assignLabel(label);
+  matrix.setSegmentLabelled(segment_idx);
+  EXPECT_FALSE(matrix.popMaxCount(0u, &label, &segment_idx, &count));
+  EXPECT_EQ(matrix.getNumPushedEntries(), 5u);
+  // Entries of labelled segments and assigned labels are skipped.
+  EXPECT_EQ(matrix.getNumOutdatedEntries(), 2u);
+}
+
+TEST_F(LabelCandidateMatrixTest, BreaksTiesByLabelThenSegment) {
+  LabelCandidates candidates;
+  candidates[5u][segments_[0]] = 10u;
+  candidates[5u][segments_[1]] = 10u;
+  candidates[2u][segments_[2]] = 10u;
+  candidates[2u][segments_[3]] = 10u;
+  LabelCandidateMatrix matrix(segments_, candidates);
+  const size_t first_segment_idx = segments_[2] < segments_[3] ? 2u : 3u;
+
+  Label label;
+  size_t segment_idx;
+  size_t count;
+  ASSERT_TRUE(matrix.popMaxCount(0u, &label, &segment_idx, &count));
+  EXPECT_EQ(label, 2u);
+  EXPECT_EQ(segment_idx, first_segment_idx);
+}
+
+TEST_F(LabelCandidateMatrixTest, SkipsChangedCounts) {
+  LabelCandidates candidates;
+  candidates[1u][segments_[0]] = 10u;
+  candidates[2u][segments_[1]] = 8u;
+  LabelCandidateMatrix matrix(segments_, candidates);
+
+  // Lowering a count leaves its old heap entry behind.
+  matrix.setCount(1u, 0u, 4u);
+  // Setting the same count again does not push an entry.
+  matrix.setCount(2u, 1u, 8u);
+  EXPECT_EQ(matrix.getNumPushedEntries(), 3u);
+
+  Label label;
+  size_t segment_idx;
+  size_t count;
+  ASSERT_TRUE(matrix.popMaxCount(0u, &label, &segment_idx, &count));
+  EXPECT_EQ(label, 2u);
+  EXPECT_EQ(count, 8u);
+  EXPECT_EQ(matrix.getNumOutdatedEntries(), 1u);
+  ASSERT_TRUE(matrix.popMaxCount(0u, &label, &segment_idx, &count));
+  EXPECT_EQ(label, 1u);
+  EXPECT_EQ(count, 4u);
+
+  // A count of 0 removes the pair.
+  matrix.setCount(3u, 2u, 6u);
+  matrix.setCount(3u, 2u, 0u);
+  EXPECT_EQ(matrix.getCount(3u, 2u), 0u);
+  EXPECT_FALSE(matrix.popMaxCount(0u, &label, &segment_idx, &count));
+}
+
+TEST_F(LabelCandidateMatrixTest, ErasesSegmentExceptKeptLabel) {
+  LabelCandidates candidates;
+  candidates[1u][segments_[0]] = 10u;
+  candidates[2u][segments_[0]] = 8u;
+  candidates[3u][segments_[0]] = 6u;
+  candidates[1u][segments_[1]] = 4u;
+  LabelCandidateMatrix matrix(segments_, candidates);
+
+  matrix.eraseSegment(0u, 2u);
+  EXPECT_EQ(matrix.getCount(1u, 0u), 0u);
+  EXPECT_EQ(matrix.getCount(2u, 0u), 8u);
+  EXPECT_EQ(matrix.getCount(3u, 0u), 0u);
+  EXPECT_EQ(matrix.getCount(1u, 1u), 4u);
+
+  // A pair added again after it was removed is listed once.
+  matrix.setCount(1u, 0u, 3u);
+  std::vector<size_t> segment_indices;
+  matrix.getLabelSegments(1u, &segment_indices);
+  EXPECT_EQ(segment_indices, std::vector<size_t>({0u, 1u}));
+  matrix.getLabelSegments(3u, &segment_indices);
+  EXPECT_TRUE(segment_indices.empty());
+}
+
+// Popping and assigning pairs until none is left picks the same pairs as a
+// search over all remaining pairs would.
+TEST_F(LabelCandidateMatrixTest, MatchesExhaustiveSearch) {
+  constexpr size_t kNumLabels = 20u;
+  constexpr size_t kMinCount = 3u;
+  std::mt19937 random_engine(42u);
+  std::uniform_int_distribution<size_t> count_distribution(0u, 50u);
+  for (size_t trial = 0u; trial < 20u; ++trial) {
+    LabelCandidates candidates;
+    for (Label label = 1u; label <= kNumLabels; ++label) {
+      for (Segment* segment : segments_) {
+        const size_t count = count_distribution(random_engine);
+        if (count % 3u != 0u) {
+          candidates[label][segment] = count;
+        }
+      }
+    }
+    LabelCandidateMatrix matrix(segments_, candidates);
+
+    std::vector<bool> is_label_assigned(kNumLabels + 1u, false);
+    std::vector<bool> is_segment_labelled(segments_.size(), false);
+    while (true) {
+      size_t expected_count = kMinCount;
+      Label expected_label = 0u;
+      Segment* expected_segment = nullptr;
+      for (const LabelCandidates::value_type& label_candidates : candidates) {
+        if (is_label_assigned[label_candidates.first]) {
+          continue;
+        }
+        for (const std::pair<Segment* const, size_t>& segment_count :
+             label_candidates.second) {
+          const size_t segment_idx =
+              matrix.getSegmentIndex(segment_count.first);
+          if (!is_segment_labelled[segment_idx] &&
+              segment_count.second > expected_count) {
+            expected_count = segment_count.second;
+            expected_label = label_candidates.first;
+            expected_segment = segment_count.first;
+          }
+        }
+      }
+
+      Label label;
+      size_t segment_idx;
+      size_t count;
+      if (expected_segment == nullptr) {
+        EXPECT_FALSE(matrix.popMaxCount(kMinCount, &label, &segment_idx,
+                                        &count));
+        break;
+      }
+      ASSERT_TRUE(
+          matrix.popMaxCount(kMinCount, &label, &segment_idx, &count));
+      EXPECT_EQ(label, expected_label);
+      EXPECT_EQ(matrix.getSegment(segment_idx), expected_segment);
+      EXPECT_EQ(count, expected_count);
+      matrix.assignLabel(label);
+      matrix.setSegmentLabelled(segment_idx);
+      is_label_assigned[label] = true;
+      is_segment_labelled[segment_idx] = true;
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_alsologtostderr = true;
+  return RUN_ALL_TESTS();
+}
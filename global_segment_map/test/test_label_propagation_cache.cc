@@ -0,0 +1,158 @@
+#include <memory>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "global_segment_map/label_propagation_cache.h"
+
+using namespace voxblox;  // NOLINT
+
+namespace {
+
+constexpr FloatingPoint kVoxelSize = 0.1f;
+constexpr FloatingPoint kVoxelSizeInv = 1.0f / kVoxelSize;
+
+class LabelPropagationCacheTest : public ::testing::Test {
+ protected:
+  // Voxelized segment with points_per_voxel points in each of the voxels
+  // [first_voxel, first_voxel + num_voxels) along x.
+  Segment* addSegment(const int first_voxel, const int num_voxels,
+                      const size_t points_per_voxel = 1u) {
+    segment_storage_.emplace_back(new Segment(T_G_C_, 0u, 0u, 0u));
+    Segment* segment = segment_storage_.back().get();
+    for (int voxel = first_voxel; voxel < first_voxel + num_voxels; ++voxel) {
+      for (size_t i = 0u; i < points_per_voxel; ++i) {
+        segment->points_C_.emplace_back((voxel + 0.5f) * kVoxelSize,
+                                        0.5f * kVoxelSize, 0.5f * kVoxelSize);
+        segment->colors_.emplace_back();
+      }
+    }
+    segment->voxelize(kVoxelSizeInv);
+    return segment;
+  }
+
+  LabelPropagationCache::Entry makeEntry(const Label label,
+                                         const FloatingPoint confidence) {
+    LabelPropagationCache::Entry entry;
+    entry.label = label;
+    entry.confidence = confidence;
+    return entry;
+  }
+
+  Transformation T_G_C_;
+  std::vector<std::unique_ptr<Segment>> segment_storage_;
+};
+
+}  // namespace
+
+TEST_F(LabelPropagationCacheTest, MissesOnEmptyCache) {
+  LabelPropagationCache cache;
+  EXPECT_TRUE(cache.empty());
+  size_t overlap_count = 0u;
+  EXPECT_EQ(cache.lookup(*addSegment(0, 10), 0.5f, &overlap_count), nullptr);
+}
+
+TEST_F(LabelPropagationCacheTest, ReturnsMostOverlappingEntry) {
+  LabelPropagationCache cache;
+  std::vector<Segment*> segments = {addSegment(0, 10), addSegment(10, 10)};
+  std::vector<LabelPropagationCache::Entry> entries = {makeEntry(3u, 1.0f),
+                                                       makeEntry(5u, 1.0f)};
+  cache.update(T_G_C_, segments, 0.5f, &entries);
+  EXPECT_FALSE(cache.empty());
+
+  // Same footprint as the first segment.
+  size_t overlap_count = 0u;
+  const LabelPropagationCache::Entry* entry =
+      cache.lookup(*addSegment(0, 10), 0.8f, &overlap_count);
+  ASSERT_NE(entry, nullptr);
+  EXPECT_EQ(entry->label, 3u);
+  EXPECT_EQ(overlap_count, 10u);
+
+  // 7 voxels of the second segment, 3 of the first one.
+  entry = cache.lookup(*addSegment(7, 10), 0.5f, &overlap_count);
+  ASSERT_NE(entry, nullptr);
+  EXPECT_EQ(entry->label, 5u);
+  EXPECT_EQ(overlap_count, 7u);
+}
+
+TEST_F(LabelPropagationCacheTest, CountsRawPoints) {
+  LabelPropagationCache cache;
+  std::vector<Segment*> segments = {addSegment(0, 4), addSegment(4, 4)};
+  std::vector<LabelPropagationCache::Entry> entries = {makeEntry(1u, 1.0f),
+                                                       makeEntry(2u, 1.0f)};
+  cache.update(T_G_C_, segments, 0.5f, &entries);
+
+  // 2 voxels with 5 points over the first segment outweigh 4 voxels with a
+  // point each over the second one.
+  Segment* segment = addSegment(2, 2, 5u);
+  segment->points_C_.insert(segment->points_C_.end(),
+                            segments[1]->points_C_.begin(),
+                            segments[1]->points_C_.end());
+  segment->colors_.resize(segment->points_C_.size());
+  segment->clearVoxels();
+  segment->voxelize(kVoxelSizeInv);
+  size_t overlap_count = 0u;
+  const LabelPropagationCache::Entry* entry =
+      cache.lookup(*segment, 0.5f, &overlap_count);
+  ASSERT_NE(entry, nullptr);
+  EXPECT_EQ(entry->label, 1u);
+  EXPECT_EQ(overlap_count, 10u);
+}
+
+TEST_F(LabelPropagationCacheTest, RequiresMinOverlapRatio) {
+  LabelPropagationCache cache;
+  std::vector<Segment*> segments = {addSegment(0, 10)};
+  std::vector<LabelPropagationCache::Entry> entries = {makeEntry(3u, 1.0f)};
+  cache.update(T_G_C_, segments, 0.5f, &entries);
+
+  // Half of the segment lies outside of the cached footprint.
+  Segment* segment = addSegment(5, 10);
+  size_t overlap_count = 0u;
+  EXPECT_EQ(cache.lookup(*segment, 0.8f, &overlap_count), nullptr);
+  const LabelPropagationCache::Entry* entry =
+      cache.lookup(*segment, 0.5f, &overlap_count);
+  ASSERT_NE(entry, nullptr);
+  EXPECT_EQ(overlap_count, 5u);
+}
+
+TEST_F(LabelPropagationCacheTest, LeavesOutUnconfidentSegments) {
+  LabelPropagationCache cache;
+  std::vector<Segment*> segments = {addSegment(0, 10), addSegment(10, 10)};
+  std::vector<LabelPropagationCache::Entry> entries = {makeEntry(3u, 0.4f),
+                                                       makeEntry(5u, 0.6f)};
+  cache.update(T_G_C_, segments, 0.5f, &entries);
+
+  size_t overlap_count = 0u;
+  EXPECT_EQ(cache.lookup(*addSegment(0, 10), 0.5f, &overlap_count), nullptr);
+  const LabelPropagationCache::Entry* entry =
+      cache.lookup(*addSegment(10, 10), 0.5f, &overlap_count);
+  ASSERT_NE(entry, nullptr);
+  EXPECT_EQ(entry->label, 5u);
+
+  cache.clear();
+  EXPECT_TRUE(cache.empty());
+  EXPECT_EQ(cache.lookup(*addSegment(10, 10), 0.5f, &overlap_count),
+            nullptr);
+}
+
+TEST_F(LabelPropagationCacheTest, ChecksCameraMotion) {
+  LabelPropagationCache cache;
+  std::vector<Segment*> segments = {addSegment(0, 10)};
+  std::vector<LabelPropagationCache::Entry> entries = {makeEntry(3u, 1.0f)};
+  cache.update(T_G_C_, segments, 0.5f, &entries);
+
+  Transformation T_G_C = T_G_C_;
+  EXPECT_TRUE(cache.isCameraCoherent(T_G_C, 0.05f, 0.05f));
+  T_G_C.getPosition().x() += 0.04f;
+  EXPECT_TRUE(cache.isCameraCoherent(T_G_C, 0.05f, 0.05f));
+  T_G_C.getPosition().x() += 0.02f;
+  EXPECT_FALSE(cache.isCameraCoherent(T_G_C, 0.05f, 0.05f));
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_alsologtostderr = true;
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,316 @@
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "global_segment_map/label_tsdf_integrator.h"
+#include "global_segment_map/label_tsdf_map.h"
+
+using namespace voxblox;  // NOLINT
+
+namespace {
+
+constexpr size_t kNumFrames = 4u;
+constexpr size_t kImageWidth = 64u;
+constexpr size_t kImageHeight = 48u;
+constexpr FloatingPoint kFocalLength = 50.0f;
+
+// Voxel of the layer, or a default voxel if its block is not allocated.
+template <typename VoxelType>
+const VoxelType& getVoxel(const Layer<VoxelType>& layer,
+                          const BlockIndex& block_idx,
+                          const size_t linear_idx) {
+  static const VoxelType kDefaultVoxel;
+  typename Block<VoxelType>::ConstPtr block =
+      layer.getBlockPtrByIndex(block_idx);
+  return block ? block->getVoxelByLinearIndex(linear_idx) : kDefaultVoxel;
+}
+
+class LabelTsdfIntegratorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    map_config_.voxel_size = 0.05f;
+    map_config_.voxels_per_side = 8u;
+    tsdf_config_.default_truncation_distance = 0.1f;
+    tsdf_config_.max_ray_length_m = 5.0f;
+    tsdf_config_.integrator_threads = 1u;
+  }
+
+  // Segments seen by a camera looking along +z: a wall 2 m away split into
+  // two halves, and the front face of a box 1.4 m away. The camera moves
+  // along x and y from frame to frame. The image scale multiplies the
+  // resolution of the frame without changing its field of view.
+  std::vector<Segment*> makeFrame(const size_t frame_idx,
+                                  const size_t image_scale = 1u) {
+    const size_t image_width = image_scale * kImageWidth;
+    const size_t image_height = image_scale * kImageHeight;
+    const FloatingPoint focal_length = image_scale * kFocalLength;
+    Transformation T_G_C;
+    T_G_C.getPosition() = Point(0.02f * frame_idx, 0.01f * frame_idx, 0.0f);
+    std::vector<Segment*> segments;
+    for (size_t i = 0u; i < 3u; ++i) {
+      segment_storage_.emplace_back(new Segment(T_G_C, 0u, 0u, 0u));
+      segments.push_back(segment_storage_.back().get());
+    }
+    for (size_t v = 0u; v < image_height; ++v) {
+      for (size_t u = 0u; u < image_width; ++u) {
+        const Point ray_C((u - 0.5f * image_width) / focal_length,
+                          (v - 0.5f * image_height) / focal_length, 1.0f);
+        const Point box_point_G = T_G_C.getPosition() + 1.4f * ray_C;
+        const bool is_box_point =
+            box_point_G.x() > -0.1f && box_point_G.x() < 0.25f &&
+            box_point_G.y() > -0.1f && box_point_G.y() < 0.15f;
+        const Point point_C = (is_box_point ? 1.4f : 2.0f) * ray_C;
+        const size_t segment_idx =
+            is_box_point
+                ? 2u
+                : ((T_G_C.getPosition() + point_C).x() < 0.05f ? 0u : 1u);
+        segments[segment_idx]->points_C_.push_back(point_C);
+        segments[segment_idx]->colors_.emplace_back(
+            50u + 100u * segment_idx, 100u, 200u - 50u * segment_idx);
+      }
+    }
+    return segments;
+  }
+
+  // Propagates the labels to the segments of the frame and integrates
+  // them, as Controller::integrateFrame() does. Returns the label of every
+  // segment, in the order of the frame.
+  std::vector<Label> integrateFrame(
+      LabelTsdfIntegrator* integrator, std::vector<Segment*> segments,
+      std::vector<LabelTsdfIntegrator::SegmentLabelVotes>*
+          segment_label_votes) {
+    std::vector<Segment*> segments_to_integrate = segments;
+    LabelTsdfIntegrator::LabelCandidates candidates;
+    LabelTsdfIntegrator::SegmentMergeCandidates segment_merge_candidates;
+    integrator->computeFrameLabelCandidates(segments_to_integrate,
+                                            segment_label_votes, &candidates,
+                                            &segment_merge_candidates);
+    integrator->decideLabelPointClouds(&segments_to_integrate, &candidates,
+                                       &segment_merge_candidates);
+    integrator->integrateFrame(segments.front()->T_G_C_,
+                               segments_to_integrate);
+    LLSet merges_to_publish;
+    integrator->mergeLabels(&merges_to_publish);
+
+    std::vector<Label> labels;
+    for (const Segment* segment : segments) {
+      labels.push_back(segment->label_);
+    }
+    return labels;
+  }
+
+  // Compares every voxel of the two maps, the voxels of blocks allocated in
+  // a single map being compared to default voxels. Weights and distances
+  // may differ by the given ratio, labels have to be equal.
+  void expectMapsNear(const LabelTsdfMap& map, const LabelTsdfMap& other_map,
+                      const float tolerance) const {
+    IndexSet block_indices;
+    for (const LabelTsdfMap* label_tsdf_map : {&map, &other_map}) {
+      BlockIndexList blocks;
+      label_tsdf_map->getTsdfLayer().getAllAllocatedBlocks(&blocks);
+      block_indices.insert(blocks.begin(), blocks.end());
+      label_tsdf_map->getLabelLayer().getAllAllocatedBlocks(&blocks);
+      block_indices.insert(blocks.begin(), blocks.end());
+    }
+
+    const size_t num_voxels = map_config_.voxels_per_side *
+                              map_config_.voxels_per_side *
+                              map_config_.voxels_per_side;
+    size_t num_observed_voxels = 0u;
+    size_t num_tsdf_mismatches = 0u;
+    size_t num_label_mismatches = 0u;
+    for (const BlockIndex& block_idx : block_indices) {
+      for (size_t linear_idx = 0u; linear_idx < num_voxels; ++linear_idx) {
+        const TsdfVoxel& tsdf_voxel =
+            getVoxel(map.getTsdfLayer(), block_idx, linear_idx);
+        const TsdfVoxel& other_tsdf_voxel =
+            getVoxel(other_map.getTsdfLayer(), block_idx, linear_idx);
+        if (tsdf_voxel.weight > 0.0f) {
+          ++num_observed_voxels;
+        }
+        if (std::abs(tsdf_voxel.weight - other_tsdf_voxel.weight) >
+                tolerance * tsdf_voxel.weight ||
+            std::abs(tsdf_voxel.distance - other_tsdf_voxel.distance) >
+                tolerance * tsdf_config_.default_truncation_distance) {
+          ++num_tsdf_mismatches;
+        }
+
+        const LabelVoxel& label_voxel =
+            getVoxel(map.getLabelLayer(), block_idx, linear_idx);
+        const LabelVoxel& other_label_voxel =
+            getVoxel(other_map.getLabelLayer(), block_idx, linear_idx);
+        if (label_voxel.label != other_label_voxel.label ||
+            label_voxel.label_confidence !=
+                other_label_voxel.label_confidence) {
+          ++num_label_mismatches;
+        }
+      }
+    }
+    EXPECT_GT(num_observed_voxels, 0u);
+    EXPECT_EQ(num_tsdf_mismatches, 0u);
+    EXPECT_EQ(num_label_mismatches, 0u);
+  }
+
+  LabelTsdfMap::Config map_config_;
+  LabelTsdfIntegrator::Config tsdf_config_;
+  LabelTsdfIntegrator::LabelTsdfConfig label_tsdf_config_;
+  std::vector<std::unique_ptr<Segment>> segment_storage_;
+};
+
+}  // namespace
+
+// Every voxel is updated by the same rays in the same order as by a single
+// thread locking each voxel.
+TEST_F(LabelTsdfIntegratorTest, BlockPartitionedMatchesLockedIntegration) {
+  LabelTsdfMap map(map_config_);
+  LabelTsdfIntegrator integrator(tsdf_config_, label_tsdf_config_, &map);
+
+  LabelTsdfIntegrator::Config partitioned_tsdf_config = tsdf_config_;
+  partitioned_tsdf_config.integrator_threads = 4u;
+  LabelTsdfIntegrator::LabelTsdfConfig partitioned_label_tsdf_config =
+      label_tsdf_config_;
+  partitioned_label_tsdf_config.enable_block_partitioned_integration = true;
+  // Spreads the rays of every segment over all threads.
+  partitioned_label_tsdf_config.integration_grain_size = 16u;
+  LabelTsdfMap partitioned_map(map_config_);
+  LabelTsdfIntegrator partitioned_integrator(partitioned_tsdf_config,
+                                             partitioned_label_tsdf_config,
+                                             &partitioned_map);
+
+  for (size_t frame_idx = 0u; frame_idx < kNumFrames; ++frame_idx) {
+    EXPECT_EQ(integrateFrame(&integrator, makeFrame(frame_idx), nullptr),
+              integrateFrame(&partitioned_integrator, makeFrame(frame_idx),
+                             nullptr))
+        << "Frame " << frame_idx;
+  }
+  expectMapsNear(map, partitioned_map, 0.0f);
+}
+
+// Logs the integration time of locked and block-partitioned integration of
+// a large frame for a growing number of threads.
+TEST_F(LabelTsdfIntegratorTest, BenchmarksIntegratorThreads) {
+  constexpr size_t kImageScale = 8u;
+  constexpr size_t kNumBenchmarkFrames = 4u;
+
+  for (const size_t num_threads : {1u, 2u, 4u, 8u, 16u, 32u}) {
+    for (const bool enable_block_partitioned_integration : {false, true}) {
+      LabelTsdfIntegrator::Config benchmark_tsdf_config = tsdf_config_;
+      benchmark_tsdf_config.integrator_threads = num_threads;
+      LabelTsdfIntegrator::LabelTsdfConfig benchmark_label_tsdf_config =
+          label_tsdf_config_;
+      benchmark_label_tsdf_config.enable_block_partitioned_integration =
+          enable_block_partitioned_integration;
+      LabelTsdfMap benchmark_map(map_config_);
+      LabelTsdfIntegrator integrator(benchmark_tsdf_config,
+                                     benchmark_label_tsdf_config,
+                                     &benchmark_map);
+
+      double integration_time_s = 0.0;
+      for (size_t frame_idx = 0u; frame_idx < kNumBenchmarkFrames;
+           ++frame_idx) {
+        const std::vector<Segment*> segments =
+            makeFrame(frame_idx, kImageScale);
+        const std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        integrateFrame(&integrator, segments, nullptr);
+        integration_time_s += std::chrono::duration<double>(
+                                  std::chrono::steady_clock::now() - start)
+                                  .count();
+      }
+      segment_storage_.clear();
+
+      LOG(INFO) << "Integrated a frame of "
+                << kImageScale * kImageWidth * kImageScale * kImageHeight
+                << " points in "
+                << 1000.0 * integration_time_s / kNumBenchmarkFrames
+                << " ms with " << num_threads << " threads and "
+                << (enable_block_partitioned_integration
+                        ? "block-partitioned"
+                        : "locked")
+                << " integration.";
+    }
+  }
+}
+
+// The wall lies beyond max_ray_length_m, so that its points are cast as
+// clearing rays, many of which pass the same voxels close to the camera.
+TEST_F(LabelTsdfIntegratorTest, ClearingDeduplicationMatchesPerRayClearing) {
+  tsdf_config_.max_ray_length_m = 1.8f;
+  tsdf_config_.allow_clear = true;
+  LabelTsdfMap map(map_config_);
+  LabelTsdfIntegrator integrator(tsdf_config_, label_tsdf_config_, &map);
+
+  LabelTsdfIntegrator::LabelTsdfConfig deduplicated_label_tsdf_config =
+      label_tsdf_config_;
+  deduplicated_label_tsdf_config.enable_clearing_voxel_deduplication = true;
+  LabelTsdfMap deduplicated_map(map_config_);
+  LabelTsdfIntegrator deduplicated_integrator(
+      tsdf_config_, deduplicated_label_tsdf_config, &deduplicated_map);
+
+  for (size_t frame_idx = 0u; frame_idx < kNumFrames; ++frame_idx) {
+    EXPECT_EQ(integrateFrame(&integrator, makeFrame(frame_idx), nullptr),
+              integrateFrame(&deduplicated_integrator, makeFrame(frame_idx),
+                             nullptr))
+        << "Frame " << frame_idx;
+  }
+  // Summing the weights of the merged updates rounds differently.
+  expectMapsNear(map, deduplicated_map, 1e-4f);
+  EXPECT_EQ(integrator.getRayTraversalStats().num_merged_clearing_steps, 0u);
+  EXPECT_GT(
+      deduplicated_integrator.getRayTraversalStats().num_merged_clearing_steps,
+      0u);
+}
+
+// The votes of every frame are counted before the previous frame is
+// integrated, as the propagation thread of the controller does, and
+// recounted in the blocks that frame changed.
+TEST_F(LabelTsdfIntegratorTest, PipelinedPropagationMatchesSequential) {
+  label_tsdf_config_.enable_block_versions = true;
+  LabelTsdfMap map(map_config_);
+  LabelTsdfIntegrator integrator(tsdf_config_, label_tsdf_config_, &map);
+  LabelTsdfMap pipelined_map(map_config_);
+  LabelTsdfIntegrator pipelined_integrator(tsdf_config_, label_tsdf_config_,
+                                           &pipelined_map);
+
+  std::vector<std::vector<Segment*>> frames;
+  for (size_t frame_idx = 0u; frame_idx < kNumFrames; ++frame_idx) {
+    frames.push_back(makeFrame(frame_idx));
+  }
+  std::vector<std::vector<LabelTsdfIntegrator::SegmentLabelVotes>>
+      frame_label_votes(kNumFrames);
+  const auto count_frame_label_votes = [&](const size_t frame_idx) {
+    frame_label_votes[frame_idx].resize(frames[frame_idx].size());
+    for (size_t i = 0u; i < frames[frame_idx].size(); ++i) {
+      pipelined_integrator.groupSegmentPointsByBlock(
+          frames[frame_idx][i], &frame_label_votes[frame_idx][i]);
+      pipelined_integrator.countSegmentLabelVotes(
+          &frame_label_votes[frame_idx][i]);
+    }
+  };
+
+  count_frame_label_votes(0u);
+  for (size_t frame_idx = 0u; frame_idx < kNumFrames; ++frame_idx) {
+    if (frame_idx + 1u < kNumFrames) {
+      count_frame_label_votes(frame_idx + 1u);
+    }
+    EXPECT_EQ(integrateFrame(&integrator, makeFrame(frame_idx), nullptr),
+              integrateFrame(&pipelined_integrator, frames[frame_idx],
+                             &frame_label_votes[frame_idx]))
+        << "Frame " << frame_idx;
+  }
+  expectMapsNear(map, pipelined_map, 0.0f);
+  EXPECT_GT(
+      pipelined_integrator.getLabelPropagationStats().num_recounted_vote_blocks,
+      0u);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_alsologtostderr = true;
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,89 @@
+#include <algorithm>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <voxblox/mesh/mesh_layer.h>
+
+#include "global_segment_map/label_tsdf_map.h"
+#include "global_segment_map/meshing/label_tsdf_mesh_integrator.h"
+
+using namespace voxblox;  // NOLINT
+
+namespace {
+
+// Walls of a slab whose front crosses from the first block into the second
+// one, and whose back lies within the second block.
+constexpr FloatingPoint kSlabFrontX = 0.83f;
+constexpr FloatingPoint kSlabBackX = 1.27f;
+
+void fillTsdfBlock(const BlockIndex& block_idx, LabelTsdfMap* map) {
+  Block<TsdfVoxel>::Ptr tsdf_block =
+      map->getTsdfLayerPtr()->allocateBlockPtrByIndex(block_idx);
+  for (size_t linear_idx = 0u; linear_idx < tsdf_block->num_voxels();
+       ++linear_idx) {
+    const Point voxel_center =
+        tsdf_block->computeCoordinatesFromLinearIndex(linear_idx);
+    TsdfVoxel& voxel = tsdf_block->getVoxelByLinearIndex(linear_idx);
+    voxel.distance = std::max(kSlabFrontX - voxel_center.x(),
+                              voxel_center.x() - kSlabBackX);
+    voxel.weight = 1.0f;
+    voxel.color = Color(200u, 100u, 50u);
+  }
+  tsdf_block->updated() = true;
+}
+
+}  // namespace
+
+// TSDF blocks only passed by clearing rays or outside of the label band have
+// no label block. Meshing them, and the vertices of a labelled block falling
+// into them, uses the color of an unlabelled voxel.
+TEST(MeshLabelIntegratorTest, MeshesTsdfBlocksWithoutLabelBlock) {
+  LabelTsdfMap::Config map_config;
+  map_config.voxel_size = 0.1f;
+  map_config.voxels_per_side = 8u;
+  const BlockIndex labelled_block_idx(0, 0, 0);
+  const BlockIndex tsdf_only_block_idx(1, 0, 0);
+
+  for (const MeshLabelIntegrator::ColorScheme color_scheme :
+       {MeshLabelIntegrator::kLabel, MeshLabelIntegrator::kLabelConfidence,
+        MeshLabelIntegrator::kColor}) {
+    LabelTsdfMap map(map_config);
+    fillTsdfBlock(labelled_block_idx, &map);
+    fillTsdfBlock(tsdf_only_block_idx, &map);
+    Block<LabelVoxel>::Ptr label_block =
+        map.getLabelLayerPtr()->allocateBlockPtrByIndex(labelled_block_idx);
+    for (size_t linear_idx = 0u; linear_idx < label_block->num_voxels();
+         ++linear_idx) {
+      LabelVoxel& voxel = label_block->getVoxelByLinearIndex(linear_idx);
+      voxel.label = 5u;
+      voxel.label_confidence = 10u;
+    }
+    ASSERT_FALSE(map.getLabelLayer().hasBlock(tsdf_only_block_idx));
+
+    MeshLayer mesh_layer(map.block_size());
+    MeshLabelIntegrator::LabelTsdfConfig label_tsdf_mesh_config;
+    label_tsdf_mesh_config.color_scheme = color_scheme;
+    MeshLabelIntegrator mesh_integrator(MeshIntegratorConfig(),
+                                        label_tsdf_mesh_config, &map,
+                                        &mesh_layer);
+    EXPECT_TRUE(mesh_integrator.generateMesh(false, true));
+
+    for (const BlockIndex& block_idx :
+         {labelled_block_idx, tsdf_only_block_idx}) {
+      const Mesh::Ptr mesh = mesh_layer.getMeshPtrByIndex(block_idx);
+      EXPECT_FALSE(mesh->vertices.empty())
+          << "Block " << block_idx.transpose() << ", color scheme "
+          << color_scheme;
+      EXPECT_EQ(mesh->colors.size(), mesh->indices.size());
+    }
+    EXPECT_FALSE(map.getTsdfLayer().getBlockByIndex(tsdf_only_block_idx)
+                     .updated());
+  }
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_alsologtostderr = true;
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,250 @@
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "global_segment_map/utils/point_merging.h"
+
+using namespace voxblox;  // NOLINT
+
+namespace {
+
+// Weight of a point as in TsdfIntegratorBase::getVoxelWeight().
+FloatingPoint getPointWeight(const Point& point_C,
+                             const bool use_const_weight) {
+  if (use_const_weight) {
+    return 1.0f;
+  }
+  const FloatingPoint dist_z = std::abs(point_C.z());
+  return dist_z > kEpsilon ? 1.0f / (dist_z * dist_z) : 0.0f;
+}
+
+// The points blended one by one, as LabelTsdfIntegrator::mergeRay() does
+// with enable_vectorized_point_merging off.
+void blendPoints(const Pointcloud& points_C, const Colors& colors,
+                 const PointCounts& point_counts,
+                 const AlignedVector<size_t>& point_indices,
+                 const bool use_const_weight, Point* merged_point_C,
+                 Color* merged_color, FloatingPoint* merged_weight) {
+  *merged_point_C = Point::Zero();
+  *merged_color = Color();
+  *merged_weight = 0.0f;
+  for (const size_t pt_idx : point_indices) {
+    FloatingPoint point_weight =
+        getPointWeight(points_C[pt_idx], use_const_weight);
+    if (!point_counts.empty()) {
+      point_weight *= point_counts[pt_idx];
+    }
+    *merged_point_C =
+        (*merged_point_C * *merged_weight + points_C[pt_idx] * point_weight) /
+        (*merged_weight + point_weight);
+    *merged_color = Color::blendTwoColors(*merged_color, *merged_weight,
+                                          colors[pt_idx], point_weight);
+    *merged_weight += point_weight;
+  }
+}
+
+// Weighted mean color in double precision, rounded once.
+Color getMeanColor(const Pointcloud& points_C, const Colors& colors,
+                   const PointCounts& point_counts,
+                   const AlignedVector<size_t>& point_indices,
+                   const bool use_const_weight) {
+  double weight_sum = 0.0;
+  double channel_sums[4] = {0.0, 0.0, 0.0, 0.0};
+  for (const size_t pt_idx : point_indices) {
+    double weight = getPointWeight(points_C[pt_idx], use_const_weight);
+    if (!point_counts.empty()) {
+      weight *= point_counts[pt_idx];
+    }
+    weight_sum += weight;
+    channel_sums[0] += weight * colors[pt_idx].r;
+    channel_sums[1] += weight * colors[pt_idx].g;
+    channel_sums[2] += weight * colors[pt_idx].b;
+    channel_sums[3] += weight * colors[pt_idx].a;
+  }
+  return Color(std::round(channel_sums[0] / weight_sum),
+               std::round(channel_sums[1] / weight_sum),
+               std::round(channel_sums[2] / weight_sum),
+               std::round(channel_sums[3] / weight_sum));
+}
+
+void expectColorNear(const Color& color, const Color& expected_color,
+                     const int tolerance) {
+  EXPECT_LE(std::abs(color.r - expected_color.r), tolerance);
+  EXPECT_LE(std::abs(color.g - expected_color.g), tolerance);
+  EXPECT_LE(std::abs(color.b - expected_color.b), tolerance);
+  EXPECT_LE(std::abs(color.a - expected_color.a), tolerance);
+}
+
+}  // namespace
+
+// Bundles of every size up to a few vector widths, so that both the
+// vectorized batches and the scalar tail are covered.
+TEST(PointMergingTest, MatchesSequentialBlending) {
+  constexpr size_t kMaxNumPoints = 50u;
+  constexpr size_t kNumCloudPoints = 200u;
+  std::mt19937 random_engine(3u);
+  std::uniform_real_distribution<FloatingPoint> xy_distribution(-2.0f, 2.0f);
+  std::uniform_real_distribution<FloatingPoint> z_distribution(0.3f, 6.0f);
+  std::uniform_int_distribution<int> channel_distribution(0, 255);
+  std::uniform_int_distribution<uint32_t> count_distribution(1u, 8u);
+  std::uniform_int_distribution<size_t> index_distribution(
+      0u, kNumCloudPoints - 1u);
+
+  for (size_t trial = 0u; trial < 20u; ++trial) {
+    Pointcloud points_C(kNumCloudPoints);
+    Colors colors(kNumCloudPoints);
+    PointCounts point_counts(kNumCloudPoints);
+    for (size_t i = 0u; i < kNumCloudPoints; ++i) {
+      points_C[i] = Point(xy_distribution(random_engine),
+                          xy_distribution(random_engine),
+                          z_distribution(random_engine));
+      colors[i] = Color(channel_distribution(random_engine),
+                        channel_distribution(random_engine),
+                        channel_distribution(random_engine),
+                        channel_distribution(random_engine));
+      point_counts[i] = count_distribution(random_engine);
+    }
+    if (trial % 2u == 0u) {
+      point_counts.clear();
+    }
+
+    for (size_t num_points = 1u; num_points <= kMaxNumPoints; ++num_points) {
+      AlignedVector<size_t> point_indices(num_points);
+      for (size_t& pt_idx : point_indices) {
+        pt_idx = index_distribution(random_engine);
+      }
+      for (const bool use_const_weight : {false, true}) {
+        Point merged_point_C;
+        Color merged_color;
+        FloatingPoint merged_weight;
+        mergeWeightedPoints(points_C, colors, point_counts, point_indices,
+                            use_const_weight, &merged_point_C, &merged_color,
+                            &merged_weight);
+        Point blended_point_C;
+        Color blended_color;
+        FloatingPoint blended_weight;
+        blendPoints(points_C, colors, point_counts, point_indices,
+                    use_const_weight, &blended_point_C, &blended_color,
+                    &blended_weight);
+
+        EXPECT_NEAR(merged_weight, blended_weight, 1e-5f * blended_weight);
+        EXPECT_LT((merged_point_C - blended_point_C).norm(), 1e-5f);
+        // The color channels are rounded once instead of after every
+        // blended point.
+        expectColorNear(merged_color,
+                        getMeanColor(points_C, colors, point_counts,
+                                     point_indices, use_const_weight),
+                        1);
+        expectColorNear(merged_color, blended_color,
+                        static_cast<int>(num_points));
+      }
+    }
+  }
+}
+
+TEST(PointMergingTest, IgnoresPointsWithoutWeight) {
+  Pointcloud points_C = {Point(1.0f, 0.0f, 0.0f), Point(0.0f, 1.0f, 2.0f)};
+  Colors colors = {Color(255u, 255u, 255u), Color(10u, 20u, 30u)};
+  AlignedVector<size_t> point_indices = {0u, 1u};
+  Point merged_point_C;
+  Color merged_color;
+  FloatingPoint merged_weight;
+  mergeWeightedPoints(points_C, colors, PointCounts(), point_indices, false,
+                      &merged_point_C, &merged_color, &merged_weight);
+  EXPECT_FLOAT_EQ(merged_weight, 0.25f);
+  EXPECT_LT((merged_point_C - points_C[1]).norm(), 1e-6f);
+  expectColorNear(merged_color, colors[1], 0);
+
+  // Nothing to merge.
+  point_indices = {0u};
+  mergeWeightedPoints(points_C, colors, PointCounts(), point_indices, false,
+                      &merged_point_C, &merged_color, &merged_weight);
+  EXPECT_EQ(merged_weight, 0.0f);
+  EXPECT_EQ(merged_point_C, Point::Zero());
+}
+
+// Logs the time of merging bundles of growing size with
+// mergeWeightedPoints() and by blending the points one by one.
+TEST(PointMergingTest, BenchmarksSequentialBlending) {
+  constexpr size_t kNumCloudPoints = 4096u;
+  constexpr size_t kNumBundles = 1024u;
+  constexpr size_t kNumRepetitions = 50u;
+  std::mt19937 random_engine(5u);
+  std::uniform_real_distribution<FloatingPoint> xy_distribution(-2.0f, 2.0f);
+  std::uniform_real_distribution<FloatingPoint> z_distribution(0.3f, 6.0f);
+  std::uniform_int_distribution<int> channel_distribution(0, 255);
+  std::uniform_int_distribution<size_t> index_distribution(
+      0u, kNumCloudPoints - 1u);
+
+  Pointcloud points_C(kNumCloudPoints);
+  Colors colors(kNumCloudPoints);
+  for (size_t i = 0u; i < kNumCloudPoints; ++i) {
+    points_C[i] =
+        Point(xy_distribution(random_engine), xy_distribution(random_engine),
+              z_distribution(random_engine));
+    colors[i] = Color(channel_distribution(random_engine),
+                      channel_distribution(random_engine),
+                      channel_distribution(random_engine));
+  }
+
+  for (const size_t num_points : {1u, 2u, 4u, 8u, 16u, 32u, 50u}) {
+    std::vector<AlignedVector<size_t>> bundles(
+        kNumBundles, AlignedVector<size_t>(num_points));
+    for (AlignedVector<size_t>& point_indices : bundles) {
+      for (size_t& pt_idx : point_indices) {
+        pt_idx = index_distribution(random_engine);
+      }
+    }
+
+    Point merged_point_C;
+    Color merged_color;
+    FloatingPoint merged_weight;
+    // Keeps the merges from being optimized away.
+    FloatingPoint weight_sum = 0.0f;
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    for (size_t i = 0u; i < kNumRepetitions; ++i) {
+      for (const AlignedVector<size_t>& point_indices : bundles) {
+        mergeWeightedPoints(points_C, colors, PointCounts(), point_indices,
+                            false, &merged_point_C, &merged_color,
+                            &merged_weight);
+        weight_sum += merged_weight;
+      }
+    }
+    const double merge_time_s = std::chrono::duration<double>(
+                                    std::chrono::steady_clock::now() - start)
+                                    .count();
+
+    FloatingPoint blended_weight_sum = 0.0f;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0u; i < kNumRepetitions; ++i) {
+      for (const AlignedVector<size_t>& point_indices : bundles) {
+        blendPoints(points_C, colors, PointCounts(), point_indices, false,
+                    &merged_point_C, &merged_color, &merged_weight);
+        blended_weight_sum += merged_weight;
+      }
+    }
+    const double blend_time_s = std::chrono::duration<double>(
+                                    std::chrono::steady_clock::now() - start)
+                                    .count();
+    EXPECT_NEAR(weight_sum, blended_weight_sum, 1e-4f * blended_weight_sum);
+
+    LOG(INFO) << "Merged bundles of " << num_points << " points in "
+              << 1e9 * merge_time_s / (kNumRepetitions * kNumBundles)
+              << " ns with mergeWeightedPoints() and in "
+              << 1e9 * blend_time_s / (kNumRepetitions * kNumBundles)
+              << " ns by sequential blending.";
+  }
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_alsologtostderr = true;
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "global_segment_map/utils/thread_pool.h"
+
+using namespace voxblox;  // NOLINT
+
+TEST(ThreadPoolTest, RunsTaskOncePerThread) {
+  constexpr size_t kNumThreads = 4u;
+  ThreadPool thread_pool(kNumThreads);
+  EXPECT_EQ(thread_pool.numThreads(), kNumThreads);
+
+  std::vector<std::atomic<size_t>> run_counts(kNumThreads);
+  for (std::atomic<size_t>& run_count : run_counts) {
+    run_count = 0u;
+  }
+  thread_pool.run(kNumThreads, [&run_counts](const size_t thread_idx) {
+    ASSERT_LT(thread_idx, run_counts.size());
+    ++run_counts[thread_idx];
+  });
+  for (const std::atomic<size_t>& run_count : run_counts) {
+    EXPECT_EQ(run_count, 1u);
+  }
+}
+
+TEST(ThreadPoolTest, RunsCallerAsThreadZero) {
+  ThreadPool thread_pool(3u);
+  const std::thread::id caller_id = std::this_thread::get_id();
+  std::vector<std::thread::id> thread_ids(thread_pool.numThreads());
+  thread_pool.run(thread_pool.numThreads(), [&](const size_t thread_idx) {
+    thread_ids[thread_idx] = std::this_thread::get_id();
+  });
+  EXPECT_EQ(thread_ids[0], caller_id);
+  EXPECT_NE(thread_ids[1], caller_id);
+  EXPECT_NE(thread_ids[2], caller_id);
+  EXPECT_NE(thread_ids[1], thread_ids[2]);
+}
+
+TEST(ThreadPoolTest, LimitsTaskToRequestedThreads) {
+  ThreadPool thread_pool(4u);
+  // More threads than the pool has are capped, fewer leave workers idle.
+  for (const size_t num_threads : {0u, 1u, 2u, 4u, 8u}) {
+    const size_t expected_num_threads =
+        std::min<size_t>(std::max<size_t>(num_threads, 1u), 4u);
+    std::atomic<size_t> num_runs(0u);
+    std::atomic<size_t> max_thread_idx(0u);
+    thread_pool.run(num_threads, [&](const size_t thread_idx) {
+      ++num_runs;
+      size_t current_max = max_thread_idx;
+      while (thread_idx > current_max &&
+             !max_thread_idx.compare_exchange_weak(current_max, thread_idx)) {
+      }
+    });
+    EXPECT_EQ(num_runs, expected_num_threads);
+    EXPECT_EQ(max_thread_idx, expected_num_threads - 1u);
+  }
+}
+
+TEST(ThreadPoolTest, SingleThreadPoolRunsInline) {
+  ThreadPool thread_pool(0u);
+  EXPECT_EQ(thread_pool.numThreads(), 1u);
+  const std::thread::id caller_id = std::this_thread::get_id();
+  size_t num_runs = 0u;
+  thread_pool.run(4u, [&](const size_t thread_idx) {
+    EXPECT_EQ(thread_idx, 0u);
+    EXPECT_EQ(std::this_thread::get_id(), caller_id);
+    ++num_runs;
+  });
+  EXPECT_EQ(num_runs, 1u);
+}
+
+// The work of every task must be visible to the caller once run() returns,
+// for many tasks in a row on the same workers.
+TEST(ThreadPoolTest, CompletesConsecutiveTasks) {
+  constexpr size_t kNumThreads = 4u;
+  constexpr size_t kNumTasks = 1000u;
+  constexpr size_t kNumItems = 100u;
+  ThreadPool thread_pool(kNumThreads);
+  std::vector<size_t> sums(kNumThreads, 0u);
+  for (size_t task = 0u; task < kNumTasks; ++task) {
+    std::atomic<size_t> next_item(0u);
+    thread_pool.run(kNumThreads, [&](const size_t thread_idx) {
+      size_t item;
+      while ((item = next_item.fetch_add(1u)) < kNumItems) {
+        sums[thread_idx] += item;
+      }
+    });
+  }
+  size_t sum = 0u;
+  for (const size_t thread_sum : sums) {
+    sum += thread_sum;
+  }
+  EXPECT_EQ(sum, kNumTasks * kNumItems * (kNumItems - 1u) / 2u);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_alsologtostderr = true;
+  return RUN_ALL_TESTS();
+}
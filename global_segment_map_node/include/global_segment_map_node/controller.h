@@ -4,6 +4,10 @@
 #ifndef VOXBLOX_GSM_CONTROLLER_H_
 #define VOXBLOX_GSM_CONTROLLER_H_
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <geometry_msgs/Transform.h>
@@ -79,10 +83,92 @@ class Controller {
 
   bool use_label_propagation_;
 
+  // Segments are downsampled to a voxel grid with this many times the map
+  // voxel size before label propagation and integration. Disabled if 0.
+  FloatingPoint segment_downsampling_factor_;
+
+  // Maximum number of complete frames waiting for the integration thread.
+  // When the queue is full the subscriber callback waits for integration,
+  // unless drop_frames_when_queue_full_ is set, in which case the oldest
+  // frame is dropped instead.
+  size_t max_frame_queue_size_;
+  bool drop_frames_when_queue_full_;
+
+  // Count the label votes of the next frame on propagation_thread_ while
+  // the current frame is integrated. The votes are then only recounted in
+  // the blocks changed by the integration in between.
+  bool enable_pipelined_propagation_;
+
+  // A frame is complete when a segment of the next frame arrives, when an
+  // empty segment message with the timestamp of the frame marks its end,
+  // or when no segment arrived for frame_completion_timeout_s_ seconds.
+  // The timeout is disabled if 0.
+  bool use_end_of_frame_marker_;
+  double frame_completion_timeout_s_;
+
+  // Receive all the segments of a frame as a single pointcloud, whose points
+  // carry the segment in their label field, along with their instance and
+  // semantic label fields with semantic instance segmentation. Frames
+  // without a label field are discarded.
+  bool use_single_message_frames_;
+
+  // Read the incoming pointclouds directly from their message buffer instead
+  // of converting them into PCL pointclouds first.
+  bool use_zero_copy_point_cloud_parsing_;
+
  protected:
+  // Segments of a complete frame, queued for the integration thread.
+  struct SegmentFrame {
+    std::vector<Segment*> segments;
+    // Label votes of each segment, only counted if propagation is
+    // pipelined.
+    std::vector<LabelTsdfIntegrator::SegmentLabelVotes> segment_label_votes;
+    ros::Time timestamp;
+    ros::WallTime enqueue_time;
+    // Number of map resets before the frame was queued.
+    size_t map_reset_count = 0u;
+  };
+
+  // Frame queue metrics, accumulated since the last integrated frame.
+  struct FrameQueueStats {
+    size_t num_enqueued_frames = 0u;
+    size_t num_dropped_frames = 0u;
+    size_t max_queue_depth = 0u;
+  };
+
   void processSegment(
       const sensor_msgs::PointCloud2::Ptr& segment_point_cloud_msg);
 
+  // Converts the segment pointcloud through a PCL pointcloud, for messages
+  // the PointCloudReader cannot read.
+  Segment* convertSegmentPointCloud(
+      const sensor_msgs::PointCloud2::Ptr& segment_point_cloud_msg,
+      const Transformation& T_G_C);
+
+  // Splits a pointcloud holding a whole frame into its segments.
+  void processFrame(const sensor_msgs::PointCloud2::Ptr& frame_point_cloud_msg);
+
+  // Moves the segments received for the current frame to the frame queue.
+  void enqueueFrame(ros::Time msg_timestamp);
+
+  // Enqueues the segments received for the current frame, if any. Requires
+  // incoming_segments_mutex_.
+  void completeFrame();
+
+  void frameCompletionTimeoutEvent(const ros::TimerEvent& e);
+
+  // Waits for the next complete frame and pops it from the frame queue.
+  // Returns false if the controller is being destroyed.
+  bool popQueuedFrame(SegmentFrame* frame);
+
+  // Runs on propagation_thread_ and counts the label votes of queued frames
+  // until the controller is destroyed.
+  void propagationLoop();
+
+  // Runs on integration_thread_ and integrates queued frames until the
+  // controller is destroyed.
+  void integrationLoop();
+
   void integrateFrame(ros::Time msg_timestamp);
 
   bool resetMapCallback(std_srvs::Empty::Request& request,
@@ -94,6 +180,9 @@ class Controller {
   virtual void segmentPointCloudCallback(
       const sensor_msgs::PointCloud2::Ptr& segment_point_cloud_msg);
 
+  virtual void framePointCloudCallback(
+      const sensor_msgs::PointCloud2::Ptr& frame_point_cloud_msg);
+
   bool getMapCallback(vpp_msgs::GetMap::Request& /* request */,
                       vpp_msgs::GetMap::Response& response);
 
@@ -144,6 +233,9 @@ class Controller {
   tf::TransformListener tf_listener_;
   tf2_ros::TransformBroadcaster tf_broadcaster_;
   ros::Time last_segment_msg_timestamp_;
+  ros::Time last_segment_receive_time_;
+  bool is_frame_completed_;
+  ros::Timer frame_completion_timer_;
   size_t integrated_frames_count_;
 
   std::string world_frame_;
@@ -180,10 +272,41 @@ class Controller {
   // Semantic labels.
   std::map<Label, std::map<SemanticLabel, int>>* label_class_count_ptr_;
 
-  // Current frame label propagation.
+  // Segments are acquired from and released into the pool instead of being
+  // allocated and deleted with every frame.
+  SegmentPool segment_pool_;
+
+  // Segments received for the frame whose messages are still arriving.
+  // Guarded together with the timestamps of the last segment message, as
+  // the frame can also be completed by frame_completion_timer_.
+  std::vector<Segment*> incoming_segments_;
+  std::mutex incoming_segments_mutex_;
+
+  // Complete frames waiting for integration.
+  std::deque<SegmentFrame> frame_queue_;
+  FrameQueueStats frame_queue_stats_;
+  std::mutex frame_queue_mutex_;
+  std::condition_variable frame_queue_condition_;
+  // Frame with counted label votes, waiting for the integration thread.
+  std::deque<SegmentFrame> propagated_frame_queue_;
+  // Frames queued before the last map reset are discarded.
+  size_t map_reset_count_;
+  bool stop_integration_thread_;
+  std::thread propagation_thread_;
+  std::thread integration_thread_;
+  // Held by the propagation and integration thread while they process a
+  // frame.
+  std::mutex frame_propagation_mutex_;
+  std::mutex frame_integration_mutex_;
+
+  // Current frame label propagation. Only accessed by the integration
+  // thread.
   std::vector<Segment*> segments_to_integrate_;
-  std::map<Label, std::map<Segment*, size_t>> segment_label_candidates;
-  std::map<Segment*, std::vector<Label>> segment_merge_candidates_;
+  std::vector<LabelTsdfIntegrator::SegmentLabelVotes> segment_label_votes_;
+  // Backs the candidate maps, reset at the end of every frame.
+  FrameArena propagation_arena_;
+  LabelTsdfIntegrator::LabelCandidates segment_label_candidates;
+  LabelTsdfIntegrator::SegmentMergeCandidates segment_merge_candidates_;
 
   // Publishers.
   ros::Publisher* map_cloud_pub_;
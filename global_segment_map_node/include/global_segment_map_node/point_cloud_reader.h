@@ -0,0 +1,89 @@
+// Copyright (c) 2019, ASL, ETH Zurich, Switzerland
+// Licensed under the BSD 3-Clause License (see LICENSE for details)
+
+#ifndef VOXBLOX_GSM_POINT_CLOUD_READER_H_
+#define VOXBLOX_GSM_POINT_CLOUD_READER_H_
+
+#include <string>
+#include <vector>
+
+#include <global_segment_map/common.h>
+#include <global_segment_map/segment.h>
+#include <sensor_msgs/PointCloud2.h>
+
+namespace voxblox {
+namespace voxblox_gsm {
+
+// Reads segments straight from the data buffer of a PointCloud2 message,
+// using the offsets of its fields, without converting it into a PCL
+// pointcloud first. Points with a non-finite coordinate are skipped.
+class PointCloudReader {
+ public:
+  explicit PointCloudReader(const sensor_msgs::PointCloud2& point_cloud_msg);
+
+  // Whether the message can be read, i.e. it is little endian, has float x,
+  // y and z fields, 4 byte color and integer label fields if any, all of
+  // them within a point, and its data holds all the rows. The label fields
+  // must not be wider than the labels they are read into, i.e. 4 bytes for
+  // the label, 2 for the instance and 1 for the semantic label. Other
+  // messages have to be converted with PCL.
+  inline bool isValid() const { return is_valid_; }
+
+  // Reads all the points of the message into a segment acquired from the
+  // pool. The labels of the segment are the ones of the first point, if the
+  // message has them.
+  Segment* readSegment(const Transformation& T_G_C,
+                       SegmentPool* segment_pool) const;
+
+  // Same as splitFramePointCloud(), splits the message into one segment per
+  // distinct label. If split_by_instance, the instance and semantic labels of
+  // a segment are the ones of its first point.
+  void splitFrame(const Transformation& T_G_C, const bool split_by_instance,
+                  SegmentPool* segment_pool,
+                  std::vector<Segment*>* segments) const;
+
+ private:
+  // Offset and datatype of a field, if the message has it.
+  struct Field {
+    bool is_present = false;
+    size_t offset = 0u;
+    uint8_t datatype = 0u;
+  };
+
+  Field getField(const std::string& name) const;
+
+  // Whether the whole field lies within a point.
+  bool isFieldInPoint(const Field& field) const;
+
+  // Reads an unsigned integer field of the point, 0 if missing.
+  uint32_t readLabelField(const uint8_t* point, const Field& field) const;
+
+  // Whether the x, y and z coordinates of the point are finite.
+  bool isFinitePoint(const uint8_t* point) const;
+
+  // Appends the point and its color to the segment.
+  void appendPoint(const uint8_t* point, Segment* segment) const;
+
+  inline const uint8_t* getPoint(const size_t row, const size_t col) const {
+    return &point_cloud_msg_.data[row * point_cloud_msg_.row_step +
+                                  col * point_cloud_msg_.point_step];
+  }
+
+  const sensor_msgs::PointCloud2& point_cloud_msg_;
+  bool is_valid_;
+  // The coordinates can be checked with a single vector load if y and z
+  // directly follow x and the point is large enough.
+  bool has_packed_coordinates_;
+  Field x_field_;
+  Field y_field_;
+  Field z_field_;
+  Field rgb_field_;
+  Field label_field_;
+  Field instance_label_field_;
+  Field semantic_label_field_;
+};
+
+}  // namespace voxblox_gsm
+}  // namespace voxblox
+
+#endif  // VOXBLOX_GSM_POINT_CLOUD_READER_H_
@@ -8,6 +8,7 @@
 
 #include <stdlib.h>
 
+#include <algorithm>
 #include <cmath>
 #include <memory>
 #include <string>
@@ -29,6 +30,7 @@
 #include <voxblox/io/sdf_ply.h>
 #include <voxblox_ros/mesh_vis.h>
 #include "global_segment_map_node/conversions.h"
+#include "global_segment_map_node/point_cloud_reader.h"
 
 #ifdef APPROXMVBB_AVAILABLE
 #include <ApproxMVBB/ComputeApproxMVBB.hpp>
@@ -121,21 +123,36 @@ std::string classes[81] = {"BG",
                            "toothbrush"};
 
 Controller::Controller(ros::NodeHandle* node_handle_private)
-    : node_handle_private_(node_handle_private),
+    : enable_semantic_instance_segmentation_(true),
+      publish_scene_map_(false),
+      publish_scene_mesh_(false),
+      publish_object_bbox_(false),
+      use_label_propagation_(true),
+      segment_downsampling_factor_(0.0f),
+      max_frame_queue_size_(4u),
+      drop_frames_when_queue_full_(false),
+      enable_pipelined_propagation_(false),
+      use_end_of_frame_marker_(true),
+      frame_completion_timeout_s_(0.5),
+      use_single_message_frames_(false),
+      use_zero_copy_point_cloud_parsing_(false),
+      node_handle_private_(node_handle_private),
       // Increased time limit for lookup in the past of tf messages
       // to give some slack to the pipeline and not lose any messages.
-      integrated_frames_count_(0u),
       tf_listener_(ros::Duration(500)),
+      is_frame_completed_(false),
+      integrated_frames_count_(0u),
       world_frame_("world"),
       integration_on_(true),
-      publish_scene_map_(false),
-      publish_scene_mesh_(false),
       received_first_message_(false),
+      map_reset_count_(0u),
+      stop_integration_thread_(false),
+      segment_label_candidates(
+          LabelTsdfIntegrator::LabelCandidates::allocator_type(
+              ArenaAllocator<Label>(&propagation_arena_))),
+      segment_merge_candidates_(ArenaAllocator<Label>(&propagation_arena_)),
       mesh_layer_updated_(false),
-      need_full_remesh_(false),
-      enable_semantic_instance_segmentation_(true),
-      publish_object_bbox_(false),
-      use_label_propagation_(true) {
+      need_full_remesh_(false) {
   CHECK_NOTNULL(node_handle_private_);
 
   bool verbose_log = false;
@@ -188,6 +205,16 @@ Controller::Controller(ros::NodeHandle* node_handle_private)
       "voxblox/max_ray_length_m", tsdf_integrator_config_.max_ray_length_m,
       tsdf_integrator_config_.max_ray_length_m);
 
+  int integrator_threads = tsdf_integrator_config_.integrator_threads;
+  node_handle_private_->param<int>("voxblox/integrator_threads",
+                                   integrator_threads, integrator_threads);
+  if (integrator_threads < 1) {
+    LOG(ERROR) << "integrator_threads must be at least 1, setting to default "
+                  "value.";
+    integrator_threads = tsdf_integrator_config_.integrator_threads;
+  }
+  tsdf_integrator_config_.integrator_threads = integrator_threads;
+
   tsdf_integrator_config_.default_truncation_distance =
       map_config_.voxel_size * truncation_distance_factor;
 
@@ -242,6 +269,165 @@ Controller::Controller(ros::NodeHandle* node_handle_private)
       label_tsdf_integrator_config_.keep_track_of_icp_correction,
       label_tsdf_integrator_config_.keep_track_of_icp_correction);
 
+  int integration_grain_size =
+      label_tsdf_integrator_config_.integration_grain_size;
+  node_handle_private_->param<int>("gsm/integration_grain_size",
+                                   integration_grain_size,
+                                   integration_grain_size);
+  if (integration_grain_size < 1) {
+    LOG(ERROR) << "integration_grain_size must be at least 1, setting to "
+                  "default value.";
+    integration_grain_size =
+        label_tsdf_integrator_config_.integration_grain_size;
+  }
+  label_tsdf_integrator_config_.integration_grain_size =
+      integration_grain_size;
+  node_handle_private_->param<bool>(
+      "gsm/enable_block_partitioned_integration",
+      label_tsdf_integrator_config_.enable_block_partitioned_integration,
+      label_tsdf_integrator_config_.enable_block_partitioned_integration);
+  node_handle_private_->param<bool>(
+      "gsm/enable_vectorized_point_merging",
+      label_tsdf_integrator_config_.enable_vectorized_point_merging,
+      label_tsdf_integrator_config_.enable_vectorized_point_merging);
+  node_handle_private_->param<FloatingPoint>(
+      "gsm/segment_downsampling_factor", segment_downsampling_factor_,
+      segment_downsampling_factor_);
+  if (segment_downsampling_factor_ < 0.0f) {
+    LOG(ERROR) << "segment_downsampling_factor must not be negative, "
+                  "disabling segment downsampling.";
+    segment_downsampling_factor_ = 0.0f;
+  }
+  int max_frame_queue_size = static_cast<int>(max_frame_queue_size_);
+  node_handle_private_->param<int>("gsm/max_frame_queue_size",
+                                   max_frame_queue_size, max_frame_queue_size);
+  if (max_frame_queue_size < 1) {
+    LOG(ERROR) << "max_frame_queue_size must be at least 1, setting to "
+                  "default value.";
+    max_frame_queue_size = static_cast<int>(max_frame_queue_size_);
+  }
+  max_frame_queue_size_ = static_cast<size_t>(max_frame_queue_size);
+  node_handle_private_->param<bool>("gsm/drop_frames_when_queue_full",
+                                    drop_frames_when_queue_full_,
+                                    drop_frames_when_queue_full_);
+  node_handle_private_->param<bool>("gsm/enable_pipelined_propagation",
+                                    enable_pipelined_propagation_,
+                                    enable_pipelined_propagation_);
+  label_tsdf_integrator_config_.enable_block_versions =
+      enable_pipelined_propagation_;
+  node_handle_private_->param<bool>("gsm/use_end_of_frame_marker",
+                                    use_end_of_frame_marker_,
+                                    use_end_of_frame_marker_);
+  node_handle_private_->param<double>("gsm/frame_completion_timeout_s",
+                                      frame_completion_timeout_s_,
+                                      frame_completion_timeout_s_);
+  node_handle_private_->param<bool>("gsm/use_single_message_frames",
+                                    use_single_message_frames_,
+                                    use_single_message_frames_);
+  node_handle_private_->param<bool>("gsm/use_zero_copy_point_cloud_parsing",
+                                    use_zero_copy_point_cloud_parsing_,
+                                    use_zero_copy_point_cloud_parsing_);
+  node_handle_private_->param<FloatingPoint>(
+      "gsm/label_band_factor", label_tsdf_integrator_config_.label_band_factor,
+      label_tsdf_integrator_config_.label_band_factor);
+  node_handle_private_->param<bool>(
+      "gsm/enable_clearing_voxel_deduplication",
+      label_tsdf_integrator_config_.enable_clearing_voxel_deduplication,
+      label_tsdf_integrator_config_.enable_clearing_voxel_deduplication);
+  node_handle_private_->param<bool>(
+      "gsm/enable_optimal_label_assignment",
+      label_tsdf_integrator_config_.enable_optimal_label_assignment,
+      label_tsdf_integrator_config_.enable_optimal_label_assignment);
+  node_handle_private_->param<bool>(
+      "gsm/enable_label_propagation_cache",
+      label_tsdf_integrator_config_.enable_label_propagation_cache,
+      label_tsdf_integrator_config_.enable_label_propagation_cache);
+  if (label_tsdf_integrator_config_.enable_label_propagation_cache &&
+      label_tsdf_integrator_config_.enable_pairwise_confidence_merging) {
+    LOG(WARNING) << "The label propagation cache is not used with pairwise "
+                    "confidence merging, the labels of all segments are "
+                    "looked up in the map.";
+  }
+  node_handle_private_->param<FloatingPoint>(
+      "gsm/propagation_cache_max_translation_m",
+      label_tsdf_integrator_config_.propagation_cache_max_translation_m,
+      label_tsdf_integrator_config_.propagation_cache_max_translation_m);
+  node_handle_private_->param<FloatingPoint>(
+      "gsm/propagation_cache_max_rotation_rad",
+      label_tsdf_integrator_config_.propagation_cache_max_rotation_rad,
+      label_tsdf_integrator_config_.propagation_cache_max_rotation_rad);
+  node_handle_private_->param<FloatingPoint>(
+      "gsm/propagation_cache_min_overlap_ratio",
+      label_tsdf_integrator_config_.propagation_cache_min_overlap_ratio,
+      label_tsdf_integrator_config_.propagation_cache_min_overlap_ratio);
+  node_handle_private_->param<FloatingPoint>(
+      "gsm/propagation_cache_min_confidence",
+      label_tsdf_integrator_config_.propagation_cache_min_confidence,
+      label_tsdf_integrator_config_.propagation_cache_min_confidence);
+  node_handle_private_->param<bool>(
+      "gsm/enable_sampled_label_voting",
+      label_tsdf_integrator_config_.enable_sampled_label_voting,
+      label_tsdf_integrator_config_.enable_sampled_label_voting);
+  int sampled_label_voting_batch_size =
+      label_tsdf_integrator_config_.sampled_label_voting_batch_size;
+  node_handle_private_->param<int>("gsm/sampled_label_voting_batch_size",
+                                   sampled_label_voting_batch_size,
+                                   sampled_label_voting_batch_size);
+  int sampled_label_voting_max_samples =
+      label_tsdf_integrator_config_.sampled_label_voting_max_samples;
+  node_handle_private_->param<int>("gsm/sampled_label_voting_max_samples",
+                                   sampled_label_voting_max_samples,
+                                   sampled_label_voting_max_samples);
+  if (sampled_label_voting_batch_size < 2 ||
+      sampled_label_voting_max_samples < sampled_label_voting_batch_size) {
+    LOG(ERROR) << "sampled_label_voting_batch_size must be at least 2 and at "
+                  "most sampled_label_voting_max_samples, setting both to "
+                  "default values.";
+    sampled_label_voting_batch_size =
+        label_tsdf_integrator_config_.sampled_label_voting_batch_size;
+    sampled_label_voting_max_samples =
+        label_tsdf_integrator_config_.sampled_label_voting_max_samples;
+  }
+  label_tsdf_integrator_config_.sampled_label_voting_batch_size =
+      sampled_label_voting_batch_size;
+  label_tsdf_integrator_config_.sampled_label_voting_max_samples =
+      sampled_label_voting_max_samples;
+  node_handle_private_->param<FloatingPoint>(
+      "gsm/sampled_label_voting_z_score",
+      label_tsdf_integrator_config_.sampled_label_voting_z_score,
+      label_tsdf_integrator_config_.sampled_label_voting_z_score);
+  node_handle_private_->param<bool>(
+      "gsm/enable_projective_integration",
+      label_tsdf_integrator_config_.enable_projective_integration,
+      label_tsdf_integrator_config_.enable_projective_integration);
+  LabelTsdfIntegrator::CameraIntrinsics& projective_camera =
+      label_tsdf_integrator_config_.projective_camera;
+  node_handle_private_->param<FloatingPoint>(
+      "gsm/projective_camera/fx", projective_camera.fx, projective_camera.fx);
+  node_handle_private_->param<FloatingPoint>(
+      "gsm/projective_camera/fy", projective_camera.fy, projective_camera.fy);
+  node_handle_private_->param<FloatingPoint>(
+      "gsm/projective_camera/cx", projective_camera.cx, projective_camera.cx);
+  node_handle_private_->param<FloatingPoint>(
+      "gsm/projective_camera/cy", projective_camera.cy, projective_camera.cy);
+  int projective_camera_width = projective_camera.width;
+  int projective_camera_height = projective_camera.height;
+  node_handle_private_->param<int>("gsm/projective_camera/width",
+                                   projective_camera_width,
+                                   projective_camera_width);
+  node_handle_private_->param<int>("gsm/projective_camera/height",
+                                   projective_camera_height,
+                                   projective_camera_height);
+  if (label_tsdf_integrator_config_.enable_projective_integration &&
+      (projective_camera.fx <= 0.0f || projective_camera.fy <= 0.0f ||
+       projective_camera_width < 1 || projective_camera_height < 1)) {
+    LOG(ERROR) << "Projective integration requires the intrinsics of the "
+                  "camera, falling back to ray casting.";
+    label_tsdf_integrator_config_.enable_projective_integration = false;
+  }
+  projective_camera.width = std::max(projective_camera_width, 1);
+  projective_camera.height = std::max(projective_camera_height, 1);
+
   integrator_.reset(new LabelTsdfIntegrator(
       tsdf_integrator_config_, label_tsdf_integrator_config_, map_.get()));
 
@@ -318,9 +504,41 @@ Controller::Controller(ros::NodeHandle* node_handle_private)
 
   node_handle_private_->param<std::string>("meshing/mesh_filename",
                                            mesh_filename_, mesh_filename_);
+
+  // The timer checks twice per timeout whether the current frame timed out.
+  if (frame_completion_timeout_s_ > 0.0 && !use_single_message_frames_) {
+    frame_completion_timer_ = node_handle_private_->createTimer(
+        ros::Duration(frame_completion_timeout_s_ / 2.0),
+        &Controller::frameCompletionTimeoutEvent, this);
+  }
+
+  if (enable_pipelined_propagation_) {
+    propagation_thread_ = std::thread(&Controller::propagationLoop, this);
+  }
+  integration_thread_ = std::thread(&Controller::integrationLoop, this);
 }
 
-Controller::~Controller() { viz_thread_.join(); }
+Controller::~Controller() {
+  {
+    std::lock_guard<std::mutex> frame_queue_lock(frame_queue_mutex_);
+    stop_integration_thread_ = true;
+  }
+  frame_queue_condition_.notify_all();
+  if (propagation_thread_.joinable()) {
+    propagation_thread_.join();
+  }
+  integration_thread_.join();
+
+  for (std::deque<SegmentFrame>* queue :
+       {&frame_queue_, &propagated_frame_queue_}) {
+    for (SegmentFrame& frame : *queue) {
+      segment_pool_.release(&frame.segments);
+    }
+  }
+  segment_pool_.release(&incoming_segments_);
+
+  viz_thread_.join();
+}
 
 void Controller::subscribeSegmentPointCloudTopic(
     ros::Subscriber* segment_point_cloud_sub) {
@@ -330,8 +548,13 @@ void Controller::subscribeSegmentPointCloudTopic(
   node_handle_private_->param<std::string>("segment_point_cloud_topic",
                                            segment_point_cloud_topic,
                                            segment_point_cloud_topic);
-  // TODO (margaritaG): make this a param once segments of a frame are
-  // refactored to be received as one single message.
+  if (use_single_message_frames_) {
+    constexpr int kFramePointCloudQueueSize = 10;
+    *segment_point_cloud_sub = node_handle_private_->subscribe(
+        segment_point_cloud_topic, kFramePointCloudQueueSize,
+        &Controller::framePointCloudCallback, this);
+    return;
+  }
   // Large queue size to give slack to the
   // pipeline and not lose any messages.
   constexpr int kSegmentPointCloudQueueSize = 6000;
@@ -433,54 +656,321 @@ void Controller::processSegment(
   std::string from_frame = segment_point_cloud_msg->header.frame_id;
   if (lookupTransform(from_frame, world_frame_,
                       segment_point_cloud_msg->header.stamp, &T_G_C)) {
-    // Convert the PCL pointcloud into voxblox format.
+    timing::Timer ptcloud_timer("ptcloud_preprocess");
+
+    Segment* segment = nullptr;
+    const PointCloudReader point_cloud_reader(*segment_point_cloud_msg);
+    if (use_zero_copy_point_cloud_parsing_ && point_cloud_reader.isValid()) {
+      segment = point_cloud_reader.readSegment(T_G_C, &segment_pool_);
+    } else {
+      segment = convertSegmentPointCloud(segment_point_cloud_msg, T_G_C);
+    }
+    CHECK_NOTNULL(segment);
+    incoming_segments_.push_back(segment);
+    ptcloud_timer.Stop();
+
+    if (segment_downsampling_factor_ > 0.0f) {
+      timing::Timer downsampling_timer("downsample_segment");
+      segment->downsampleVoxelGrid(segment_downsampling_factor_ *
+                                   map_config_.voxel_size);
+      downsampling_timer.Stop();
+    }
+  }
+}
+
+Segment* Controller::convertSegmentPointCloud(
+    const sensor_msgs::PointCloud2::Ptr& segment_point_cloud_msg,
+    const Transformation& T_G_C) {
+  // Convert the PCL pointcloud into voxblox format.
+  // Horrible hack fix to fix color parsing colors in PCL.
+  for (size_t d = 0; d < segment_point_cloud_msg->fields.size(); ++d) {
+    if (segment_point_cloud_msg->fields[d].name == std::string("rgb")) {
+      segment_point_cloud_msg->fields[d].datatype =
+          sensor_msgs::PointField::FLOAT32;
+    }
+  }
+
+  if (enable_semantic_instance_segmentation_) {
+    pcl::PointCloud<voxblox::PointSemanticInstanceType>
+        point_cloud_semantic_instance;
+    pcl::fromROSMsg(*segment_point_cloud_msg, point_cloud_semantic_instance);
+    return new Segment(point_cloud_semantic_instance, T_G_C);
+  } else if (use_label_propagation_) {
+    // TODO(ntonci): maybe rename use_label_propagation_ to something like
+    // use_voxblox_plus_plus_lables_ or change the order and call it
+    // use_external_labels_
+    pcl::PointCloud<voxblox::PointType> point_cloud;
+    pcl::fromROSMsg(*segment_point_cloud_msg, point_cloud);
+    return new Segment(point_cloud, T_G_C);
+  }
+  pcl::PointCloud<voxblox::PointLabelType> point_cloud_label;
+  pcl::fromROSMsg(*segment_point_cloud_msg, point_cloud_label);
+  return new Segment(point_cloud_label, T_G_C);
+}
+
+void Controller::processFrame(
+    const sensor_msgs::PointCloud2::Ptr& frame_point_cloud_msg) {
+  // Without the label field all the segments of the frame would be merged.
+  const bool has_label_field =
+      std::any_of(frame_point_cloud_msg->fields.begin(),
+                  frame_point_cloud_msg->fields.end(),
+                  [](const sensor_msgs::PointField& field) {
+                    return field.name == "label";
+                  });
+  if (!has_label_field) {
+    LOG(ERROR) << "Discarding a frame pointcloud without a label field.";
+    return;
+  }
+
+  // A single transform is looked up for all the segments of the frame.
+  Transformation T_G_C;
+  std::string from_frame = frame_point_cloud_msg->header.frame_id;
+  if (!lookupTransform(from_frame, world_frame_,
+                       frame_point_cloud_msg->header.stamp, &T_G_C)) {
+    return;
+  }
+  timing::Timer ptcloud_timer("ptcloud_preprocess");
+
+  const size_t num_segments = incoming_segments_.size();
+  const PointCloudReader point_cloud_reader(*frame_point_cloud_msg);
+  if (use_zero_copy_point_cloud_parsing_ && point_cloud_reader.isValid()) {
+    point_cloud_reader.splitFrame(T_G_C,
+                                  enable_semantic_instance_segmentation_,
+                                  &segment_pool_, &incoming_segments_);
+  } else {
     // Horrible hack fix to fix color parsing colors in PCL.
-    for (size_t d = 0; d < segment_point_cloud_msg->fields.size(); ++d) {
-      if (segment_point_cloud_msg->fields[d].name == std::string("rgb")) {
-        segment_point_cloud_msg->fields[d].datatype =
+    for (size_t d = 0; d < frame_point_cloud_msg->fields.size(); ++d) {
+      if (frame_point_cloud_msg->fields[d].name == std::string("rgb")) {
+        frame_point_cloud_msg->fields[d].datatype =
             sensor_msgs::PointField::FLOAT32;
       }
     }
-    timing::Timer ptcloud_timer("ptcloud_preprocess");
-
-    Segment* segment = nullptr;
     if (enable_semantic_instance_segmentation_) {
-      pcl::PointCloud<voxblox::PointSemanticInstanceType>
+      pcl::PointCloud<voxblox::PointSemanticInstanceLabelType>
           point_cloud_semantic_instance;
-      pcl::fromROSMsg(*segment_point_cloud_msg, point_cloud_semantic_instance);
-      segment = new Segment(point_cloud_semantic_instance, T_G_C);
-    } else if (use_label_propagation_) {
-      // TODO(ntonci): maybe rename use_label_propagation_ to something like
-      // use_voxblox_plus_plus_lables_ or change the order and call it
-      // use_external_labels_
-      pcl::PointCloud<voxblox::PointType> point_cloud;
-      pcl::fromROSMsg(*segment_point_cloud_msg, point_cloud);
-      segment = new Segment(point_cloud, T_G_C);
+      pcl::fromROSMsg(*frame_point_cloud_msg, point_cloud_semantic_instance);
+      splitFramePointCloud(point_cloud_semantic_instance, T_G_C,
+                           &segment_pool_, &incoming_segments_);
     } else {
       pcl::PointCloud<voxblox::PointLabelType> point_cloud_label;
-      pcl::fromROSMsg(*segment_point_cloud_msg, point_cloud_label);
-      segment = new Segment(point_cloud_label, T_G_C);
+      pcl::fromROSMsg(*frame_point_cloud_msg, point_cloud_label);
+      splitFramePointCloud(point_cloud_label, T_G_C, &segment_pool_,
+                           &incoming_segments_);
     }
-    CHECK_NOTNULL(segment);
-    segments_to_integrate_.push_back(segment);
-    ptcloud_timer.Stop();
+  }
+  ptcloud_timer.Stop();
 
-    timing::Timer label_candidates_timer("compute_label_candidates");
+  if (segment_downsampling_factor_ > 0.0f) {
+    timing::Timer downsampling_timer("downsample_segment");
+    for (size_t i = num_segments; i < incoming_segments_.size(); ++i) {
+      incoming_segments_[i]->downsampleVoxelGrid(segment_downsampling_factor_ *
+                                                 map_config_.voxel_size);
+    }
+    downsampling_timer.Stop();
+  }
+}
 
+void Controller::enqueueFrame(ros::Time msg_timestamp) {
+  SegmentFrame frame;
+  frame.segments.swap(incoming_segments_);
+  frame.timestamp = msg_timestamp;
+  frame.enqueue_time = ros::WallTime::now();
+
+  std::vector<Segment*> dropped_segments;
+  {
+    std::unique_lock<std::mutex> frame_queue_lock(frame_queue_mutex_);
+    if (drop_frames_when_queue_full_) {
+      if (frame_queue_.size() >= max_frame_queue_size_) {
+        dropped_segments.swap(frame_queue_.front().segments);
+        frame_queue_.pop_front();
+        ++frame_queue_stats_.num_dropped_frames;
+      }
+    } else {
+      frame_queue_condition_.wait(frame_queue_lock, [this] {
+        return stop_integration_thread_ ||
+               frame_queue_.size() < max_frame_queue_size_;
+      });
+      if (stop_integration_thread_) {
+        segment_pool_.release(&frame.segments);
+        return;
+      }
+    }
+    // Read after waiting, a map reset may have happened in the meantime.
+    frame.map_reset_count = map_reset_count_;
+    frame_queue_.push_back(std::move(frame));
+    ++frame_queue_stats_.num_enqueued_frames;
+    frame_queue_stats_.max_queue_depth =
+        std::max(frame_queue_stats_.max_queue_depth, frame_queue_.size());
+  }
+  frame_queue_condition_.notify_all();
+
+  if (!dropped_segments.empty()) {
+    LOG(WARNING) << "Frame queue is full, dropping the oldest frame with "
+                 << dropped_segments.size() << " segments.";
+    segment_pool_.release(&dropped_segments);
+  }
+}
+
+void Controller::completeFrame() {
+  if (!incoming_segments_.empty()) {
+    enqueueFrame(last_segment_msg_timestamp_);
+  }
+  is_frame_completed_ = true;
+}
+
+void Controller::frameCompletionTimeoutEvent(const ros::TimerEvent& /*e*/) {
+  std::lock_guard<std::mutex> incoming_segments_lock(incoming_segments_mutex_);
+  if (!incoming_segments_.empty() &&
+      (ros::Time::now() - last_segment_receive_time_).toSec() >=
+          frame_completion_timeout_s_) {
+    LOG(INFO) << "No segment received for " << frame_completion_timeout_s_
+              << " seconds, completing the frame.";
+    completeFrame();
+  }
+}
+
+bool Controller::popQueuedFrame(SegmentFrame* frame) {
+  CHECK_NOTNULL(frame);
+  size_t queue_depth;
+  FrameQueueStats frame_queue_stats;
+  {
+    std::unique_lock<std::mutex> frame_queue_lock(frame_queue_mutex_);
+    frame_queue_condition_.wait(frame_queue_lock, [this] {
+      return stop_integration_thread_ || !frame_queue_.empty();
+    });
+    if (stop_integration_thread_) {
+      return false;
+    }
+    *frame = std::move(frame_queue_.front());
+    frame_queue_.pop_front();
+    queue_depth = frame_queue_.size();
+    frame_queue_stats = frame_queue_stats_;
+    frame_queue_stats_ = FrameQueueStats();
+  }
+  // Wakes up the subscriber callback if it waits for space in the queue.
+  frame_queue_condition_.notify_all();
+
+  LOG(INFO) << "Frame waited "
+            << (ros::WallTime::now() - frame->enqueue_time).toSec()
+            << " seconds in the frame queue. Enqueued "
+            << frame_queue_stats.num_enqueued_frames << " and dropped "
+            << frame_queue_stats.num_dropped_frames
+            << " frames since the last frame, with a maximum queue depth of "
+            << frame_queue_stats.max_queue_depth << ", " << queue_depth
+            << " frames still queued.";
+  return true;
+}
+
+void Controller::propagationLoop() {
+  while (true) {
+    SegmentFrame frame;
+    if (!popQueuedFrame(&frame)) {
+      return;
+    }
+
+    // Held until the frame is handed over, so that a map reset does not
+    // miss a frame counted from the old map.
+    std::lock_guard<std::mutex> frame_propagation_lock(
+        frame_propagation_mutex_);
     if (use_label_propagation_) {
-      integrator_->computeSegmentLabelCandidates(
-          segment, &segment_label_candidates, &segment_merge_candidates_);
+      timing::Timer group_timer("propagation/group_segment_points");
+      frame.segment_label_votes.resize(frame.segments.size());
+      for (size_t i = 0u; i < frame.segments.size(); ++i) {
+        integrator_->groupSegmentPointsByBlock(frame.segments[i],
+                                               &frame.segment_label_votes[i]);
+      }
+      group_timer.Stop();
+
+      timing::Timer count_timer("propagation/count_label_votes");
+      std::lock_guard<std::mutex> label_tsdf_layers_lock(
+          label_tsdf_layers_mutex_);
+      for (LabelTsdfIntegrator::SegmentLabelVotes& segment_votes :
+           frame.segment_label_votes) {
+        integrator_->countSegmentLabelVotes(&segment_votes);
+      }
+      count_timer.Stop();
     }
+
+    // Only the next frame is propagated ahead of integration.
+    {
+      std::unique_lock<std::mutex> frame_queue_lock(frame_queue_mutex_);
+      frame_queue_condition_.wait(frame_queue_lock, [this] {
+        return stop_integration_thread_ || propagated_frame_queue_.empty();
+      });
+      if (stop_integration_thread_) {
+        segment_pool_.release(&frame.segments);
+        return;
+      }
+      propagated_frame_queue_.push_back(std::move(frame));
+    }
+    frame_queue_condition_.notify_all();
+  }
+}
+
+void Controller::integrationLoop() {
+  while (true) {
+    SegmentFrame frame;
+    if (enable_pipelined_propagation_) {
+      {
+        std::unique_lock<std::mutex> frame_queue_lock(frame_queue_mutex_);
+        frame_queue_condition_.wait(frame_queue_lock, [this] {
+          return stop_integration_thread_ || !propagated_frame_queue_.empty();
+        });
+        if (stop_integration_thread_) {
+          return;
+        }
+        frame = std::move(propagated_frame_queue_.front());
+        propagated_frame_queue_.pop_front();
+      }
+      frame_queue_condition_.notify_all();
+    } else if (!popQueuedFrame(&frame)) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> frame_integration_lock(
+        frame_integration_mutex_);
+    bool is_frame_reset;
+    {
+      std::lock_guard<std::mutex> frame_queue_lock(frame_queue_mutex_);
+      is_frame_reset = frame.map_reset_count != map_reset_count_;
+    }
+    if (is_frame_reset) {
+      LOG(INFO) << "Discarding a frame received before the map reset.";
+      segment_pool_.release(&frame.segments);
+      continue;
+    }
+    segments_to_integrate_.swap(frame.segments);
+    segment_label_votes_.swap(frame.segment_label_votes);
+    integrateFrame(frame.timestamp);
   }
 }
 
 void Controller::integrateFrame(ros::Time msg_timestamp) {
   LOG(INFO) << "Integrating frame n." << ++integrated_frames_count_
             << ", timestamp of frame: " << msg_timestamp.toSec();
+  if (segment_downsampling_factor_ > 0.0f) {
+    size_t num_raw_points = 0u;
+    size_t num_points = 0u;
+    for (const Segment* segment : segments_to_integrate_) {
+      num_raw_points += segment->getNumRawPoints();
+      num_points += segment->points_C_.size();
+    }
+    LOG(INFO) << "Downsampled " << num_raw_points << " segment points to "
+              << num_points << ".";
+  }
   ros::WallTime start;
   ros::WallTime end;
 
   if (use_label_propagation_) {
+    timing::Timer label_candidates_timer("compute_label_candidates");
+    // Pipelined frames come with the label votes counted while the previous
+    // frame was integrated.
+    integrator_->computeFrameLabelCandidates(
+        segments_to_integrate_,
+        enable_pipelined_propagation_ ? &segment_label_votes_ : nullptr,
+        &segment_label_candidates, &segment_merge_candidates_);
+    label_candidates_timer.Stop();
+
     start = ros::WallTime::now();
     timing::Timer propagation_timer("label_propagation");
 
@@ -491,23 +981,61 @@ void Controller::integrateFrame(ros::Time msg_timestamp) {
     end = ros::WallTime::now();
     LOG(INFO) << "Decided labels for " << segments_to_integrate_.size()
               << " pointclouds in " << (end - start).toSec() << " seconds.";
+    const LabelTsdfIntegrator::LabelPropagationStats& propagation_stats =
+        integrator_->getLabelPropagationStats();
+    LOG(INFO) << "Recomputed the label candidates of "
+              << propagation_stats.num_recomputed_segments
+              << " segments, caching "
+              << propagation_stats.num_cached_voxel_votes
+              << " voxel votes and reassigning "
+              << propagation_stats.num_reassigned_voxel_votes
+              << " of them. Pushed "
+              << propagation_stats.num_heap_entries
+              << " candidate heap entries, "
+              << propagation_stats.num_outdated_heap_entries
+              << " of them were outdated. Matched "
+              << propagation_stats.num_matched_segments
+              << " segments over "
+              << propagation_stats.num_matching_edges
+              << " segment label pairs.";
+    if (propagation_stats.num_propagation_cache_lookups > 0u) {
+      LOG(INFO) << "Propagated the labels of "
+                << propagation_stats.num_propagation_cache_hits << " of "
+                << propagation_stats.num_propagation_cache_lookups
+                << " segments from the previous frame, a hit rate of "
+                << 100.0 * propagation_stats.num_propagation_cache_hits /
+                       propagation_stats.num_propagation_cache_lookups
+                << "%.";
+    }
+    if (propagation_stats.num_vote_blocks > 0u) {
+      LOG(INFO) << "Recounted the label votes of "
+                << propagation_stats.num_recounted_vote_blocks << " of "
+                << propagation_stats.num_vote_blocks
+                << " segment blocks changed since propagation.";
+    }
+    if (propagation_stats.num_counted_segments > 0u) {
+      LOG(INFO) << "Looked up " << propagation_stats.num_voxel_lookups
+                << " of the " << propagation_stats.num_counted_voxels
+                << " voxels of " << propagation_stats.num_counted_segments
+                << " segments in the map, sampling the voxels of "
+                << propagation_stats.num_sampled_segments << " of them.";
+    }
+    integrator_->resetLabelPropagationStats();
   }
 
-  constexpr bool kIsFreespacePointcloud = false;
-
   start = ros::WallTime::now();
   timing::Timer integrate_timer("integrate_frame_pointclouds");
   Transformation T_G_C = segments_to_integrate_.at(0)->T_G_C_;
-  Pointcloud point_cloud_all_segments_t;
-  for (Segment* segment : segments_to_integrate_) {
-    // Concatenate point clouds. (NOTE(ff): We should probably just use
-    // the original cloud here instead.)
-    Pointcloud::iterator it = point_cloud_all_segments_t.end();
-    point_cloud_all_segments_t.insert(it, segment->points_C_.begin(),
-                                      segment->points_C_.end());
-  }
   Transformation T_Gicp_C = T_G_C;
   if (label_tsdf_integrator_config_.enable_icp) {
+    Pointcloud point_cloud_all_segments_t;
+    for (Segment* segment : segments_to_integrate_) {
+      // Concatenate point clouds. (NOTE(ff): We should probably just use
+      // the original cloud here instead.)
+      Pointcloud::iterator it = point_cloud_all_segments_t.end();
+      point_cloud_all_segments_t.insert(it, segment->points_C_.begin(),
+                                        segment->points_C_.end());
+    }
     // TODO(ntonci): Make icp config members ros params.
     // integrator_->icp_.reset(new
     // ICP(getICPConfigFromRosParam(nh_private)));
@@ -520,12 +1048,11 @@ void Controller::integrateFrame(ros::Time msg_timestamp) {
         label_tsdf_layers_mutex_);
     for (Segment* segment : segments_to_integrate_) {
       CHECK_NOTNULL(segment);
+      // The segments are voxelized again if the refined transform differs.
       segment->T_G_C_ = T_Gicp_C;
-
-      integrator_->integratePointCloud(segment->T_G_C_, segment->points_C_,
-                                       segment->colors_, segment->label_,
-                                       kIsFreespacePointcloud);
     }
+    // All segments of the frame are integrated in a single pass.
+    integrator_->integrateFrame(T_Gicp_C, segments_to_integrate_);
   }
 
   integrate_timer.Stop();
@@ -533,16 +1060,75 @@ void Controller::integrateFrame(ros::Time msg_timestamp) {
   LOG(INFO) << "Integrated " << segments_to_integrate_.size()
             << " pointclouds in " << (end - start).toSec() << " secs. ";
 
-  LOG(INFO) << "The map contains "
-            << map_->getTsdfLayerPtr()->getNumberOfAllocatedBlocks()
-            << " tsdf and "
-            << map_->getLabelLayerPtr()->getNumberOfAllocatedBlocks()
-            << " label blocks.";
+  // Totals over the whole run, the per-frame counters below only cover the
+  // blocks allocated by this frame.
+  const size_t num_tsdf_blocks =
+      map_->getTsdfLayerPtr()->getNumberOfAllocatedBlocks();
+  const size_t num_label_blocks =
+      map_->getLabelLayerPtr()->getNumberOfAllocatedBlocks();
+  const size_t vps = map_->getLabelLayerPtr()->voxels_per_side();
+  const size_t label_block_size_bytes = vps * vps * vps * sizeof(LabelVoxel);
+  LOG(INFO) << "The map contains " << num_tsdf_blocks << " tsdf and "
+            << num_label_blocks << " label blocks, using "
+            << num_label_blocks * label_block_size_bytes / (1024.0 * 1024.0)
+            << " MB of label blocks instead of "
+            << num_tsdf_blocks * label_block_size_bytes / (1024.0 * 1024.0)
+            << " MB with a label block per tsdf block.";
+
+  const LabelTsdfIntegrator::RayTraversalStats& ray_stats =
+      integrator_->getRayTraversalStats();
+  if (ray_stats.num_rays > 0u) {
+    const float num_rays = static_cast<float>(ray_stats.num_rays);
+    LOG(INFO) << "Traversed " << ray_stats.num_rays << " rays with "
+              << ray_stats.num_steps / num_rays << " steps, "
+              << ray_stats.num_block_lookups / num_rays
+              << " block lookups and "
+              << ray_stats.num_anti_grazing_lookups / num_rays
+              << " anti-grazing lookups per ray, "
+              << ray_stats.num_anti_grazing_skips
+              << " voxels skipped by anti-grazing, "
+              << ray_stats.num_merged_clearing_steps
+              << " clearing ray voxels merged into a single update.";
+  }
+  integrator_->resetRayTraversalStats();
+
+  const LabelTsdfIntegrator::ProjectiveIntegrationStats& projective_stats =
+      integrator_->getProjectiveIntegrationStats();
+  if (projective_stats.num_frames > 0u) {
+    LOG(INFO) << "Projectively integrated " << projective_stats.num_frames
+              << " frames into " << projective_stats.num_frustum_blocks
+              << " frustum blocks out of " << projective_stats.num_box_blocks
+              << " blocks of their bounding boxes, updating "
+              << projective_stats.num_updated_voxels << " of "
+              << projective_stats.num_projected_voxels
+              << " projected voxels.";
+  }
+  integrator_->resetProjectiveIntegrationStats();
+
+  const LabelTsdfIntegrator::LabelUpdateStats& label_update_stats =
+      integrator_->getLabelUpdateStats();
+  LOG(INFO) << "Updated " << label_update_stats.num_label_updates
+            << " label voxels, skipped "
+            << label_update_stats.num_out_of_band_voxels
+            << " voxels outside the label band and "
+            << label_update_stats.num_clearing_voxels
+            << " voxels of clearing rays. Allocated "
+            << label_update_stats.num_label_blocks << " label blocks and "
+            << label_update_stats.num_tsdf_only_blocks
+            << " TSDF blocks without label block, saving "
+            << label_update_stats.num_tsdf_only_blocks *
+                   label_block_size_bytes / (1024.0 * 1024.0)
+            << " MB of label blocks.";
+  integrator_->resetLabelUpdateStats();
 
   start = ros::WallTime::now();
 
-  integrator_->mergeLabels(&merges_to_publish_);
-  integrator_->getLabelsToPublish(&segment_labels_to_publish_);
+  {
+    std::lock_guard<std::mutex> label_tsdf_layers_lock(
+        label_tsdf_layers_mutex_);
+    integrator_->mergeLabels(&merges_to_publish_);
+    integrator_->getLabelsToPublish(&segment_labels_to_publish_);
+  }
 
   end = ros::WallTime::now();
   LOG(INFO) << "Merged segments in " << (end - start).toSec() << " seconds.";
@@ -550,15 +1136,27 @@ void Controller::integrateFrame(ros::Time msg_timestamp) {
 
   segment_merge_candidates_.clear();
   segment_label_candidates.clear();
-  for (Segment* segment : segments_to_integrate_) {
-    delete segment;
-  }
-  segments_to_integrate_.clear();
+  // The candidate maps have been cleared, so the arena can be reset.
+  propagation_arena_.reset();
+  segment_pool_.release(&segments_to_integrate_);
+  segment_label_votes_.clear();
 
   end = ros::WallTime::now();
   LOG(INFO) << "Cleared candidates and memory in " << (end - start).toSec()
             << " seconds.";
 
+  const SegmentPool::Stats segment_pool_stats = segment_pool_.getStats();
+  const FrameArena::Stats& arena_stats = propagation_arena_.getStats();
+  LOG(INFO) << "Acquired " << segment_pool_stats.num_acquired_segments
+            << " segments since the last frame, "
+            << segment_pool_stats.num_allocated_segments
+            << " of them were allocated. Served "
+            << arena_stats.num_allocations
+            << " allocations of the candidate maps with "
+            << arena_stats.num_chunk_allocations << " arena chunk allocations.";
+  segment_pool_.resetStats();
+  propagation_arena_.resetStats();
+
   LOG(INFO) << "Timings: " << std::endl << timing::Timing::Print() << std::endl;
 }
 
@@ -567,24 +1165,47 @@ void Controller::segmentPointCloudCallback(
   if (!integration_on_) {
     return;
   }
+  std::lock_guard<std::mutex> incoming_segments_lock(incoming_segments_mutex_);
   // Message timestamps are used to detect when all
   // segment messages from a certain frame have arrived.
   // Since segments from the same frame all have the same timestamp,
-  // the start of a new frame is detected when the message timestamp changes.
-  // TODO(grinvalm): need additional check for the last frame to be
-  // integrated.
-  if (received_first_message_ &&
-      last_segment_msg_timestamp_ != segment_point_cloud_msg->header.stamp) {
-    if (segments_to_integrate_.size() > 0u) {
-      integrateFrame(segment_point_cloud_msg->header.stamp);
-    } else {
-      LOG(INFO) << "No segments to integrate.";
-    }
+  // the start of a new frame is detected when the message timestamp changes,
+  // unless the frame was already completed by its end of frame marker or the
+  // timeout. The complete frame is handed over to the integration thread, so
+  // the callback only converts and enqueues segments.
+  const ros::Time& msg_timestamp = segment_point_cloud_msg->header.stamp;
+  if (received_first_message_ && last_segment_msg_timestamp_ != msg_timestamp) {
+    completeFrame();
+    is_frame_completed_ = false;
+  } else if (is_frame_completed_) {
+    LOG(WARNING) << "Received a segment of a completed frame, it is "
+                    "integrated as a separate frame.";
+    is_frame_completed_ = false;
   }
   received_first_message_ = true;
-  last_segment_msg_timestamp_ = segment_point_cloud_msg->header.stamp;
+  last_segment_msg_timestamp_ = msg_timestamp;
+
+  if (use_end_of_frame_marker_ &&
+      segment_point_cloud_msg->width * segment_point_cloud_msg->height == 0u) {
+    completeFrame();
+  } else {
+    processSegment(segment_point_cloud_msg);
+  }
+  last_segment_receive_time_ = ros::Time::now();
+}
 
-  processSegment(segment_point_cloud_msg);
+void Controller::framePointCloudCallback(
+    const sensor_msgs::PointCloud2::Ptr& frame_point_cloud_msg) {
+  if (!integration_on_) {
+    return;
+  }
+  std::lock_guard<std::mutex> incoming_segments_lock(incoming_segments_mutex_);
+  received_first_message_ = true;
+  last_segment_msg_timestamp_ = frame_point_cloud_msg->header.stamp;
+  processFrame(frame_point_cloud_msg);
+  // Every message holds a complete frame.
+  completeFrame();
+  last_segment_receive_time_ = ros::Time::now();
 }
 
 void Controller::resetMeshIntegrators() {
@@ -614,12 +1235,32 @@ void Controller::resetMeshIntegrators() {
   }
 }
 
-// TODO(margaritaG): this is not thread safe wrt segmentPointCloudCallback yet.
 bool Controller::resetMapCallback(std_srvs::Empty::Request& /*request*/,
                                   std_srvs::Empty::Response& /*request*/) {
+  // Wait for the frames being propagated and integrated to finish, then
+  // discard the frames that are still queued.
+  std::lock_guard<std::mutex> frame_propagation_lock(
+      frame_propagation_mutex_);
+  std::lock_guard<std::mutex> frame_integration_lock(
+      frame_integration_mutex_);
+  std::vector<Segment*> queued_segments;
+  {
+    std::lock_guard<std::mutex> frame_queue_lock(frame_queue_mutex_);
+    ++map_reset_count_;
+    for (std::deque<SegmentFrame>* queue :
+         {&frame_queue_, &propagated_frame_queue_}) {
+      for (SegmentFrame& frame : *queue) {
+        queued_segments.insert(queued_segments.end(), frame.segments.begin(),
+                               frame.segments.end());
+      }
+      queue->clear();
+    }
+  }
+  frame_queue_condition_.notify_all();
+  segment_pool_.release(&queued_segments);
+
   // Reset counters and flags.
   integrated_frames_count_ = 0u;
-  received_first_message_ = false;
   {
     std::lock_guard<std::mutex> label_tsdf_layers_lock(
         label_tsdf_layers_mutex_);
@@ -641,13 +1282,11 @@ bool Controller::resetMapCallback(std_srvs::Empty::Request& /*request*/,
     need_full_remesh_ = true;
   }
 
-  // Clear segments to be integrated from the last frame.
-  segment_merge_candidates_.clear();
-  segment_label_candidates.clear();
-  for (Segment* segment : segments_to_integrate_) {
-    delete segment;
-  }
-  segments_to_integrate_.clear();
+  // Clear segments received for the current frame.
+  std::lock_guard<std::mutex> incoming_segments_lock(incoming_segments_mutex_);
+  received_first_message_ = false;
+  is_frame_completed_ = false;
+  segment_pool_.release(&incoming_segments_);
 
   return true;
 }
@@ -0,0 +1,270 @@
+// Copyright (c) 2019, ASL, ETH Zurich, Switzerland
+// Licensed under the BSD 3-Clause License (see LICENSE for details)
+
+#include "global_segment_map_node/point_cloud_reader.h"
+
+#include <cstring>
+#include <unordered_map>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <glog/logging.h>
+
+namespace voxblox {
+namespace voxblox_gsm {
+
+namespace {
+
+// Exponent bits of a float, all set for infinities and NaNs.
+constexpr uint32_t kFloatExponentMask = 0x7f800000u;
+
+inline uint32_t readUint32(const uint8_t* data) {
+  uint32_t value;
+  std::memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+inline float readFloat(const uint8_t* data) {
+  float value;
+  std::memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+// Size in bytes of a PointField datatype, 0 if unknown.
+inline size_t getDatatypeSize(const uint8_t datatype) {
+  switch (datatype) {
+    case sensor_msgs::PointField::INT8:
+    case sensor_msgs::PointField::UINT8:
+      return 1u;
+    case sensor_msgs::PointField::INT16:
+    case sensor_msgs::PointField::UINT16:
+      return 2u;
+    case sensor_msgs::PointField::INT32:
+    case sensor_msgs::PointField::UINT32:
+    case sensor_msgs::PointField::FLOAT32:
+      return 4u;
+    case sensor_msgs::PointField::FLOAT64:
+      return 8u;
+    default:
+      return 0u;
+  }
+}
+
+}  // namespace
+
+PointCloudReader::PointCloudReader(
+    const sensor_msgs::PointCloud2& point_cloud_msg)
+    : point_cloud_msg_(point_cloud_msg),
+      is_valid_(false),
+      has_packed_coordinates_(false) {
+  x_field_ = getField("x");
+  y_field_ = getField("y");
+  z_field_ = getField("z");
+  rgb_field_ = getField("rgb");
+  if (!rgb_field_.is_present) {
+    rgb_field_ = getField("rgba");
+  }
+  label_field_ = getField("label");
+  instance_label_field_ = getField("instance_label");
+  semantic_label_field_ = getField("semantic_label");
+
+  for (const Field* field : {&x_field_, &y_field_, &z_field_}) {
+    if (!field->is_present ||
+        field->datatype != sensor_msgs::PointField::FLOAT32 ||
+        !isFieldInPoint(*field)) {
+      return;
+    }
+  }
+  // The color is packed into a float or an unsigned integer.
+  if (rgb_field_.is_present &&
+      (getDatatypeSize(rgb_field_.datatype) != 4u ||
+       !isFieldInPoint(rgb_field_))) {
+    return;
+  }
+  // Label fields wider than the labels they are read into would be
+  // truncated.
+  const std::pair<const Field*, size_t> label_fields[] = {
+      {&label_field_, sizeof(uint32_t)},
+      {&instance_label_field_, sizeof(InstanceLabel)},
+      {&semantic_label_field_, sizeof(SemanticLabel)}};
+  for (const std::pair<const Field*, size_t>& label_field : label_fields) {
+    const Field& field = *label_field.first;
+    if (field.is_present &&
+        (field.datatype == sensor_msgs::PointField::FLOAT32 ||
+         field.datatype == sensor_msgs::PointField::FLOAT64 ||
+         getDatatypeSize(field.datatype) == 0u ||
+         getDatatypeSize(field.datatype) > label_field.second ||
+         !isFieldInPoint(field))) {
+      return;
+    }
+  }
+  // Computed in size_t, the product of the 32 bit message sizes can
+  // overflow 32 bits.
+  const size_t point_step = point_cloud_msg_.point_step;
+  const size_t row_step = point_cloud_msg_.row_step;
+  const size_t width = point_cloud_msg_.width;
+  const size_t height = point_cloud_msg_.height;
+  if (point_cloud_msg_.is_bigendian || row_step < width * point_step ||
+      point_cloud_msg_.data.size() < height * row_step) {
+    return;
+  }
+  is_valid_ = true;
+  has_packed_coordinates_ = y_field_.offset == x_field_.offset + 4u &&
+                            z_field_.offset == x_field_.offset + 8u &&
+                            x_field_.offset + 16u <= point_step;
+}
+
+PointCloudReader::Field PointCloudReader::getField(
+    const std::string& name) const {
+  Field field;
+  for (const sensor_msgs::PointField& point_field : point_cloud_msg_.fields) {
+    if (point_field.name == name) {
+      field.is_present = true;
+      field.offset = point_field.offset;
+      field.datatype = point_field.datatype;
+      break;
+    }
+  }
+  return field;
+}
+
+bool PointCloudReader::isFieldInPoint(const Field& field) const {
+  const size_t size = getDatatypeSize(field.datatype);
+  return size > 0u && field.offset + size <= point_cloud_msg_.point_step;
+}
+
+uint32_t PointCloudReader::readLabelField(const uint8_t* point,
+                                          const Field& field) const {
+  if (!field.is_present) {
+    return 0u;
+  }
+  const uint8_t* data = point + field.offset;
+  switch (field.datatype) {
+    case sensor_msgs::PointField::INT8:
+    case sensor_msgs::PointField::UINT8:
+      return *data;
+    case sensor_msgs::PointField::INT16:
+    case sensor_msgs::PointField::UINT16: {
+      uint16_t value;
+      std::memcpy(&value, data, sizeof(value));
+      return value;
+    }
+    case sensor_msgs::PointField::INT32:
+    case sensor_msgs::PointField::UINT32:
+      return readUint32(data);
+    default:
+      LOG(FATAL) << "Unsupported label field datatype "
+                 << static_cast<int>(field.datatype) << ".";
+      return 0u;
+  }
+}
+
+bool PointCloudReader::isFinitePoint(const uint8_t* point) const {
+#if defined(__SSE2__)
+  if (has_packed_coordinates_) {
+    // Checks the exponents of x, y and z at once, the fourth lane holds
+    // whatever follows z and is ignored.
+    const __m128i exponent_mask =
+        _mm_set1_epi32(static_cast<int>(kFloatExponentMask));
+    const __m128i coordinates = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(point + x_field_.offset));
+    const __m128i is_not_finite = _mm_cmpeq_epi32(
+        _mm_and_si128(coordinates, exponent_mask), exponent_mask);
+    return (_mm_movemask_ps(_mm_castsi128_ps(is_not_finite)) & 0x7) == 0;
+  }
+#endif
+  return (readUint32(point + x_field_.offset) & kFloatExponentMask) !=
+             kFloatExponentMask &&
+         (readUint32(point + y_field_.offset) & kFloatExponentMask) !=
+             kFloatExponentMask &&
+         (readUint32(point + z_field_.offset) & kFloatExponentMask) !=
+             kFloatExponentMask;
+}
+
+void PointCloudReader::appendPoint(const uint8_t* point,
+                                   Segment* segment) const {
+  segment->points_C_.emplace_back(readFloat(point + x_field_.offset),
+                                  readFloat(point + y_field_.offset),
+                                  readFloat(point + z_field_.offset));
+  if (!rgb_field_.is_present) {
+    segment->colors_.emplace_back(0u, 0u, 0u, 255u);
+    return;
+  }
+  // Same byte order as the rgba union of the PCL point types.
+  const uint8_t* rgba = point + rgb_field_.offset;
+  segment->colors_.emplace_back(rgba[2], rgba[1], rgba[0], rgba[3]);
+}
+
+Segment* PointCloudReader::readSegment(const Transformation& T_G_C,
+                                       SegmentPool* segment_pool) const {
+  CHECK(is_valid_);
+  CHECK_NOTNULL(segment_pool);
+  const size_t num_points = static_cast<size_t>(point_cloud_msg_.width) *
+                            point_cloud_msg_.height;
+  Label label = 0u;
+  SemanticLabel semantic_label = 0u;
+  InstanceLabel instance_label = 0u;
+  if (num_points > 0u) {
+    const uint8_t* first_point = getPoint(0u, 0u);
+    label = readLabelField(first_point, label_field_);
+    semantic_label = readLabelField(first_point, semantic_label_field_);
+    instance_label = readLabelField(first_point, instance_label_field_);
+  }
+
+  Segment* segment =
+      segment_pool->acquire(T_G_C, label, semantic_label, instance_label);
+  segment->points_C_.reserve(num_points);
+  segment->colors_.reserve(num_points);
+  for (size_t row = 0u; row < point_cloud_msg_.height; ++row) {
+    for (size_t col = 0u; col < point_cloud_msg_.width; ++col) {
+      const uint8_t* point = getPoint(row, col);
+      if (isFinitePoint(point)) {
+        appendPoint(point, segment);
+      }
+    }
+  }
+  return segment;
+}
+
+void PointCloudReader::splitFrame(const Transformation& T_G_C,
+                                  const bool split_by_instance,
+                                  SegmentPool* segment_pool,
+                                  std::vector<Segment*>* segments) const {
+  CHECK(is_valid_);
+  CHECK_NOTNULL(segment_pool);
+  CHECK_NOTNULL(segments);
+  std::unordered_map<uint32_t, Segment*> segments_by_label;
+  uint32_t last_label = 0u;
+  Segment* segment = nullptr;
+  for (size_t row = 0u; row < point_cloud_msg_.height; ++row) {
+    for (size_t col = 0u; col < point_cloud_msg_.width; ++col) {
+      const uint8_t* point = getPoint(row, col);
+      if (!isFinitePoint(point)) {
+        continue;
+      }
+      const uint32_t label = readLabelField(point, label_field_);
+      if (segment == nullptr || label != last_label) {
+        Segment*& label_segment = segments_by_label[label];
+        if (label_segment == nullptr) {
+          label_segment =
+              split_by_instance
+                  ? segment_pool->acquire(
+                        T_G_C, 0u,
+                        readLabelField(point, semantic_label_field_),
+                        readLabelField(point, instance_label_field_))
+                  : segment_pool->acquire(T_G_C, label, 0u, 0u);
+          segments->push_back(label_segment);
+        }
+        segment = label_segment;
+        last_label = label;
+      }
+      appendPoint(point, segment);
+    }
+  }
+}
+
+}  // namespace voxblox_gsm
+}  // namespace voxblox
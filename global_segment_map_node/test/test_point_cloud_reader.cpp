@@ -0,0 +1,361 @@
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <global_segment_map/common.h>
+#include <global_segment_map/segment.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <pcl_conversions/pcl_conversions.h>
+#include <sensor_msgs/PointCloud2.h>
+
+#include "global_segment_map_node/point_cloud_reader.h"
+
+using namespace voxblox;               // NOLINT
+using namespace voxblox::voxblox_gsm;  // NOLINT
+
+namespace {
+
+// Layout of the test messages, with a gap after z and the color and label
+// fields in the order PCL uses for PointLabelType.
+constexpr uint32_t kXOffset = 0u;
+constexpr uint32_t kRgbOffset = 16u;
+constexpr uint32_t kLabelOffset = 20u;
+constexpr uint32_t kPointStep = 24u;
+// Layout of the semantic test messages, with a 2 byte instance and a 1 byte
+// semantic label after the label.
+constexpr uint32_t kInstanceLabelOffset = 24u;
+constexpr uint32_t kSemanticLabelOffset = 26u;
+constexpr uint32_t kSemanticPointStep = 28u;
+
+struct TestPoint {
+  float x;
+  float y;
+  float z;
+  uint8_t r;
+  uint8_t g;
+  uint8_t b;
+  uint32_t label;
+};
+
+sensor_msgs::PointField makeField(const std::string& name,
+                                  const uint32_t offset,
+                                  const uint8_t datatype) {
+  sensor_msgs::PointField field;
+  field.name = name;
+  field.offset = offset;
+  field.datatype = datatype;
+  field.count = 1u;
+  return field;
+}
+
+sensor_msgs::PointCloud2 makeMessage(const std::vector<TestPoint>& points) {
+  sensor_msgs::PointCloud2 msg;
+  msg.height = 1u;
+  msg.width = points.size();
+  msg.fields = {
+      makeField("x", kXOffset, sensor_msgs::PointField::FLOAT32),
+      makeField("y", kXOffset + 4u, sensor_msgs::PointField::FLOAT32),
+      makeField("z", kXOffset + 8u, sensor_msgs::PointField::FLOAT32),
+      makeField("rgb", kRgbOffset, sensor_msgs::PointField::FLOAT32),
+      makeField("label", kLabelOffset, sensor_msgs::PointField::UINT32)};
+  msg.is_bigendian = false;
+  msg.point_step = kPointStep;
+  msg.row_step = msg.width * msg.point_step;
+  msg.data.assign(msg.height * msg.row_step, 0u);
+  for (size_t i = 0u; i < points.size(); ++i) {
+    uint8_t* point = &msg.data[i * kPointStep];
+    const TestPoint& test_point = points[i];
+    std::memcpy(point + kXOffset, &test_point.x, sizeof(float));
+    std::memcpy(point + kXOffset + 4u, &test_point.y, sizeof(float));
+    std::memcpy(point + kXOffset + 8u, &test_point.z, sizeof(float));
+    // Same byte order as the rgba union of the PCL point types.
+    const uint8_t bgra[4] = {test_point.b, test_point.g, test_point.r, 255u};
+    std::memcpy(point + kRgbOffset, bgra, sizeof(bgra));
+    std::memcpy(point + kLabelOffset, &test_point.label, sizeof(uint32_t));
+  }
+  msg.is_dense = true;
+  return msg;
+}
+
+sensor_msgs::PointCloud2 makeSemanticMessage(
+    const std::vector<TestPoint>& points,
+    const std::vector<InstanceLabel>& instance_labels,
+    const std::vector<SemanticLabel>& semantic_labels) {
+  const sensor_msgs::PointCloud2 label_msg = makeMessage(points);
+  sensor_msgs::PointCloud2 msg = label_msg;
+  msg.fields.push_back(makeField("instance_label", kInstanceLabelOffset,
+                                 sensor_msgs::PointField::UINT16));
+  msg.fields.push_back(makeField("semantic_label", kSemanticLabelOffset,
+                                 sensor_msgs::PointField::UINT8));
+  msg.point_step = kSemanticPointStep;
+  msg.row_step = msg.width * msg.point_step;
+  msg.data.assign(msg.height * msg.row_step, 0u);
+  for (size_t i = 0u; i < points.size(); ++i) {
+    uint8_t* point = &msg.data[i * kSemanticPointStep];
+    std::memcpy(point, &label_msg.data[i * kPointStep], kPointStep);
+    std::memcpy(point + kInstanceLabelOffset, &instance_labels[i],
+                sizeof(InstanceLabel));
+    std::memcpy(point + kSemanticLabelOffset, &semantic_labels[i],
+                sizeof(SemanticLabel));
+  }
+  return msg;
+}
+
+std::vector<TestPoint> makeTestPoints(const size_t num_points,
+                                      const uint32_t num_labels) {
+  std::vector<TestPoint> points(num_points);
+  for (size_t i = 0u; i < num_points; ++i) {
+    TestPoint& point = points[i];
+    point.x = 0.01f * i;
+    point.y = -0.02f * i;
+    point.z = 1.0f + 0.001f * i;
+    point.r = i % 256u;
+    point.g = (3u * i) % 256u;
+    point.b = (7u * i) % 256u;
+    // Runs of points with the same label, like a rendered segmentation.
+    point.label = (i / 16u) % num_labels + 1u;
+  }
+  return points;
+}
+
+void expectSameSegments(const std::vector<Segment*>& segments,
+                        const std::vector<Segment*>& expected_segments) {
+  ASSERT_EQ(segments.size(), expected_segments.size());
+  for (size_t i = 0u; i < segments.size(); ++i) {
+    const Segment& segment = *segments[i];
+    const Segment& expected_segment = *expected_segments[i];
+    EXPECT_EQ(segment.label_, expected_segment.label_);
+    EXPECT_EQ(segment.semantic_label_, expected_segment.semantic_label_);
+    EXPECT_EQ(segment.instance_label_, expected_segment.instance_label_);
+    ASSERT_EQ(segment.points_C_.size(), expected_segment.points_C_.size());
+    ASSERT_EQ(segment.colors_.size(), expected_segment.colors_.size());
+    for (size_t j = 0u; j < segment.points_C_.size(); ++j) {
+      EXPECT_EQ(segment.points_C_[j], expected_segment.points_C_[j]);
+      EXPECT_EQ(segment.colors_[j].r, expected_segment.colors_[j].r);
+      EXPECT_EQ(segment.colors_[j].g, expected_segment.colors_[j].g);
+      EXPECT_EQ(segment.colors_[j].b, expected_segment.colors_[j].b);
+    }
+  }
+}
+
+}  // namespace
+
+TEST(PointCloudReaderTest, ReadsSegment) {
+  const std::vector<TestPoint> points = makeTestPoints(100u, 1u);
+  const sensor_msgs::PointCloud2 msg = makeMessage(points);
+  const PointCloudReader reader(msg);
+  ASSERT_TRUE(reader.isValid());
+
+  SegmentPool segment_pool;
+  Segment* segment = reader.readSegment(Transformation(), &segment_pool);
+  EXPECT_EQ(segment->label_, 1u);
+  ASSERT_EQ(segment->points_C_.size(), points.size());
+  ASSERT_EQ(segment->colors_.size(), points.size());
+  for (size_t i = 0u; i < points.size(); ++i) {
+    EXPECT_EQ(segment->points_C_[i], Point(points[i].x, points[i].y,
+                                           points[i].z));
+    EXPECT_EQ(segment->colors_[i].r, points[i].r);
+    EXPECT_EQ(segment->colors_[i].g, points[i].g);
+    EXPECT_EQ(segment->colors_[i].b, points[i].b);
+  }
+  segment_pool.release(segment);
+}
+
+TEST(PointCloudReaderTest, SkipsNonFinitePoints) {
+  std::vector<TestPoint> points = makeTestPoints(10u, 1u);
+  points[2].x = std::numeric_limits<float>::quiet_NaN();
+  points[5].y = std::numeric_limits<float>::infinity();
+  points[7].z = -std::numeric_limits<float>::infinity();
+  const sensor_msgs::PointCloud2 msg = makeMessage(points);
+  const PointCloudReader reader(msg);
+  ASSERT_TRUE(reader.isValid());
+
+  SegmentPool segment_pool;
+  Segment* segment = reader.readSegment(Transformation(), &segment_pool);
+  EXPECT_EQ(segment->points_C_.size(), 7u);
+  segment_pool.release(segment);
+}
+
+TEST(PointCloudReaderTest, SplitsFrameByLabel) {
+  const std::vector<TestPoint> points = makeTestPoints(160u, 3u);
+  const sensor_msgs::PointCloud2 msg = makeMessage(points);
+  const PointCloudReader reader(msg);
+  ASSERT_TRUE(reader.isValid());
+
+  SegmentPool segment_pool;
+  std::vector<Segment*> segments;
+  reader.splitFrame(Transformation(), false, &segment_pool, &segments);
+  // Segments in the order their label first appears.
+  ASSERT_EQ(segments.size(), 3u);
+  size_t num_points = 0u;
+  for (size_t i = 0u; i < segments.size(); ++i) {
+    EXPECT_EQ(segments[i]->label_, i + 1u);
+    num_points += segments[i]->points_C_.size();
+  }
+  EXPECT_EQ(num_points, points.size());
+  segment_pool.release(&segments);
+}
+
+// Segments sharing an instance and semantic label pair, like the background
+// segments, are kept apart, and instance labels above 255 are kept.
+TEST(PointCloudReaderTest, SplitsSemanticFrameByLabel) {
+  const std::vector<TestPoint> points = makeTestPoints(160u, 4u);
+  std::vector<InstanceLabel> instance_labels(points.size(), 0u);
+  std::vector<SemanticLabel> semantic_labels(points.size(), 0u);
+  for (size_t i = 0u; i < points.size(); ++i) {
+    if (points[i].label == 3u) {
+      instance_labels[i] = 300u;
+      semantic_labels[i] = 5u;
+    } else if (points[i].label == 4u) {
+      instance_labels[i] = 44u;
+      semantic_labels[i] = 5u;
+    }
+  }
+  const sensor_msgs::PointCloud2 msg =
+      makeSemanticMessage(points, instance_labels, semantic_labels);
+  const PointCloudReader reader(msg);
+  ASSERT_TRUE(reader.isValid());
+
+  SegmentPool segment_pool;
+  std::vector<Segment*> segments;
+  reader.splitFrame(Transformation(), true, &segment_pool, &segments);
+  ASSERT_EQ(segments.size(), 4u);
+  const InstanceLabel expected_instance_labels[] = {0u, 0u, 300u, 44u};
+  const SemanticLabel expected_semantic_labels[] = {0u, 0u, 5u, 5u};
+  size_t num_points = 0u;
+  for (size_t i = 0u; i < segments.size(); ++i) {
+    EXPECT_EQ(segments[i]->label_, 0u);
+    EXPECT_EQ(segments[i]->instance_label_, expected_instance_labels[i]);
+    EXPECT_EQ(segments[i]->semantic_label_, expected_semantic_labels[i]);
+    num_points += segments[i]->points_C_.size();
+  }
+  EXPECT_EQ(num_points, points.size());
+  segment_pool.release(&segments);
+}
+
+TEST(PointCloudReaderTest, RejectsFieldOutsidePoint) {
+  sensor_msgs::PointCloud2 msg = makeMessage(makeTestPoints(10u, 1u));
+  msg.fields.back().offset = kPointStep - 2u;
+  EXPECT_FALSE(PointCloudReader(msg).isValid());
+
+  msg = makeMessage(makeTestPoints(10u, 1u));
+  msg.fields[3].offset = kPointStep;
+  EXPECT_FALSE(PointCloudReader(msg).isValid());
+
+  msg = makeMessage(makeTestPoints(10u, 1u));
+  msg.fields[2].offset = std::numeric_limits<uint32_t>::max();
+  EXPECT_FALSE(PointCloudReader(msg).isValid());
+}
+
+TEST(PointCloudReaderTest, RejectsUnsupportedFields) {
+  sensor_msgs::PointCloud2 msg = makeMessage(makeTestPoints(10u, 1u));
+  msg.fields.back().datatype = sensor_msgs::PointField::FLOAT32;
+  EXPECT_FALSE(PointCloudReader(msg).isValid());
+
+  msg = makeMessage(makeTestPoints(10u, 1u));
+  msg.fields[3].datatype = sensor_msgs::PointField::UINT16;
+  EXPECT_FALSE(PointCloudReader(msg).isValid());
+
+  msg = makeMessage(makeTestPoints(10u, 1u));
+  msg.fields[0].datatype = sensor_msgs::PointField::FLOAT64;
+  EXPECT_FALSE(PointCloudReader(msg).isValid());
+
+  msg = makeMessage(makeTestPoints(10u, 1u));
+  msg.is_bigendian = true;
+  EXPECT_FALSE(PointCloudReader(msg).isValid());
+}
+
+TEST(PointCloudReaderTest, RejectsLabelFieldsWiderThanLabels) {
+  const std::vector<TestPoint> points = makeTestPoints(10u, 1u);
+  const std::vector<InstanceLabel> instance_labels(points.size(), 0u);
+  const std::vector<SemanticLabel> semantic_labels(points.size(), 0u);
+  sensor_msgs::PointCloud2 msg =
+      makeSemanticMessage(points, instance_labels, semantic_labels);
+  EXPECT_TRUE(PointCloudReader(msg).isValid());
+
+  msg.fields[5].datatype = sensor_msgs::PointField::UINT32;
+  EXPECT_FALSE(PointCloudReader(msg).isValid());
+
+  msg = makeSemanticMessage(points, instance_labels, semantic_labels);
+  msg.fields[6].datatype = sensor_msgs::PointField::UINT16;
+  EXPECT_FALSE(PointCloudReader(msg).isValid());
+}
+
+TEST(PointCloudReaderTest, RejectsTruncatedData) {
+  sensor_msgs::PointCloud2 msg = makeMessage(makeTestPoints(10u, 1u));
+  msg.data.pop_back();
+  EXPECT_FALSE(PointCloudReader(msg).isValid());
+
+  msg = makeMessage(makeTestPoints(10u, 1u));
+  msg.row_step -= 1u;
+  EXPECT_FALSE(PointCloudReader(msg).isValid());
+
+  // Sizes whose products overflow 32 bits.
+  msg = makeMessage(makeTestPoints(10u, 1u));
+  msg.width = 1u << 30u;
+  msg.row_step = 0u;
+  EXPECT_FALSE(PointCloudReader(msg).isValid());
+
+  msg = makeMessage(makeTestPoints(10u, 1u));
+  msg.height = 1u << 30u;
+  msg.row_step = 16u;
+  msg.width = 0u;
+  EXPECT_FALSE(PointCloudReader(msg).isValid());
+}
+
+// Compares the reader with the PCL conversion it replaces and logs the time
+// of both on a large frame.
+TEST(PointCloudReaderTest, MatchesAndBenchmarksPclConversion) {
+  constexpr size_t kNumPoints = 640u * 480u;
+  constexpr size_t kNumRepetitions = 20u;
+  const sensor_msgs::PointCloud2 msg =
+      makeMessage(makeTestPoints(kNumPoints, 50u));
+  const Transformation T_G_C;
+  SegmentPool segment_pool;
+
+  std::vector<Segment*> reader_segments;
+  std::vector<Segment*> pcl_segments;
+  double reader_time_s = 0.0;
+  double pcl_time_s = 0.0;
+  for (size_t i = 0u; i < kNumRepetitions; ++i) {
+    segment_pool.release(&reader_segments);
+    segment_pool.release(&pcl_segments);
+
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    const PointCloudReader reader(msg);
+    ASSERT_TRUE(reader.isValid());
+    reader.splitFrame(T_G_C, false, &segment_pool, &reader_segments);
+    reader_time_s += std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+
+    start = std::chrono::steady_clock::now();
+    pcl::PointCloud<PointLabelType> point_cloud;
+    pcl::fromROSMsg(msg, point_cloud);
+    splitFramePointCloud(point_cloud, T_G_C, &segment_pool, &pcl_segments);
+    pcl_time_s += std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+  }
+  expectSameSegments(reader_segments, pcl_segments);
+
+  LOG(INFO) << "Split a frame of " << kNumPoints << " points in "
+            << 1000.0 * reader_time_s / kNumRepetitions
+            << " ms with the point cloud reader and in "
+            << 1000.0 * pcl_time_s / kNumRepetitions
+            << " ms with the PCL conversion.";
+  segment_pool.release(&reader_segments);
+  segment_pool.release(&pcl_segments);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_alsologtostderr = true;
+  return RUN_ALL_TESTS();
+}